@@ -0,0 +1,570 @@
+#pragma once
+
+#include "Model.hpp"
+#include "Ray.hpp"
+#include "TriangleKernel.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <thread>
+#include <vector>
+
+struct AABB
+{
+    glm::vec3 bmin = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 bmax = glm::vec3(-std::numeric_limits<float>::max());
+
+    void grow(const glm::vec3& p) {
+        bmin = glm::min(bmin, p);
+        bmax = glm::max(bmax, p);
+    }
+    void grow(const AABB& b) {
+        bmin = glm::min(bmin, b.bmin);
+        bmax = glm::max(bmax, b.bmax);
+    }
+    float area() const {
+        if (bmin.x > bmax.x)
+            return 0.f;
+        glm::vec3 e = bmax - bmin;
+        return e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+};
+
+// 32 bytes, two nodes per cache line.
+// Interior nodes store the index of their left child (the right one is leftFirst + 1),
+// leaves store the first triangle of their range.
+struct BVHNode
+{
+    glm::vec3 bmin;
+    uint32_t leftFirst;
+    glm::vec3 bmax;
+    uint32_t count;
+
+    bool isLeaf() const { return count > 0; }
+};
+
+struct TriangleHit
+{
+    float t = std::numeric_limits<float>::max();
+    glm::vec2 bary = glm::vec2(0.f); // Weights of the second and third vertex
+    uint32_t prim = 0;     // Triangle index inside the BVH
+    uint32_t triangle = 0; // Triangle index inside its mesh
+    uint32_t mesh = 0;
+    glm::vec3 point = glm::vec3(0.f);
+    glm::vec3 normal = glm::vec3(0.f);
+};
+
+struct PointHit
+{
+    float distance = std::numeric_limits<float>::max();
+    glm::vec3 point = glm::vec3(0.f);
+    uint32_t prim = 0; // Triangle index inside the BVH
+    TriangleFeature feature = TriangleFeature::Face; // Corner, edge or inside of prim
+};
+
+// A surface crossed by a ray
+struct Crossing
+{
+    float t;
+    uint64_t id;   // Triangle index for BVH queries, rewritten by the callers that know more
+    bool entering; // The ray goes from the outside to the inside of the surface
+};
+
+// Keeps the maxHits nearest crossings in a max-heap. Once full, limit() drops to the farthest kept
+// crossing so that traversals can skip everything behind it.
+class CrossingCollector
+{
+public:
+    explicit CrossingCollector(int maxHits, float tMax = std::numeric_limits<float>::max())
+        : maxHits(size_t(std::max(1, maxHits))), tMax(tMax)
+    {};
+
+    float limit() const {
+        return heap.size() < maxHits ? tMax : heap.front().t;
+    }
+    void add(float t, uint64_t id, bool entering) {
+        if (t >= limit())
+            return;
+        if (heap.size() == maxHits) {
+            std::pop_heap(heap.begin(), heap.end(), closer);
+            heap.pop_back();
+        }
+        heap.push_back({ t, id, entering });
+        std::push_heap(heap.begin(), heap.end(), closer);
+    }
+    std::vector<Crossing>& sorted() {
+        std::sort_heap(heap.begin(), heap.end(), closer);
+        return heap;
+    }
+
+private:
+    size_t maxHits;
+    float tMax;
+    std::vector<Crossing> heap;
+
+    static bool closer(const Crossing& a, const Crossing& b) { return a.t < b.t; }
+};
+
+class BVH
+{
+public:
+    static const int BINS = 16;
+    static const uint32_t MAX_LEAF_SIZE = 8; // One AVX2 iteration of the triangle kernel
+    static const uint32_t PARALLEL_THRESHOLD = 4096; // Below this many triangles a subtree is built on the current thread
+    static const uint32_t MAX_DEPTH = 64; // Deeper ranges stay leaves, whatever their size, so traversal stacks are bounded
+
+    std::vector<BVHNode> nodes;
+    // Triangles sorted so that every leaf references a contiguous range
+    TriangleSoA triangles;
+    std::vector<uint32_t> meshIds;
+    std::vector<uint32_t> triangleIds;
+    std::vector<uint32_t> sourcePrims; // Triangle in model order (id pass primitive id) -> sorted triangle
+    std::vector<uint32_t> meshBase;    // First model order triangle of every mesh
+    TriangleKernel kernel = selectTriangleKernel(); // Leaf intersection routine, picked from the CPU features
+
+    BVH() {};
+
+    void build(const Model& model);
+    bool intersect(const Ray& ray, TriangleHit& hit) const;
+    void intersectAll(const Ray& ray, CrossingCollector& collector, uint64_t idBase = 0, bool flipped = false) const;
+    bool closestPoint(const glm::vec3& p, float maxDist, PointHit& hit) const;
+
+    uint32_t size() const { return uint32_t(meshIds.size()); }
+    uint32_t primitive(uint32_t mesh, uint32_t triangle) const { return sourcePrims[meshBase[mesh] + triangle]; }
+    AABB bounds() const;
+
+private:
+    struct Bin
+    {
+        AABB bounds;
+        uint32_t count = 0;
+    };
+
+    // Build time only
+    std::vector<AABB> primBounds;
+    std::vector<glm::vec3> centroids;
+    std::vector<uint32_t> primIndices;
+
+    void subdivide(uint32_t nodeIdx, uint32_t first, uint32_t count, uint32_t depth, std::atomic<uint32_t>& nodesUsed);
+    void computeBounds(uint32_t first, uint32_t count, AABB& bounds, AABB& centroidBounds) const;
+    void binCentroids(uint32_t first, uint32_t count, const AABB& centroidBounds, Bin bins[3][BINS]) const;
+    float intersectAABB(const Ray& ray, const glm::vec3& invDir, const BVHNode& node, float tMax) const;
+    static float distance2(const glm::vec3& p, const BVHNode& node);
+};
+
+
+void BVH::build(const Model& model)
+{
+    nodes.clear();
+    triangles.resize(0);
+    meshIds.clear();
+    triangleIds.clear();
+    sourcePrims.clear();
+    meshBase.clear();
+
+    std::vector<glm::vec3> unsorted;
+    std::vector<uint32_t> unsortedMesh;
+    std::vector<uint32_t> unsortedTriangle;
+    const auto& meshes = model.getMeshes();
+    for (uint32_t m = 0; m < meshes.size(); m++) {
+        const Mesh& mesh = meshes[m];
+        meshBase.push_back(uint32_t(unsortedMesh.size()));
+        for (uint32_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+            unsorted.push_back(mesh.vertices[mesh.indices[i]].Position);
+            unsorted.push_back(mesh.vertices[mesh.indices[i + 1]].Position);
+            unsorted.push_back(mesh.vertices[mesh.indices[i + 2]].Position);
+            unsortedMesh.push_back(m);
+            unsortedTriangle.push_back(i / 3);
+        }
+    }
+
+    auto N = uint32_t(unsortedMesh.size());
+    if (N == 0)
+        return;
+
+    primBounds.resize(N);
+    centroids.resize(N);
+    primIndices.resize(N);
+    for (uint32_t i = 0; i < N; i++) {
+        AABB b;
+        b.grow(unsorted[3 * i]);
+        b.grow(unsorted[3 * i + 1]);
+        b.grow(unsorted[3 * i + 2]);
+        primBounds[i] = b;
+        centroids[i] = (b.bmin + b.bmax) * 0.5f;
+        primIndices[i] = i;
+    }
+
+    // A binary tree over N leaves never needs more than 2N - 1 nodes
+    nodes.resize(2 * N);
+    std::atomic<uint32_t> nodesUsed(1);
+    subdivide(0, 0, N, 0, nodesUsed);
+    nodes.resize(nodesUsed);
+
+    // Store triangles in leaf order so that leaves read contiguous memory
+    triangles.resize(N);
+    meshIds.resize(N);
+    triangleIds.resize(N);
+    sourcePrims.resize(N);
+    for (uint32_t i = 0; i < N; i++) {
+        uint32_t p = primIndices[i];
+        sourcePrims[p] = i;
+        triangles.set(i, unsorted[3 * p], unsorted[3 * p + 1], unsorted[3 * p + 2]);
+        meshIds[i] = unsortedMesh[p];
+        triangleIds[i] = unsortedTriangle[p];
+    }
+
+    primBounds.clear();
+    primBounds.shrink_to_fit();
+    centroids.clear();
+    centroids.shrink_to_fit();
+    primIndices.clear();
+    primIndices.shrink_to_fit();
+}
+
+AABB BVH::bounds() const
+{
+    AABB b;
+    if (!nodes.empty()) {
+        b.bmin = nodes[0].bmin;
+        b.bmax = nodes[0].bmax;
+    }
+    return b;
+}
+
+void BVH::computeBounds(uint32_t first, uint32_t count, AABB& bounds, AABB& centroidBounds) const
+{
+    for (uint32_t i = first; i < first + count; i++) {
+        uint32_t p = primIndices[i];
+        bounds.grow(primBounds[p]);
+        centroidBounds.grow(centroids[p]);
+    }
+}
+
+void BVH::binCentroids(uint32_t first, uint32_t count, const AABB& centroidBounds, Bin bins[3][BINS]) const
+{
+    glm::vec3 extent = centroidBounds.bmax - centroidBounds.bmin;
+    for (uint32_t i = first; i < first + count; i++) {
+        uint32_t p = primIndices[i];
+        for (int axis = 0; axis < 3; axis++) {
+            if (extent[axis] <= 0.f)
+                continue;
+            float scale = float(BINS) / extent[axis];
+            int b = std::min(BINS - 1, int((centroids[p][axis] - centroidBounds.bmin[axis]) * scale));
+            bins[axis][b].count++;
+            bins[axis][b].bounds.grow(primBounds[p]);
+        }
+    }
+}
+
+void BVH::subdivide(uint32_t nodeIdx, uint32_t first, uint32_t count, uint32_t depth, std::atomic<uint32_t>& nodesUsed)
+{
+    // Large ranges are scanned in parallel chunks, their partial results merged afterwards
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+    bool parallel = count >= 4 * PARALLEL_THRESHOLD && threads > 1;
+    uint32_t chunk = (count + threads - 1) / threads;
+
+    AABB bounds, centroidBounds;
+    if (parallel) {
+        std::vector<std::future<std::pair<AABB, AABB>>> jobs;
+        for (uint32_t start = first; start < first + count; start += chunk) {
+            uint32_t n = std::min(chunk, first + count - start);
+            jobs.push_back(std::async(std::launch::async, [this, start, n]() {
+                AABB b, cb;
+                computeBounds(start, n, b, cb);
+                return std::make_pair(b, cb);
+            }));
+        }
+        for (auto& job : jobs) {
+            auto res = job.get();
+            bounds.grow(res.first);
+            centroidBounds.grow(res.second);
+        }
+    }
+    else {
+        computeBounds(first, count, bounds, centroidBounds);
+    }
+
+    BVHNode& node = nodes[nodeIdx];
+    node.bmin = bounds.bmin;
+    node.bmax = bounds.bmax;
+    node.leftFirst = first;
+    node.count = count;
+
+    // Many coincident or badly spread centroids can make SAH splits very lopsided, the depth cap keeps them finite
+    if (count <= MAX_LEAF_SIZE || depth >= MAX_DEPTH)
+        return;
+
+    // Binned SAH, evaluating BINS - 1 split planes per axis
+    Bin bins[3][BINS];
+    if (parallel) {
+        std::vector<std::future<std::vector<Bin>>> jobs;
+        for (uint32_t start = first; start < first + count; start += chunk) {
+            uint32_t n = std::min(chunk, first + count - start);
+            jobs.push_back(std::async(std::launch::async, [this, start, n, &centroidBounds]() {
+                Bin local[3][BINS];
+                binCentroids(start, n, centroidBounds, local);
+                return std::vector<Bin>(&local[0][0], &local[0][0] + 3 * BINS);
+            }));
+        }
+        for (auto& job : jobs) {
+            auto local = job.get();
+            for (int axis = 0; axis < 3; axis++) {
+                for (int b = 0; b < BINS; b++) {
+                    bins[axis][b].count += local[axis * BINS + b].count;
+                    bins[axis][b].bounds.grow(local[axis * BINS + b].bounds);
+                }
+            }
+        }
+    }
+    else {
+        binCentroids(first, count, centroidBounds, bins);
+    }
+
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1, bestSplit = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float leftArea[BINS - 1], rightArea[BINS - 1];
+        uint32_t leftCount[BINS - 1], rightCount[BINS - 1];
+        AABB leftBox, rightBox;
+        uint32_t leftSum = 0, rightSum = 0;
+        for (int i = 0; i < BINS - 1; i++) {
+            leftSum += bins[axis][i].count;
+            leftCount[i] = leftSum;
+            leftBox.grow(bins[axis][i].bounds);
+            leftArea[i] = leftBox.area();
+
+            rightSum += bins[axis][BINS - 1 - i].count;
+            rightCount[BINS - 2 - i] = rightSum;
+            rightBox.grow(bins[axis][BINS - 1 - i].bounds);
+            rightArea[BINS - 2 - i] = rightBox.area();
+        }
+        for (int i = 0; i < BINS - 1; i++) {
+            if (leftCount[i] == 0 || rightCount[i] == 0)
+                continue;
+            float cost = float(leftCount[i]) * leftArea[i] + float(rightCount[i]) * rightArea[i];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
+        }
+    }
+
+    uint32_t mid;
+    if (bestAxis == -1) {
+        // All centroids coincide, fall back to a median split of the range
+        mid = first + count / 2;
+    }
+    else {
+        // Traversal step costs about one triangle test
+        float leafCost = float(count) * bounds.area();
+        if (bestCost + bounds.area() >= leafCost && count <= 4 * MAX_LEAF_SIZE)
+            return;
+
+        float scale = float(BINS) / (centroidBounds.bmax[bestAxis] - centroidBounds.bmin[bestAxis]);
+        float cmin = centroidBounds.bmin[bestAxis];
+        auto it = std::partition(primIndices.begin() + first, primIndices.begin() + first + count,
+                                 [&](uint32_t p) {
+            int b = std::min(BINS - 1, int((centroids[p][bestAxis] - cmin) * scale));
+            return b <= bestSplit;
+        });
+        mid = uint32_t(it - primIndices.begin());
+    }
+
+    uint32_t leftCount = mid - first;
+    uint32_t leftIdx = nodesUsed.fetch_add(2);
+    node.leftFirst = leftIdx;
+    node.count = 0;
+
+    // Sibling subtrees touch disjoint index ranges and node slots, so they can be built concurrently
+    if (count >= PARALLEL_THRESHOLD) {
+        auto job = std::async(std::launch::async, [this, leftIdx, first, leftCount, depth, &nodesUsed]() {
+            subdivide(leftIdx, first, leftCount, depth + 1, nodesUsed);
+        });
+        subdivide(leftIdx + 1, mid, count - leftCount, depth + 1, nodesUsed);
+        job.get();
+    }
+    else {
+        subdivide(leftIdx, first, leftCount, depth + 1, nodesUsed);
+        subdivide(leftIdx + 1, mid, count - leftCount, depth + 1, nodesUsed);
+    }
+}
+
+float BVH::intersectAABB(const Ray& ray, const glm::vec3& invDir, const BVHNode& node, float tMax) const
+{
+    glm::vec3 t1 = (node.bmin - ray.point) * invDir;
+    glm::vec3 t2 = (node.bmax - ray.point) * invDir;
+    glm::vec3 tmin = glm::min(t1, t2);
+    glm::vec3 tmax = glm::max(t1, t2);
+    float tnear = std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, 0.f));
+    float tfar = std::min(std::min(tmax.x, tmax.y), std::min(tmax.z, tMax));
+    if (tnear <= tfar)
+        return tnear;
+    return std::numeric_limits<float>::max();
+}
+
+bool BVH::intersect(const Ray& ray, TriangleHit& hit) const
+{
+    if (nodes.empty())
+        return false;
+
+    glm::vec3 invDir = 1.f / ray.dir;
+    if (intersectAABB(ray, invDir, nodes[0], hit.t) == std::numeric_limits<float>::max())
+        return false;
+
+    bool found = false;
+    KernelHit closest;
+    closest.t = hit.t;
+    struct Deferred
+    {
+        uint32_t node;
+        float t; // Where the ray enters its box
+    };
+    Deferred stack[MAX_DEPTH + 1]; // One far child per level at most
+    int sp = 0;
+    const BVHNode* node = &nodes[0];
+    while (true) {
+        if (node->isLeaf()) {
+            found |= kernel(triangles, node->leftFirst, node->count, ray, closest);
+        } else {
+            // Visit the nearest child first, the other one waits with its entry distance
+            uint32_t near = node->leftFirst, far = node->leftFirst + 1;
+            float dNear = intersectAABB(ray, invDir, nodes[near], closest.t);
+            float dFar = intersectAABB(ray, invDir, nodes[far], closest.t);
+            if (dNear > dFar) {
+                std::swap(near, far);
+                std::swap(dNear, dFar);
+            }
+            if (dNear != std::numeric_limits<float>::max()) {
+                if (dFar != std::numeric_limits<float>::max()) {
+                    assert(sp < int(MAX_DEPTH + 1));
+                    stack[sp++] = { far, dFar };
+                }
+                node = &nodes[near];
+                continue;
+            }
+        }
+        // Children deferred before a closer hit was found can be dropped without testing their boxes again
+        while (sp > 0 && stack[sp - 1].t >= closest.t)
+            sp--;
+        if (sp == 0)
+            break;
+        node = &nodes[stack[--sp].node];
+    }
+
+    if (found) {
+        uint32_t p = closest.prim;
+        hit.t = closest.t;
+        hit.bary = glm::vec2(closest.u, closest.v);
+        hit.prim = p;
+        hit.mesh = meshIds[p];
+        hit.triangle = triangleIds[p];
+        hit.point = ray.point + hit.t * ray.dir;
+        hit.normal = triangles.normal(p);
+    }
+    return found;
+}
+
+// Same traversal as intersect but every crossing is handed to the collector, which bounds the search once it is full.
+// flipped swaps entering and exiting for instances with a mirroring transform.
+void BVH::intersectAll(const Ray& ray, CrossingCollector& collector, uint64_t idBase, bool flipped) const
+{
+    if (nodes.empty())
+        return;
+
+    glm::vec3 invDir = 1.f / ray.dir;
+    uint32_t stack[MAX_DEPTH + 2]; // A popped node pushes its two children, one more entry per level
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp > 0) {
+        const BVHNode& node = nodes[stack[--sp]];
+        if (intersectAABB(ray, invDir, node, collector.limit()) == std::numeric_limits<float>::max())
+            continue;
+        if (node.isLeaf()) {
+            intersectTrianglesAll(triangles, node.leftFirst, node.count, ray,
+                                  [&]() { return collector.limit(); },
+                                  [&](float t, uint32_t prim, bool front) { collector.add(t, idBase | prim, front != flipped); });
+            continue;
+        }
+        // Push the far child first so that the near one is popped next and tightens the limit sooner
+        uint32_t near = node.leftFirst, far = node.leftFirst + 1;
+        if (intersectAABB(ray, invDir, nodes[near], collector.limit()) > intersectAABB(ray, invDir, nodes[far], collector.limit()))
+            std::swap(near, far);
+        assert(sp + 2 <= int(MAX_DEPTH + 2));
+        stack[sp++] = far;
+        stack[sp++] = near;
+    }
+}
+
+float BVH::distance2(const glm::vec3& p, const BVHNode& node)
+{
+    glm::vec3 d = glm::max(glm::max(node.bmin - p, p - node.bmax), glm::vec3(0.f));
+    return glm::dot(d, d);
+}
+
+// Nearest triangle closer than maxDist. Triangles meeting at the nearest edge or corner are all at the same distance,
+// among them the one whose plane faces p the most wins so that its winding gives a meaningful side.
+bool BVH::closestPoint(const glm::vec3& p, float maxDist, PointHit& hit) const
+{
+    if (nodes.empty())
+        return false;
+
+    bool found = false;
+    float best = maxDist * maxDist;
+    float bestAlignment = -1.f;
+    uint32_t stack[MAX_DEPTH + 2]; // A popped node pushes its two children, one more entry per level
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp > 0) {
+        const BVHNode& node = nodes[stack[--sp]];
+        if (distance2(p, node) > best)
+            continue;
+        if (node.isLeaf()) {
+            for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                TriangleFeature feature;
+                glm::vec3 q = closestPointOnTriangle(triangles, i, p, feature);
+                glm::vec3 pq = p - q;
+                float d2 = glm::dot(pq, pq);
+                if (d2 > best * (1.f + 1e-5f))
+                    continue;
+                // Slivers have no reliable side, their neighbours cover the same points
+                glm::vec3 e1(triangles.e1x[i], triangles.e1y[i], triangles.e1z[i]);
+                glm::vec3 e2(triangles.e2x[i], triangles.e2y[i], triangles.e2z[i]);
+                glm::vec3 n = glm::cross(e1, e2);
+                float area2 = glm::dot(n, n);
+                float edge2 = std::max(std::max(glm::dot(e1, e1), glm::dot(e2, e2)), glm::dot(e2 - e1, e2 - e1));
+                if (!(area2 > 1e-12f * edge2 * edge2))
+                    continue;
+                float alignment = d2 > 0.f ? std::fabs(glm::dot(pq, n)) / std::sqrt(d2 * area2) : 1.f;
+                if (d2 >= best * (1.f - 1e-5f) && found && alignment <= bestAlignment)
+                    continue;
+                found = true;
+                best = std::min(best, d2);
+                bestAlignment = alignment;
+                hit.point = q;
+                hit.prim = i;
+                hit.feature = feature;
+            }
+            continue;
+        }
+        // Push the far child first so that the near one is popped next and shrinks the search radius sooner
+        uint32_t near = node.leftFirst, far = node.leftFirst + 1;
+        if (distance2(p, nodes[near]) > distance2(p, nodes[far]))
+            std::swap(near, far);
+        assert(sp + 2 <= int(MAX_DEPTH + 2));
+        stack[sp++] = far;
+        stack[sp++] = near;
+    }
+
+    if (found)
+        hit.distance = glm::length(p - hit.point);
+    return found;
+}
@@ -0,0 +1,312 @@
+#pragma once
+
+#include "BVH.hpp"
+#include "Model.hpp"
+#include "Ray.hpp"
+#include "PrimitiveStore.hpp"
+
+#include <btBulletCollisionCommon.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+inline btVector3 toBt(const glm::vec3& v) { return btVector3(v.x, v.y, v.z); }
+inline glm::vec3 toGlm(const btVector3& v) { return glm::vec3(float(v.x()), float(v.y()), float(v.z())); }
+
+// Picking backend running the rays through a Bullet collision world, mirroring the content of a PrimitiveStore.
+// Meshes are registered as btBvhTriangleMeshShape over the model vertex buffers (no copy), wrapped in a scaled shape so
+// that moving or scaling a model never rebuilds the Bullet BVH. Hits come back as the same handles as the store ones.
+class BulletPicker
+{
+public:
+    float rayLength = 1000.f; // Rays are segments for Bullet, t is rebuilt from the hit fraction
+    static constexpr float MIN_SCALE = 1e-6f; // Models scaled below this on an axis are left out of the queries
+
+    explicit BulletPicker(const PrimitiveStore& store);
+
+    void addModel(uint32_t model, const Model& source);
+    void sync();
+    bool closestHit(const Ray& ray, SceneHit& hit) const;
+    int allHits(const Ray& ray, std::vector<Crossing>& crossings, int maxHits) const;
+    void Delete();
+
+private:
+    struct PickObject
+    {
+        PrimitiveType type;
+        uint32_t model;
+        uint64_t index;                 // Sphere / plane index in the store pools
+        std::vector<uint32_t> meshBase; // First model order triangle of every Bullet shape part
+        btCollisionObject* object = nullptr;
+        btCollisionShape* shape = nullptr;
+        btBvhTriangleMeshShape* meshShape = nullptr;
+        btTriangleIndexVertexArray* meshData = nullptr;
+    };
+
+    // Collects hits as (fraction, handle), closest only or the maxHits nearest ones
+    struct HitCallback : public btCollisionWorld::RayResultCallback
+    {
+        const BulletPicker& picker;
+        CrossingCollector collector;
+        btVector3 rayFrom, rayTo;
+        btVector3 normal;
+        PrimitiveHandle handle = INVALID_PRIMITIVE;
+        bool all;
+
+        HitCallback(const BulletPicker& picker, int maxHits, bool all)
+            : picker(picker), collector(maxHits, 1.f), all(all)
+        {};
+        btScalar addSingleResult(btCollisionWorld::LocalRayResult& result, bool normalInWorldSpace) override;
+    };
+
+    const PrimitiveStore& store;
+    btDefaultCollisionConfiguration* configuration;
+    btCollisionDispatcher* dispatcher;
+    btDbvtBroadphase* broadphase;
+    btCollisionWorld* world;
+    std::vector<PickObject> objects;
+    size_t syncedSpheres = 0, syncedPlanes = 0;
+
+    void add(PickObject& pick, const btTransform& transform);
+    static bool decompose(const glm::mat4& m, btTransform& transform, btVector3& scale);
+    PrimitiveHandle handleOf(const btCollisionWorld::LocalRayResult& result) const;
+};
+
+
+BulletPicker::BulletPicker(const PrimitiveStore& store) : store(store)
+{
+    configuration = new btDefaultCollisionConfiguration();
+    dispatcher = new btCollisionDispatcher(configuration);
+    broadphase = new btDbvtBroadphase();
+    world = new btCollisionWorld(dispatcher, broadphase, configuration);
+}
+
+// Rigid part and per axis scale of a model matrix, a mirroring matrix keeps its sign in the scale.
+// Returns false for a flattened or non finite matrix, it has no rigid part.
+bool BulletPicker::decompose(const glm::mat4& m, btTransform& transform, btVector3& scale)
+{
+    glm::vec3 s(glm::length(glm::vec3(m[0])), glm::length(glm::vec3(m[1])), glm::length(glm::vec3(m[2])));
+    // Written so that NaN fails too
+    if (!(s.x >= MIN_SCALE && s.y >= MIN_SCALE && s.z >= MIN_SCALE) || !std::isfinite(s.x + s.y + s.z))
+        return false;
+    if (glm::determinant(glm::mat3(m)) < 0.f)
+        s.x = -s.x;
+    glm::mat4 rigid = m;
+    rigid[0] /= s.x;
+    rigid[1] /= s.y;
+    rigid[2] /= s.z;
+    transform.setFromOpenGLMatrix(glm::value_ptr(rigid));
+    scale = toBt(s);
+    return true;
+}
+
+void BulletPicker::add(PickObject& pick, const btTransform& transform)
+{
+    pick.object = new btCollisionObject();
+    pick.object->setCollisionShape(pick.shape);
+    pick.object->setWorldTransform(transform);
+    pick.object->setUserIndex(int(objects.size()));
+    world->addCollisionObject(pick.object);
+    objects.push_back(pick);
+}
+
+// The model meshes must outlive the picker, Bullet reads their vertices and indices in place
+void BulletPicker::addModel(uint32_t model, const Model& source)
+{
+    PickObject pick;
+    pick.type = PrimitiveType::Triangle;
+    pick.model = model;
+    pick.index = 0;
+    pick.meshData = new btTriangleIndexVertexArray();
+    uint32_t base = 0;
+    for (const Mesh& mesh : source.getMeshes()) {
+        if (mesh.indices.size() < 3 || mesh.vertices.empty()) {
+            base += uint32_t(mesh.indices.size() / 3);
+            continue;
+        }
+        btIndexedMesh part;
+        part.m_numTriangles = int(mesh.indices.size() / 3);
+        part.m_triangleIndexBase = (const unsigned char*)mesh.indices.data();
+        part.m_triangleIndexStride = 3 * sizeof(GLuint);
+        part.m_numVertices = int(mesh.vertices.size());
+        part.m_vertexBase = (const unsigned char*)&mesh.vertices[0].Position;
+        part.m_vertexStride = sizeof(Vertex);
+        part.m_vertexType = PHY_FLOAT;
+        pick.meshData->addIndexedMesh(part, PHY_INTEGER);
+        pick.meshBase.push_back(base);
+        base += uint32_t(part.m_numTriangles);
+    }
+    pick.meshShape = new btBvhTriangleMeshShape(pick.meshData, true);
+
+    btTransform transform;
+    btVector3 scale(1.f, 1.f, 1.f);
+    bool placed = decompose(store.models[model].transform, transform, scale);
+    if (!placed)
+        transform.setIdentity();
+    pick.shape = new btScaledBvhTriangleMeshShape(pick.meshShape, scale);
+    add(pick, transform);
+    if (!placed)
+        world->removeCollisionObject(objects.back().object);
+}
+
+// Register the spheres and planes added to the store since the last call and follow the model transforms
+void BulletPicker::sync()
+{
+    for (; syncedSpheres < store.spheres.center.size(); syncedSpheres++) {
+        PickObject pick;
+        pick.type = PrimitiveType::Sphere;
+        pick.model = store.spheres.model[syncedSpheres];
+        pick.index = syncedSpheres;
+        pick.shape = new btSphereShape(store.spheres.radius[syncedSpheres]);
+        btTransform transform;
+        transform.setIdentity();
+        transform.setOrigin(toBt(store.spheres.center[syncedSpheres]));
+        add(pick, transform);
+    }
+    for (; syncedPlanes < store.planes.origin.size(); syncedPlanes++) {
+        PickObject pick;
+        pick.type = PrimitiveType::Plane;
+        pick.model = store.planes.model[syncedPlanes];
+        pick.index = syncedPlanes;
+        glm::vec3 n = store.planes.normal[syncedPlanes];
+        pick.shape = new btStaticPlaneShape(toBt(n), glm::dot(n, store.planes.origin[syncedPlanes]));
+        btTransform transform;
+        transform.setIdentity();
+        add(pick, transform);
+    }
+
+    for (auto& pick : objects) {
+        if (pick.type != PrimitiveType::Triangle)
+            continue;
+        btTransform transform;
+        btVector3 scale;
+        // A flattened model is out of the world until its scale is usable again
+        bool inWorld = pick.object->getBroadphaseHandle() != nullptr;
+        if (!decompose(store.models[pick.model].transform, transform, scale)) {
+            if (inWorld)
+                world->removeCollisionObject(pick.object);
+            continue;
+        }
+        if (inWorld && transform == pick.object->getWorldTransform() && scale == pick.shape->getLocalScaling())
+            continue;
+        pick.shape->setLocalScaling(scale);
+        pick.object->setWorldTransform(transform);
+        if (inWorld)
+            world->updateSingleAabb(pick.object);
+        else
+            world->addCollisionObject(pick.object);
+    }
+}
+
+PrimitiveHandle BulletPicker::handleOf(const btCollisionWorld::LocalRayResult& result) const
+{
+    const PickObject& pick = objects[result.m_collisionObject->getUserIndex()];
+    if (pick.type != PrimitiveType::Triangle)
+        return makeHandle(pick.type, pick.model, pick.index);
+    if (!result.m_localShapeInfo)
+        return INVALID_PRIMITIVE;
+    uint32_t triangle = pick.meshBase[result.m_localShapeInfo->m_shapePart] + uint32_t(result.m_localShapeInfo->m_triangleIndex);
+    return store.fromGpuId(pick.model, triangle);
+}
+
+btScalar BulletPicker::HitCallback::addSingleResult(btCollisionWorld::LocalRayResult& result, bool normalInWorldSpace)
+{
+    PrimitiveHandle hitHandle = picker.handleOf(result);
+    if (hitHandle == INVALID_PRIMITIVE)
+        return m_closestHitFraction;
+
+    // Bullet planes are unbounded, keep the store radius around their origin
+    if (handleType(hitHandle) == PrimitiveType::Plane) {
+        uint64_t i = handleIndex(hitHandle);
+        glm::vec3 p = toGlm(rayFrom.lerp(rayTo, result.m_hitFraction)) - picker.store.planes.origin[i];
+        if (glm::dot(p, p) > picker.store.planes.maxDist[i] * picker.store.planes.maxDist[i])
+            return m_closestHitFraction;
+    }
+
+    if (all) {
+        // Bullet flips triangle normals toward the ray, the store geometric normal tells entering from exiting
+        glm::vec3 dir = toGlm(rayTo - rayFrom);
+        glm::vec3 p = toGlm(rayFrom.lerp(rayTo, result.m_hitFraction));
+        bool entering = handleType(hitHandle) == PrimitiveType::Sphere || glm::dot(picker.store.normal(hitHandle, p), dir) < 0.f;
+        collector.add(float(result.m_hitFraction), hitHandle, entering);
+        // Once maxHits are kept Bullet can cull everything behind the farthest one
+        m_closestHitFraction = collector.limit();
+        m_collisionObject = result.m_collisionObject;
+        return m_closestHitFraction;
+    }
+
+    m_closestHitFraction = result.m_hitFraction;
+    m_collisionObject = result.m_collisionObject;
+    normal = normalInWorldSpace ? result.m_hitNormalLocal
+                                : m_collisionObject->getWorldTransform().getBasis() * result.m_hitNormalLocal;
+    handle = hitHandle;
+    return m_closestHitFraction;
+}
+
+bool BulletPicker::closestHit(const Ray& ray, SceneHit& hit) const
+{
+    HitCallback callback(*this, 1, false);
+    callback.rayFrom = toBt(ray.point);
+    callback.rayTo = toBt(ray.point + rayLength * ray.dir);
+    world->rayTest(callback.rayFrom, callback.rayTo, callback);
+    if (!callback.hasHit())
+        return false;
+
+    hit.t = float(callback.m_closestHitFraction) * rayLength;
+    hit.point = ray.point + hit.t * ray.dir;
+    hit.normal = glm::normalize(toGlm(callback.normal));
+    hit.handle = callback.handle;
+    hit.tExit = hit.t;
+    if (handleType(hit.handle) == PrimitiveType::Sphere) {
+        // Bullet only reports the entry of convex shapes, the exit is the far root along the same chord
+        glm::vec3 center = store.spheres.center[handleIndex(hit.handle)];
+        hit.tExit = hit.t + 2.f * glm::dot(center - hit.point, ray.dir) / glm::dot(ray.dir, ray.dir);
+    }
+    return true;
+}
+
+// Same contract as PrimitiveStore::allHits. Convex shapes only report their entry, sphere exits are added here.
+int BulletPicker::allHits(const Ray& ray, std::vector<Crossing>& crossings, int maxHits) const
+{
+    HitCallback callback(*this, maxHits, true);
+    callback.rayFrom = toBt(ray.point);
+    callback.rayTo = toBt(ray.point + rayLength * ray.dir);
+    world->rayTest(callback.rayFrom, callback.rayTo, callback);
+
+    crossings = callback.collector.sorted();
+    size_t count = crossings.size();
+    for (size_t i = 0; i < count; i++) {
+        crossings[i].t *= rayLength;
+        if (handleType(crossings[i].id) == PrimitiveType::Sphere) {
+            glm::vec3 p = ray.point + crossings[i].t * ray.dir;
+            glm::vec3 center = store.spheres.center[handleIndex(crossings[i].id)];
+            float tExit = crossings[i].t + 2.f * glm::dot(center - p, ray.dir) / glm::dot(ray.dir, ray.dir);
+            crossings.push_back({ tExit, crossings[i].id, false });
+        }
+    }
+    std::sort(crossings.begin(), crossings.end(), [](const Crossing& a, const Crossing& b) { return a.t < b.t; });
+    if (int(crossings.size()) > maxHits)
+        crossings.resize(size_t(std::max(1, maxHits)));
+    return int(crossings.size());
+}
+
+void BulletPicker::Delete()
+{
+    for (auto& pick : objects) {
+        if (pick.object->getBroadphaseHandle())
+            world->removeCollisionObject(pick.object);
+        delete pick.object;
+        delete pick.shape;
+        delete pick.meshShape;
+        delete pick.meshData;
+    }
+    objects.clear();
+    delete world;
+    delete broadphase;
+    delete dispatcher;
+    delete configuration;
+}
@@ -1,7 +1,7 @@
 #pragma once
 
 //Local Includes
-#include "Object.hpp"
+#include "Ray.hpp"
 
 // Std. Includes
 #include <vector>
@@ -28,11 +28,13 @@ public:
     bool capture = false;
     std::vector<glm::vec3> positions;
     std::vector<glm::vec3> orientations;
+    std::vector<double> times; // Clock of each captured frame, for time based replays
 
     glm::vec3 P;
     glm::vec3 O = glm::vec3(0.0f, 0.0f, -1.0f);
     glm::vec3 U = glm::vec3(0.0f, 1.0f, 0.0f);
     glm::mat4 CM = glm::mat4(1.0f);
+    glm::mat4 invCM = glm::mat4(1.0f); // Cached inverse of CM, unprojects window positions
     glm::mat4 view = glm::mat4(1.0f);
     glm::mat4 projection = glm::mat4(1.0f);
     int width, height;
@@ -64,10 +66,12 @@ void Camera::update(float nfov, float nNear, float nFar) {
     far = nFar;
     projection = glm::perspective(glm::radians(fov), (float)width / height, near, far);
     CM = projection * view;
+    invCM = glm::inverse(CM);
     if (capture == true)
     {
         positions.push_back(P);
         orientations.push_back(O);
+        times.push_back(glfwGetTime());
     }
 }
 
@@ -131,7 +135,7 @@ void Camera::movements(GLFWwindow *window) {
 Ray Camera::getClickDir(int x, int y, int width, int height) {
 
     const glm::highp_f32vec2 pos(x,y);
-    glm::highp_f32mat4 invMat = glm::inverse(CM);
+    glm::highp_f32mat4 invMat = invCM;
     float halfScreenWidth = float(width) / 2.f;
     float halfScreenHeight = float(height) / 2.f;
     glm::highp_f32vec4 near = glm::vec4((pos.x - halfScreenWidth) / halfScreenWidth, -1 * (pos.y - halfScreenHeight) / halfScreenHeight, -1, 1.0);
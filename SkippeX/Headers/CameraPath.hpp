@@ -0,0 +1,147 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Camera positions and orientations over time, sampled by wall clock time rather than by frame so that playback
+// speed does not depend on the frame rate. Orientations are quaternions of the camera frame built with a fixed up
+// vector, slerped between keys.
+// A path is either a captured camera motion, replayed as it was recorded, or a curve the camera flies along at a
+// constant speed. Curves are resampled at a uniform arc length and smoothed with a moving average over prefix sums,
+// O(n) whatever the smoothing radius.
+class CameraPath
+{
+public:
+    float spacing = 0.01f; // World units between two keys of a curve path
+    float smoothing = 0.2f; // World units, radius of the moving average over a curve path
+    glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f);
+
+    bool empty() const { return times.size() < 2; }
+    uint32_t size() const { return uint32_t(times.size()); }
+    float duration() const { return times.empty() ? 0.0f : times.back(); }
+
+    void clear();
+    void fromCapture(const std::vector<glm::vec3>& positions, const std::vector<glm::vec3>& directions,
+                     const std::vector<double>& captureTimes);
+    void fromCurve(const std::vector<glm::vec3>& points, float speed);
+    void sample(float time, glm::vec3& position, glm::vec3& direction) const;
+
+private:
+    std::vector<float> times;
+    std::vector<glm::vec3> positions;
+    std::vector<glm::quat> orientations;
+
+    void push(float time, const glm::vec3& position, const glm::vec3& direction);
+};
+
+
+void CameraPath::clear()
+{
+    times.clear();
+    positions.clear();
+    orientations.clear();
+}
+
+// Camera looking along direction, with its right vector kept from the previous key when direction is along up
+void CameraPath::push(float time, const glm::vec3& position, const glm::vec3& direction)
+{
+    glm::vec3 back = -glm::normalize(direction);
+    glm::vec3 right = glm::cross(up, back);
+    if (glm::dot(right, right) < 1e-8f)
+        right = orientations.empty() ? glm::vec3(1.0f, 0.0f, 0.0f) : orientations.back() * glm::vec3(1.0f, 0.0f, 0.0f);
+    right = glm::normalize(right);
+    glm::quat orientation = glm::quat_cast(glm::mat3(right, glm::cross(back, right), back));
+    // Neighbouring keys in the same hemisphere, slerp takes the short way
+    if (!orientations.empty() && glm::dot(orientations.back(), orientation) < 0.0f)
+        orientation = glm::quat(-orientation.w, -orientation.x, -orientation.y, -orientation.z);
+    times.push_back(time);
+    positions.push_back(position);
+    orientations.push_back(orientation);
+}
+
+void CameraPath::fromCapture(const std::vector<glm::vec3>& capturedPositions, const std::vector<glm::vec3>& directions,
+                             const std::vector<double>& captureTimes)
+{
+    clear();
+    size_t n = std::min(capturedPositions.size(), std::min(directions.size(), captureTimes.size()));
+    for (size_t i = 0; i < n; i++) {
+        auto time = float(captureTimes[i] - captureTimes[0]);
+        // Frames captured within the same clock tick would stall the search
+        if (!times.empty() && time <= times.back())
+            continue;
+        push(time, capturedPositions[i], directions[i]);
+    }
+}
+
+// The camera flies along the points at speed world units per second, looking along the smoothed tangent
+void CameraPath::fromCurve(const std::vector<glm::vec3>& points, float speed)
+{
+    clear();
+    if (points.size() < 2 || spacing <= 0.0f || speed <= 0.0f)
+        return;
+
+    // Uniform arc length resampling, a single walk over the polyline
+    std::vector<glm::vec3> uniform(1, points[0]);
+    float carried = 0.0f; // Length walked since the last key
+    for (size_t i = 1; i < points.size(); i++) {
+        glm::vec3 from = points[i - 1], d = points[i] - points[i - 1];
+        float length = glm::length(d);
+        float along = spacing - carried;
+        for (; along <= length; along += spacing)
+            uniform.push_back(from + d * (along / length));
+        carried = length - (along - spacing);
+    }
+    if (carried > 0.0f)
+        uniform.push_back(points.back());
+    auto n = uniform.size();
+    if (n < 2)
+        return;
+
+    // Moving average of a sequence with prefix sums, the window shrinks at both ends
+    auto radius = size_t(std::max(0.0f, smoothing / spacing));
+    auto average = [radius, n](const std::vector<glm::vec3>& values, std::vector<glm::vec3>& averaged) {
+        std::vector<glm::dvec3> sums(n + 1, glm::dvec3(0.0));
+        for (size_t i = 0; i < n; i++)
+            sums[i + 1] = sums[i] + glm::dvec3(values[i]);
+        averaged.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            size_t first = i > radius ? i - radius : 0, last = std::min(n - 1, i + radius);
+            averaged[i] = glm::vec3((sums[last + 1] - sums[first]) / double(last + 1 - first));
+        }
+    };
+    std::vector<glm::vec3> smoothed, tangents(n), directions;
+    average(uniform, smoothed);
+    for (size_t i = 0; i < n; i++) {
+        glm::vec3 d = smoothed[std::min(n - 1, i + 1)] - smoothed[i > 0 ? i - 1 : 0];
+        float length = glm::length(d);
+        tangents[i] = length > 1e-12f ? d / length : (i > 0 ? tangents[i - 1] : glm::vec3(0.0f, 0.0f, -1.0f));
+    }
+    average(tangents, directions);
+
+    for (size_t i = 0; i < n; i++) {
+        glm::vec3 direction = glm::dot(directions[i], directions[i]) > 1e-12f ? directions[i] : tangents[i];
+        push(float(i) * spacing / speed, smoothed[i], direction);
+    }
+}
+
+void CameraPath::sample(float time, glm::vec3& position, glm::vec3& direction) const
+{
+    if (times.empty())
+        return;
+    size_t next = std::upper_bound(times.begin(), times.end(), time) - times.begin();
+    if (next == 0 || next == times.size()) {
+        size_t key = next == 0 ? 0 : times.size() - 1;
+        position = positions[key];
+        direction = orientations[key] * glm::vec3(0.0f, 0.0f, -1.0f);
+        return;
+    }
+    size_t key = next - 1;
+    float u = (time - times[key]) / (times[next] - times[key]);
+    position = glm::mix(positions[key], positions[next], u);
+    direction = glm::slerp(orientations[key], orientations[next], u) * glm::vec3(0.0f, 0.0f, -1.0f);
+}
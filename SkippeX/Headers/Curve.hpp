@@ -1,15 +1,96 @@
 #pragma once
 
+#include "Simd.hpp"
+
+#include <algorithm>
+#include <functional>
 #include <vector>
 #include <cassert>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
-class Curve
+// Cubic bases in matrix form, a segment is [u^3 u^2 u 1] * M * [P0 P1 P2 P3].
+// STRIDE is the number of control points between the first points of two consecutive segments.
+struct UniformBSpline
+{
+    static constexpr int STRIDE = 1;
+    static constexpr float M[4][4] = {
+        { -1.f / 6.f,  3.f / 6.f, -3.f / 6.f, 1.f / 6.f },
+        {  3.f / 6.f, -6.f / 6.f,  3.f / 6.f, 0.f },
+        { -3.f / 6.f,  0.f,        3.f / 6.f, 0.f },
+        {  1.f / 6.f,  4.f / 6.f,  1.f / 6.f, 0.f },
+    };
+};
+
+// Interpolates P1 and P2
+struct CatmullRom
+{
+    static constexpr int STRIDE = 1;
+    static constexpr float M[4][4] = {
+        { -0.5f,  1.5f, -1.5f,  0.5f },
+        {  1.0f, -2.5f,  2.0f, -0.5f },
+        { -0.5f,  0.0f,  0.5f,  0.0f },
+        {  0.0f,  1.0f,  0.0f,  0.0f },
+    };
+};
+
+// Segments share their end points, P3 of a segment is P0 of the next
+struct CubicBezier
+{
+    static constexpr int STRIDE = 3;
+    static constexpr float M[4][4] = {
+        { -1.f,  3.f, -3.f, 1.f },
+        {  3.f, -6.f,  3.f, 0.f },
+        { -3.f,  3.f,  0.f, 0.f },
+        {  1.f,  0.f,  0.f, 0.f },
+    };
+};
+
+// Weights of the four control points at every sample of a segment, for the position and its first two derivatives.
+// Built once per sample count, every lane array is padded to a multiple of 4.
+struct SampleTable
+{
+    int samples = -1;
+    int lanes = 0;
+    std::vector<float> w[3][4]; // [derivative][control point][sample]
+
+    template<typename Basis>
+    void build(int samples);
+};
+
+// Samples of consecutive segments in structure of arrays layout, derivatives are with respect to the segment parameter.
+// Segment s starts at lane s * perSegment and holds samples + 1 valid values.
+struct CurveSamples
+{
+    int perSegment = 0;
+    int segments = 0;
+    std::vector<float> x, y, z;
+    std::vector<float> dx, dy, dz;
+    std::vector<float> ddx, ddy, ddz;
+};
+
+// How points are placed along the curve. Fixed puts samples + 1 points on every segment, Adaptive subdivides each
+// segment until the polyline is closer than tolerance to the curve, ArcLength spaces the points evenly along it.
+enum class CurveSampling { Fixed, Adaptive, ArcLength };
+
+// Points [first, first + count) changed by an edit
+struct CurveRange
+{
+    int first = 0;
+    int count = 0;
+};
+
+template<typename Basis>
+class BasicCurve
 {
 public:
-    Curve() {};
+    static const int MAX_DEPTH = 12; // Adaptive subdivision stops at 4096 intervals per segment
+
+    BasicCurve() {};
     int samples = 50;
+    CurveSampling sampling = CurveSampling::Fixed;
+    float tolerance = 0.002f; // Adaptive, world space, unless a tolerance function was given to rebuildAdaptive
+    float spacing = 0.05f; // ArcLength, world space
     std::vector<glm::vec3> control_points;
     std::vector<glm::vec3> points;
 
@@ -17,24 +98,353 @@ public:
         return points[i];
     }
     void add_point(const glm::vec3& point);
+    void rebuild();
+    void rebuildAdaptive(std::function<float(const glm::vec3&)> toleranceAt);
+
+    // Local edits, only the segments whose four control points include index are evaluated again.
+    // Points after them only move in memory when the edited segments end up with a different point count.
+    CurveRange move(int index, const glm::vec3& point);
+    CurveRange insert(int index, const glm::vec3& point);
+    CurveRange erase(int index);
+
+    int segments() const {
+        return control_points.size() < 4 ? 0 : int(control_points.size() - 4) / Basis::STRIDE + 1;
+    }
+    // First point of a segment, segmentStart(segments()) is the point count
+    int segmentStart(int segment) const {
+        return offsets[segment];
+    }
+    glm::vec3 evaluate(int segment, float u, int derivative = 0) const;
+    void evaluateBatch(int firstSegment, int count, CurveSamples& out) const;
+
+private:
+    mutable SampleTable table;
+    std::function<float(const glm::vec3&)> toleranceAt;
+    std::vector<int> offsets = { 0 }; // segments() + 1 entries
+    std::vector<float> carries = { 0.f }; // ArcLength, distance along the curve since the last point at each segment start
+
+    int firstTouching(int index) const {
+        return index < 3 ? 0 : (index - 3 + Basis::STRIDE - 1) / Basis::STRIDE;
+    }
+    float toleranceFor(const glm::vec3& p) const {
+        return toleranceAt ? toleranceAt(p) : tolerance;
+    }
+    template<typename Tolerance>
+    void subdivide(int segment, Tolerance toleranceAt, std::vector<float>& us) const;
+    void appendSegment(int segment, std::vector<glm::vec3>& out, float& carry) const;
+    CurveRange resample(int first, int oldEnd, int newEnd);
+
+    const SampleTable& weights() const {
+        if (table.samples != samples)
+            table.build<Basis>(samples);
+        return table;
+    }
+    static void blend(const std::vector<float>* w, const glm::vec3* P, int lanes, float* x, float* y, float* z);
 };
 
-void Curve::add_point(const glm::vec3& point)
+typedef BasicCurve<UniformBSpline> Curve;
+
+
+template<typename Basis>
+void SampleTable::build(int sampleCount)
+{
+    samples = sampleCount;
+    lanes = (samples + 1 + 3) & ~3;
+    for (auto& derivative : w)
+        for (auto& k : derivative)
+            k.assign(lanes, 0.f);
+    for (int i = 0; i <= samples; i++) {
+        float u = samples > 0 ? float(i) / float(samples) : 0.f;
+        const float powers[3][4] = {
+            { u * u * u, u * u, u, 1.f },
+            { 3.f * u * u, 2.f * u, 1.f, 0.f },
+            { 6.f * u, 2.f, 0.f, 0.f },
+        };
+        for (int d = 0; d < 3; d++)
+            for (int k = 0; k < 4; k++) {
+                float weight = 0.f;
+                for (int j = 0; j < 4; j++)
+                    weight += powers[d][j] * Basis::M[j][k];
+                w[d][k][i] = weight;
+            }
+    }
+}
+
+// Appends the points of the segment the new control point completes, if any
+template<typename Basis>
+void BasicCurve<Basis>::add_point(const glm::vec3& point)
 {
     control_points.push_back(point);
-    if(control_points.size() < 4)
+    if (control_points.size() < 4 || (control_points.size() - 4) % Basis::STRIDE != 0)
+        return;
+
+    float carry = carries.back();
+    appendSegment(segments() - 1, points, carry);
+    offsets.push_back(int(points.size()));
+    carries.push_back(carry);
+}
+
+// Recomputes points from every control point at once, after they were edited or the sampling changed
+template<typename Basis>
+void BasicCurve<Basis>::rebuild()
+{
+    points.clear();
+    offsets.assign(1, 0);
+    carries.assign(1, 0.f);
+    if (sampling != CurveSampling::Fixed) {
+        resample(0, 0, segments());
+        return;
+    }
+    CurveSamples batch;
+    evaluateBatch(0, segments(), batch);
+    points.reserve(size_t(batch.segments) * (samples + 1));
+    for (int s = 0; s < batch.segments; s++) {
+        for (int i = s * batch.perSegment; i <= s * batch.perSegment + samples; i++)
+            points.emplace_back(batch.x[i], batch.y[i], batch.z[i]);
+        offsets.push_back(int(points.size()));
+        carries.push_back(0.f);
+    }
+}
+
+// toleranceAt(point) gives the allowed distance between the curve and the polyline around point, a screen space
+// tolerance is a pixel size scaled by the distance of point to the eye. It is kept for the following edits.
+template<typename Basis>
+void BasicCurve<Basis>::rebuildAdaptive(std::function<float(const glm::vec3&)> newToleranceAt)
+{
+    sampling = CurveSampling::Adaptive;
+    toleranceAt = std::move(newToleranceAt);
+    rebuild();
+}
+
+template<typename Basis>
+CurveRange BasicCurve<Basis>::move(int index, const glm::vec3& point)
+{
+    control_points[index] = point;
+    int first = std::min(firstTouching(index), segments());
+    int end = std::min(segments(), index / Basis::STRIDE + 1);
+    if (sampling == CurveSampling::ArcLength)
+        end = segments();
+    return resample(first, std::max(end, first), std::max(end, first));
+}
+
+// With a stride of 1 the segments after index are the previous ones shifted by one, otherwise they all change
+template<typename Basis>
+CurveRange BasicCurve<Basis>::insert(int index, const glm::vec3& point)
+{
+    int oldSegments = segments();
+    control_points.insert(control_points.begin() + index, point);
+    int first = std::min(firstTouching(index), oldSegments);
+    int oldEnd = std::min(oldSegments, index), newEnd = std::min(segments(), index + 1);
+    if (Basis::STRIDE != 1 || sampling == CurveSampling::ArcLength) {
+        oldEnd = oldSegments;
+        newEnd = segments();
+    }
+    return resample(first, std::max(oldEnd, first), std::max(newEnd, first));
+}
+
+template<typename Basis>
+CurveRange BasicCurve<Basis>::erase(int index)
+{
+    int oldSegments = segments();
+    control_points.erase(control_points.begin() + index);
+    int first = std::min(firstTouching(index), segments());
+    int oldEnd = std::min(oldSegments, index + 1), newEnd = std::min(segments(), index);
+    if (Basis::STRIDE != 1 || sampling == CurveSampling::ArcLength) {
+        oldEnd = oldSegments;
+        newEnd = segments();
+    }
+    return resample(first, std::max(oldEnd, first), std::max(newEnd, first));
+}
+
+// Replaces the points of the old segments [first, oldEnd) by the ones of the new segments [first, newEnd)
+template<typename Basis>
+CurveRange BasicCurve<Basis>::resample(int first, int oldEnd, int newEnd)
+{
+    // Only the first segment adds its start point, whichever segment becomes the first one is sampled again
+    if (sampling != CurveSampling::Fixed && first == 0 && (oldEnd == 0 || newEnd == 0) &&
+        oldEnd < int(offsets.size()) - 1 && newEnd < segments()) {
+        oldEnd++;
+        newEnd++;
+    }
+    std::vector<glm::vec3> fresh;
+    std::vector<int> ends;
+    std::vector<float> endCarries;
+    float carry = carries[first];
+    for (int s = first; s < newEnd; s++) {
+        appendSegment(s, fresh, carry);
+        ends.push_back(int(fresh.size()));
+        endCarries.push_back(carry);
+    }
+
+    CurveRange range;
+    range.first = offsets[first];
+    int oldCount = offsets[oldEnd] - offsets[first];
+    int delta = int(fresh.size()) - oldCount;
+    if (delta == 0)
+        std::copy(fresh.begin(), fresh.end(), points.begin() + range.first);
+    else {
+        points.erase(points.begin() + range.first, points.begin() + range.first + oldCount);
+        points.insert(points.begin() + range.first, fresh.begin(), fresh.end());
+    }
+    range.count = delta == 0 ? int(fresh.size()) : int(points.size()) - range.first;
+
+    // Moving a point keeps the layout of every other segment
+    if (delta == 0 && oldEnd == newEnd) {
+        for (size_t i = 0; i < ends.size(); i++) {
+            offsets[first + 1 + i] = range.first + ends[i];
+            carries[first + 1 + i] = endCarries[i];
+        }
+        return range;
+    }
+    std::vector<int> tailOffsets(offsets.begin() + oldEnd + 1, offsets.end());
+    std::vector<float> tailCarries(carries.begin() + oldEnd + 1, carries.end());
+    offsets.resize(first + 1);
+    carries.resize(first + 1);
+    for (size_t i = 0; i < ends.size(); i++) {
+        offsets.push_back(range.first + ends[i]);
+        carries.push_back(endCarries[i]);
+    }
+    for (size_t i = 0; i < tailOffsets.size(); i++) {
+        offsets.push_back(tailOffsets[i] + delta);
+        carries.push_back(tailCarries[i]);
+    }
+    return range;
+}
+
+// Parameters in (0, 1] ending the intervals of the segment, in order. The distance between a cubic and its chord over
+// [a, b] is at most (b - a)^2 / 8 * max |C''|, and C'' is linear in u so its largest norm is at one of the ends.
+template<typename Basis>
+template<typename Tolerance>
+void BasicCurve<Basis>::subdivide(int segment, Tolerance toleranceAt, std::vector<float>& us) const
+{
+    struct Interval { float a, b; int depth; };
+    Interval stack[MAX_DEPTH + 2];
+    int top = 0;
+    stack[top++] = { 0.f, 1.f, 0 };
+    while (top > 0) {
+        Interval i = stack[--top];
+        float h = i.b - i.a;
+        float curvature = std::max(glm::length(evaluate(segment, i.a, 2)), glm::length(evaluate(segment, i.b, 2)));
+        float m = 0.5f * (i.a + i.b);
+        if (i.depth >= MAX_DEPTH || h * h * 0.125f * curvature <= toleranceAt(evaluate(segment, m))) {
+            us.push_back(i.b);
+            continue;
+        }
+        // The second half is popped after the first one is done
+        stack[top++] = { m, i.b, i.depth + 1 };
+        stack[top++] = { i.a, m, i.depth + 1 };
+    }
+}
+
+// Points of one segment for the current sampling. With Adaptive and ArcLength the start of a segment is the end of
+// the previous one and only the first segment adds it. ArcLength walks a fine adaptive polyline of the segment and
+// places a point every spacing along it, carry being the distance walked since the last point. The parameter of each
+// point is interpolated within its interval then evaluated, so points lie on the curve. The remainder shorter than
+// spacing at the end of the curve gets no point.
+template<typename Basis>
+void BasicCurve<Basis>::appendSegment(int segment, std::vector<glm::vec3>& out, float& carry) const
+{
+    if (sampling == CurveSampling::Fixed) {
+        const glm::vec3* P = &control_points[segment * Basis::STRIDE];
+        const SampleTable& t = weights();
+        for (int i = 0; i <= samples; i++)
+            out.push_back(t.w[0][0][i] * P[0] + t.w[0][1][i] * P[1] + t.w[0][2][i] * P[2] + t.w[0][3][i] * P[3]);
         return;
+    }
+    if (segment == 0) {
+        out.push_back(evaluate(0, 0.f));
+        carry = 0.f;
+    }
+    std::vector<float> us;
+    if (sampling == CurveSampling::Adaptive) {
+        subdivide(segment, [this](const glm::vec3& p) { return toleranceFor(p); }, us);
+        for (float u : us)
+            out.push_back(evaluate(segment, u));
+        return;
+    }
 
-    int ctrl_pt = control_points.size() - 4;
-    for(int i = 0; i <= samples; i++)
-    {
-        // Implementation of BSpline algorithm for 3D Points
-        float u=(float)i / (float)samples;
-        glm::vec3 point;
-        point = u * u * u * ((-1.f) * control_points[ctrl_pt] + 3.f * control_points[ctrl_pt + 1] - 3.f * control_points[ctrl_pt + 2] + control_points[ctrl_pt + 3]) / 6.f;
-        point += u * u * (3.f * control_points[ctrl_pt] - 6.f * control_points[ctrl_pt + 1]+ 3.f * control_points[ctrl_pt + 2]) / 6.f;
-        point += u * ((-3.f) * control_points[ctrl_pt] + 3.f * control_points[ctrl_pt + 2]) / 6.f;
-        point += (control_points[ctrl_pt] + 4.f * control_points[ctrl_pt + 1] + control_points[ctrl_pt + 2]) / 6.f;
-        points.push_back(point);
-    }
-}
\ No newline at end of file
+    float step = std::max(spacing, 1e-6f);
+    subdivide(segment, [step](const glm::vec3&) { return step * 0.01f; }, us);
+    float u0 = 0.f;
+    glm::vec3 p0 = evaluate(segment, 0.f);
+    for (float u1 : us) {
+        glm::vec3 p1 = evaluate(segment, u1);
+        float length = glm::length(p1 - p0);
+        float along = 0.f;
+        while (carry + length - along >= step) {
+            along += step - carry;
+            carry = 0.f;
+            out.push_back(evaluate(segment, u0 + (u1 - u0) * along / length));
+        }
+        carry += length - along;
+        u0 = u1;
+        p0 = p1;
+    }
+}
+
+template<typename Basis>
+glm::vec3 BasicCurve<Basis>::evaluate(int segment, float u, int derivative) const
+{
+    const float powers[3][4] = {
+        { u * u * u, u * u, u, 1.f },
+        { 3.f * u * u, 2.f * u, 1.f, 0.f },
+        { 6.f * u, 2.f, 0.f, 0.f },
+    };
+    const glm::vec3* P = &control_points[segment * Basis::STRIDE];
+    glm::vec3 result(0.f);
+    for (int k = 0; k < 4; k++) {
+        float weight = 0.f;
+        for (int j = 0; j < 4; j++)
+            weight += powers[derivative][j] * Basis::M[j][k];
+        result += weight * P[k];
+    }
+    return result;
+}
+
+// Positions, first and second derivatives of count segments. The weight table stays in L1 across segments so the
+// loop is bound by the stores of the nine output streams.
+template<typename Basis>
+void BasicCurve<Basis>::evaluateBatch(int firstSegment, int count, CurveSamples& out) const
+{
+    const SampleTable& t = weights();
+    out.perSegment = t.lanes;
+    out.segments = std::max(0, count);
+    size_t n = size_t(out.segments) * t.lanes;
+    for (auto* a : { &out.x, &out.y, &out.z, &out.dx, &out.dy, &out.dz, &out.ddx, &out.ddy, &out.ddz })
+        a->resize(n);
+    for (int s = 0; s < out.segments; s++) {
+        const glm::vec3* P = &control_points[(firstSegment + s) * Basis::STRIDE];
+        size_t o = size_t(s) * t.lanes;
+        blend(t.w[0], P, t.lanes, &out.x[o], &out.y[o], &out.z[o]);
+        blend(t.w[1], P, t.lanes, &out.dx[o], &out.dy[o], &out.dz[o]);
+        blend(t.w[2], P, t.lanes, &out.ddx[o], &out.ddy[o], &out.ddz[o]);
+    }
+}
+
+// x[i] = sum over k of w[k][i] * P[k].x, lanes is a multiple of 4
+template<typename Basis>
+void BasicCurve<Basis>::blend(const std::vector<float>* w, const glm::vec3* P, int lanes, float* x, float* y, float* z)
+{
+    const float* w0 = w[0].data();
+    const float* w1 = w[1].data();
+    const float* w2 = w[2].data();
+    const float* w3 = w[3].data();
+#ifdef SKIPPEX_X86
+    const __m128 p0x = _mm_set1_ps(P[0].x), p0y = _mm_set1_ps(P[0].y), p0z = _mm_set1_ps(P[0].z);
+    const __m128 p1x = _mm_set1_ps(P[1].x), p1y = _mm_set1_ps(P[1].y), p1z = _mm_set1_ps(P[1].z);
+    const __m128 p2x = _mm_set1_ps(P[2].x), p2y = _mm_set1_ps(P[2].y), p2z = _mm_set1_ps(P[2].z);
+    const __m128 p3x = _mm_set1_ps(P[3].x), p3y = _mm_set1_ps(P[3].y), p3z = _mm_set1_ps(P[3].z);
+    for (int i = 0; i < lanes; i += 4) {
+        __m128 a = _mm_loadu_ps(w0 + i), b = _mm_loadu_ps(w1 + i), c = _mm_loadu_ps(w2 + i), d = _mm_loadu_ps(w3 + i);
+        _mm_storeu_ps(x + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, p0x), _mm_mul_ps(b, p1x)), _mm_add_ps(_mm_mul_ps(c, p2x), _mm_mul_ps(d, p3x))));
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, p0y), _mm_mul_ps(b, p1y)), _mm_add_ps(_mm_mul_ps(c, p2y), _mm_mul_ps(d, p3y))));
+        _mm_storeu_ps(z + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, p0z), _mm_mul_ps(b, p1z)), _mm_add_ps(_mm_mul_ps(c, p2z), _mm_mul_ps(d, p3z))));
+    }
+#else
+    for (int i = 0; i < lanes; i++) {
+        x[i] = w0[i] * P[0].x + w1[i] * P[1].x + w2[i] * P[2].x + w3[i] * P[3].x;
+        y[i] = w0[i] * P[0].y + w1[i] * P[1].y + w2[i] * P[2].y + w3[i] * P[3].y;
+        z[i] = w0[i] * P[0].z + w1[i] * P[1].z + w2[i] * P[2].z + w3[i] * P[3].z;
+    }
+#endif
+}
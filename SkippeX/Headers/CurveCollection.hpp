@@ -0,0 +1,273 @@
+#pragma once
+
+#include "InstanceBuffer.hpp"
+#include "shader.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Per curve data read by curves.vert, std430 layout
+struct CurveRecord
+{
+    glm::vec4 color;
+    uint32_t first; // First point in the point buffer
+    uint32_t count;
+    float thickness; // Pixels
+    uint32_t pad;
+};
+
+struct DrawElementsIndirectCommand
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+// Any number of polylines drawn as screen space ribbons with a single glMultiDrawElementsIndirect call. The points of
+// every curve live in one storage buffer, a curve owns a contiguous range of it handed out first fit, and its slot
+// in the record and command buffers gives its offset, color and thickness. Adding, editing or removing a curve uploads
+// its own range and its 20 byte command only. Slots of removed curves stay in the draw with a zero count until reused.
+// All curves share one index buffer of quads, a command picks its points with baseVertex: vertices 2i and 2i + 1 are
+// the two sides of point i.
+class CurveCollection
+{
+public:
+    uint32_t size() const { return liveCount; }
+    uint32_t points() const { return pointCount; }
+    size_t uploaded() const { return bytes; } // Since the last resetStats
+    void resetStats() { bytes = 0; }
+
+    uint32_t add(const std::vector<glm::vec3>& points, glm::vec4 color, float thickness);
+    void update(uint32_t id, const std::vector<glm::vec3>& points);
+    void setStyle(uint32_t id, glm::vec4 color, float thickness);
+    void remove(uint32_t id);
+    void clear();
+    void draw(LinkedShader& shader, glm::vec2 viewport) const;
+    void Delete();
+
+private:
+    struct Range
+    {
+        uint32_t first, count;
+    };
+
+    GLuint vao = 0, pointBuffer = 0, recordBuffer = 0, commandBuffer = 0, indexBuffer = 0;
+    GLsizeiptr pointCapacity = 0, recordCapacity = 0, commandCapacity = 0, indexCapacity = 0; // Bytes
+    uint32_t pointEnd = 0; // Points past the last allocated range are free
+    uint32_t quads = 0; // Segments the index buffer covers
+    std::vector<Range> freeRanges; // Sorted, never adjacent
+    std::vector<CurveRecord> records;
+    std::vector<uint32_t> reserved; // Points allocated to each slot, may exceed the count after an edit
+    std::vector<uint32_t> freeSlots;
+    uint32_t liveCount = 0, pointCount = 0;
+    size_t bytes = 0;
+
+    uint32_t allocate(uint32_t count);
+    void release(Range range);
+    void indexQuads(uint32_t segments);
+    void write(uint32_t id, const std::vector<glm::vec3>& points);
+    void writeSlot(uint32_t id);
+};
+
+
+uint32_t CurveCollection::allocate(uint32_t count)
+{
+    for (size_t i = 0; i < freeRanges.size(); i++) {
+        Range& range = freeRanges[i];
+        if (range.count < count)
+            continue;
+        uint32_t first = range.first;
+        range.first += count;
+        range.count -= count;
+        if (range.count == 0)
+            freeRanges.erase(freeRanges.begin() + i);
+        return first;
+    }
+    uint32_t first = pointEnd;
+    pointEnd += count;
+    growBuffer(pointBuffer, pointCapacity, GLsizeiptr(first) * sizeof(glm::vec4), GLsizeiptr(pointEnd) * sizeof(glm::vec4));
+    return first;
+}
+
+// Merged with its neighbours, the range at the end goes back to the unallocated tail
+void CurveCollection::release(Range range)
+{
+    if (range.count == 0)
+        return;
+    auto next = std::lower_bound(freeRanges.begin(), freeRanges.end(), range,
+                                 [](const Range& a, const Range& b) { return a.first < b.first; });
+    if (next != freeRanges.end() && range.first + range.count == next->first) {
+        range.count += next->count;
+        next = freeRanges.erase(next);
+    }
+    if (next != freeRanges.begin() && std::prev(next)->first + std::prev(next)->count == range.first) {
+        auto previous = std::prev(next);
+        range.first = previous->first;
+        range.count += previous->count;
+        next = freeRanges.erase(previous);
+    }
+    if (range.first + range.count == pointEnd)
+        pointEnd = range.first;
+    else
+        freeRanges.insert(next, range);
+}
+
+// Quad k joins points k and k + 1, the pattern is the same for every curve
+void CurveCollection::indexQuads(uint32_t segments)
+{
+    if (segments <= quads)
+        return;
+    if (!vao)
+        glGenVertexArrays(1, &vao);
+    segments = std::max(segments, quads * 2);
+    std::vector<GLuint> indices;
+    indices.reserve(size_t(segments - quads) * 6);
+    for (GLuint k = quads; k < segments; k++)
+        indices.insert(indices.end(), { 2 * k, 2 * k + 1, 2 * k + 2, 2 * k + 1, 2 * k + 3, 2 * k + 2 });
+    GLsizeiptr used = GLsizeiptr(quads) * 6 * sizeof(GLuint);
+    growBuffer(indexBuffer, indexCapacity, used, GLsizeiptr(segments) * 6 * sizeof(GLuint));
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, used, GLsizeiptr(indices.size() * sizeof(GLuint)), indices.data());
+    glBindVertexArray(0);
+    bytes += indices.size() * sizeof(GLuint);
+    quads = segments;
+}
+
+void CurveCollection::write(uint32_t id, const std::vector<glm::vec3>& points)
+{
+    std::vector<glm::vec4> padded;
+    padded.reserve(points.size());
+    for (const auto& point : points)
+        padded.emplace_back(point, 1.0f);
+    if (!padded.empty()) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, GLintptr(records[id].first) * sizeof(glm::vec4),
+                        GLsizeiptr(padded.size() * sizeof(glm::vec4)), padded.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        bytes += padded.size() * sizeof(glm::vec4);
+    }
+    indexQuads(records[id].count > 0 ? records[id].count - 1 : 0);
+}
+
+// Record and draw command of one slot
+void CurveCollection::writeSlot(uint32_t id)
+{
+    const CurveRecord& record = records[id];
+    DrawElementsIndirectCommand command = { record.count > 1 ? 6 * (record.count - 1) : 0, 1, 0,
+                                            GLint(2 * record.first), id };
+    growBuffer(recordBuffer, recordCapacity, GLsizeiptr(id) * sizeof(CurveRecord), GLsizeiptr(id + 1) * sizeof(CurveRecord));
+    growBuffer(commandBuffer, commandCapacity, GLsizeiptr(id) * sizeof(DrawElementsIndirectCommand),
+               GLsizeiptr(id + 1) * sizeof(DrawElementsIndirectCommand));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, recordBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, GLintptr(id) * sizeof(CurveRecord), sizeof(CurveRecord), &record);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, GLintptr(id) * sizeof(DrawElementsIndirectCommand), sizeof(command), &command);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    bytes += sizeof(CurveRecord) + sizeof(command);
+}
+
+// Returns the id of the curve, ids of removed curves are reused
+uint32_t CurveCollection::add(const std::vector<glm::vec3>& points, glm::vec4 color, float thickness)
+{
+    uint32_t id;
+    if (!freeSlots.empty()) {
+        id = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    else {
+        id = uint32_t(records.size());
+        records.emplace_back();
+        reserved.push_back(0);
+    }
+    auto count = uint32_t(points.size());
+    records[id] = { color, allocate(count), count, thickness, 0 };
+    reserved[id] = count;
+    write(id, points);
+    writeSlot(id);
+    liveCount++;
+    pointCount += count;
+    return id;
+}
+
+// In place while the curve fits its range, otherwise it moves to a new one
+void CurveCollection::update(uint32_t id, const std::vector<glm::vec3>& points)
+{
+    auto count = uint32_t(points.size());
+    CurveRecord& record = records[id];
+    pointCount += count - record.count;
+    if (count > reserved[id]) {
+        release({ record.first, reserved[id] });
+        record.first = allocate(count);
+        reserved[id] = count;
+    }
+    record.count = count;
+    write(id, points);
+    writeSlot(id);
+}
+
+void CurveCollection::setStyle(uint32_t id, glm::vec4 color, float thickness)
+{
+    records[id].color = color;
+    records[id].thickness = thickness;
+    writeSlot(id);
+}
+
+void CurveCollection::remove(uint32_t id)
+{
+    CurveRecord& record = records[id];
+    release({ record.first, reserved[id] });
+    pointCount -= record.count;
+    record.first = record.count = 0;
+    reserved[id] = 0;
+    writeSlot(id);
+    freeSlots.push_back(id);
+    liveCount--;
+}
+
+// The buffers keep their storage for the next curves
+void CurveCollection::clear()
+{
+    records.clear();
+    reserved.clear();
+    freeSlots.clear();
+    freeRanges.clear();
+    pointEnd = 0;
+    liveCount = pointCount = 0;
+}
+
+// The shader is active with view and projection set
+void CurveCollection::draw(LinkedShader& shader, glm::vec2 viewport) const
+{
+    if (liveCount == 0)
+        return;
+    shader.SetVec2("viewport", viewport);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, pointBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, recordBuffer);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, GLsizei(records.size()), 0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+void CurveCollection::Delete()
+{
+    if (vao)
+        glDeleteVertexArrays(1, &vao);
+    for (GLuint* buffer : { &pointBuffer, &recordBuffer, &commandBuffer, &indexBuffer })
+        if (*buffer)
+            glDeleteBuffers(1, buffer);
+    vao = pointBuffer = recordBuffer = commandBuffer = indexBuffer = 0;
+    pointCapacity = recordCapacity = commandCapacity = indexCapacity = 0;
+    quads = 0;
+    clear();
+}
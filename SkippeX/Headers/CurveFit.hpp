@@ -0,0 +1,204 @@
+#pragma once
+
+#include "Curve.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Control points of a uniform cubic B-spline (Curve) fitted by least squares to noisy samples.
+// Samples are parametrized by chord length, so sample i sits at a fixed point of one segment and only touches the
+// four control points of that segment. The normal equations are then banded with 3 sub diagonals and are solved by a
+// banded Cholesky factorization, linear in the number of samples and control points.
+struct CurveFit
+{
+    std::vector<glm::vec3> control_points;
+    float maxError = 0.f; // Largest distance between a sample and the curve at its parameter
+    float rmsError = 0.f;
+    float bias = 0.f; // Largest mean residual over WINDOW consecutive samples
+};
+
+class CurveFitter
+{
+public:
+    static constexpr int BAND = 4; // Diagonal and 3 sub diagonals
+    static constexpr int WINDOW = 8; // Samples averaged by CurveFit::bias
+
+    float smoothing = 1e-4f; // Weight of the second differences of the control points, relative to the samples
+
+    bool fit(const std::vector<glm::vec3>& samples, int controlPoints, CurveFit& result);
+    bool fitTolerance(const std::vector<glm::vec3>& samples, float tolerance, CurveFit& result, int maxControlPoints = 0);
+
+private:
+    std::vector<float> params; // Global parameter of every sample, in [0, segments]
+    std::vector<float> band; // Row major, band[i * BAND + d] is A(i, i - d)
+    std::vector<glm::vec3> rhs;
+    std::vector<glm::vec3> residuals; // Prefix sums
+
+    void parametrize(const std::vector<glm::vec3>& samples);
+    static void weights(float u, float w[4]);
+    bool factorize(int n);
+    void solve(int n, std::vector<glm::vec3>& x) const;
+};
+
+
+void CurveFitter::weights(float u, float w[4])
+{
+    const float powers[4] = { u * u * u, u * u, u, 1.f };
+    for (int k = 0; k < 4; k++) {
+        w[k] = 0.f;
+        for (int j = 0; j < 4; j++)
+            w[k] += powers[j] * UniformBSpline::M[j][k];
+    }
+}
+
+// Chord length parameters normalized to [0, 1], scaled by the segment count in fit()
+void CurveFitter::parametrize(const std::vector<glm::vec3>& samples)
+{
+    params.resize(samples.size());
+    params[0] = 0.f;
+    for (size_t i = 1; i < samples.size(); i++)
+        params[i] = params[i - 1] + glm::length(samples[i] - samples[i - 1]);
+    float length = params.back();
+    for (auto& t : params)
+        t = length > 0.f ? t / length : 0.f;
+    // Samples that did not move get spread evenly
+    if (length <= 0.f)
+        for (size_t i = 0; i < samples.size(); i++)
+            params[i] = samples.size() > 1 ? float(i) / float(samples.size() - 1) : 0.f;
+}
+
+// In place, L is stored over the lower band of A
+bool CurveFitter::factorize(int n)
+{
+    for (int i = 0; i < n; i++) {
+        for (int d = std::min(i, BAND - 1); d >= 0; d--) {
+            int j = i - d;
+            float sum = band[i * BAND + d];
+            for (int k = std::max(0, i - (BAND - 1)); k < j; k++)
+                sum -= band[i * BAND + (i - k)] * band[j * BAND + (j - k)];
+            if (d == 0) {
+                if (sum <= 0.f)
+                    return false;
+                band[i * BAND] = std::sqrt(sum);
+            }
+            else
+                band[i * BAND + d] = sum / band[j * BAND];
+        }
+    }
+    return true;
+}
+
+void CurveFitter::solve(int n, std::vector<glm::vec3>& x) const
+{
+    x = rhs;
+    for (int i = 0; i < n; i++) {
+        for (int d = 1; d < BAND && d <= i; d++)
+            x[i] -= band[i * BAND + d] * x[i - d];
+        x[i] /= band[i * BAND];
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        for (int d = 1; d < BAND && i + d < n; d++)
+            x[i] -= band[(i + d) * BAND + d] * x[i + d];
+        x[i] /= band[i * BAND];
+    }
+}
+
+// Least squares control points for a fixed count, at least 4
+bool CurveFitter::fit(const std::vector<glm::vec3>& samples, int controlPoints, CurveFit& result)
+{
+    if (samples.size() < 2 || controlPoints < 4)
+        return false;
+    parametrize(samples);
+    int n = controlPoints;
+    int segments = n - 3;
+    band.assign(size_t(n) * BAND, 0.f);
+    rhs.assign(n, glm::vec3(0.f));
+
+    for (size_t i = 0; i < samples.size(); i++) {
+        float t = params[i] * float(segments);
+        int s = std::min(int(t), segments - 1);
+        float w[4];
+        weights(t - float(s), w);
+        for (int a = 0; a < 4; a++) {
+            rhs[s + a] += w[a] * samples[i];
+            for (int b = 0; b <= a; b++)
+                band[(s + a) * BAND + (a - b)] += w[a] * w[b];
+        }
+    }
+
+    // Second differences P[j] - 2 P[j + 1] + P[j + 2] keep spans without samples determined
+    float lambda = smoothing * float(samples.size()) / float(n);
+    const float diff[3] = { 1.f, -2.f, 1.f };
+    for (int j = 0; j + 2 < n; j++)
+        for (int a = 0; a < 3; a++)
+            for (int b = 0; b <= a; b++)
+                band[(j + a) * BAND + (a - b)] += lambda * diff[a] * diff[b];
+
+    if (!factorize(n))
+        return false;
+    solve(n, result.control_points);
+
+    double squared = 0.0;
+    result.maxError = 0.f;
+    residuals.resize(samples.size() + 1);
+    residuals[0] = glm::vec3(0.f);
+    for (size_t i = 0; i < samples.size(); i++) {
+        float t = params[i] * float(segments);
+        int s = std::min(int(t), segments - 1);
+        float w[4];
+        weights(t - float(s), w);
+        const glm::vec3* P = &result.control_points[s];
+        glm::vec3 residual = w[0] * P[0] + w[1] * P[1] + w[2] * P[2] + w[3] * P[3] - samples[i];
+        float error = glm::length(residual);
+        result.maxError = std::max(result.maxError, error);
+        squared += double(error) * error;
+        residuals[i + 1] = residuals[i] + residual;
+    }
+    result.rmsError = float(std::sqrt(squared / double(samples.size())));
+    // Prefix sums of the residuals give every window mean in constant time
+    int window = std::min(int(samples.size()), WINDOW);
+    result.bias = 0.f;
+    for (size_t i = window; i <= samples.size(); i++)
+        result.bias = std::max(result.bias, glm::length(residuals[i] - residuals[i - window]) / float(window));
+    return true;
+}
+
+// Fewest control points whose fit is within tolerance everywhere. The error is the bias rather than the largest
+// residual: the jitter of the samples averages out over a window so it does not force more control points, while a
+// curve that cuts a corner stays on one side of the samples and does not.
+// The segment count doubles until the fit is close enough then a bisection finds the smallest one, about 2 log2(n)
+// solves of linear cost each.
+bool CurveFitter::fitTolerance(const std::vector<glm::vec3>& samples, float tolerance, CurveFit& result, int maxControlPoints)
+{
+    if (samples.size() < 2)
+        return false;
+    int most = maxControlPoints > 0 ? maxControlPoints : int(samples.size()) + 2;
+    most = std::max(most, 4);
+    CurveFit trial;
+    int good = -1, bad = 3;
+    for (int n = 4;; n = std::min(most, 3 + 2 * (n - 3))) {
+        if (fit(samples, n, trial) && trial.bias <= tolerance) {
+            good = n;
+            result = trial;
+            break;
+        }
+        bad = n;
+        if (n == most)
+            break;
+    }
+    if (good < 0)
+        return fit(samples, most, result);
+    while (good - bad > 1) {
+        int n = (good + bad) / 2;
+        if (fit(samples, n, trial) && trial.bias <= tolerance) {
+            good = n;
+            result = trial;
+        }
+        else
+            bad = n;
+    }
+    return true;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "Curve.hpp"
+#include "shader.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Control points of a curve drawn as GL_PATCHES of 4 vertices, evaluated by curve.tesc / curve.tese on the GPU.
+// Patches share their control points through the index buffer, so moving one control point is a 12 byte upload
+// whatever the length of the curve. The basis matrix is a uniform, every BasicCurve basis draws through the same code.
+class CurvePatches
+{
+public:
+    float pixelsPerSegment = 4.0f; // Screen length of the line pieces the tessellator aims for
+
+    uint32_t size() const { return controls; }
+    uint32_t patches() const { return patchCount; }
+    size_t uploaded() const { return bytes; } // Since the last resetStats
+    void resetStats() { bytes = 0; }
+
+    template<typename Basis>
+    void assign(const BasicCurve<Basis>& curve);
+    template<typename Basis>
+    void update(const BasicCurve<Basis>& curve, int first);
+    void updatePoint(int index, const glm::vec3& point);
+    void draw(LinkedShader& shader, glm::vec2 viewport) const;
+    void Delete();
+
+private:
+    GLuint vao = 0, vbo = 0, ebo = 0;
+    uint32_t controls = 0;
+    uint32_t capacity = 0; // Control points the buffers can hold
+    uint32_t patchCount = 0;
+    int stride = 1;
+    glm::mat4 basis = glm::mat4(1.0f);
+    size_t bytes = 0;
+
+    bool reserve(uint32_t n);
+    void index(uint32_t segments);
+};
+
+
+// Buffers only grow, the vertex array keeps pointing at the same names. Returns true when the content was lost.
+bool CurvePatches::reserve(uint32_t n)
+{
+    if (vao && n <= capacity)
+        return false;
+    if (!vao) {
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vbo);
+        glGenBuffers(1, &ebo);
+    }
+    capacity = std::max(n, std::max(capacity * 2, 64u));
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, GLsizeiptr(capacity) * sizeof(glm::vec3), NULL, GL_DYNAMIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void *)0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, GLsizeiptr(capacity) * 4 * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    patchCount = 0; // The indices are gone with the old storage
+    return true;
+}
+
+// Segment s reads control points s * stride to s * stride + 3, only the patches not indexed yet are written
+void CurvePatches::index(uint32_t segments)
+{
+    if (segments > patchCount) {
+        std::vector<GLuint> indices;
+        indices.reserve(size_t(segments - patchCount) * 4);
+        for (uint32_t s = patchCount; s < segments; s++)
+            for (GLuint k = 0; k < 4; k++)
+                indices.push_back(GLuint(s * stride) + k);
+        // The element buffer binding belongs to the vertex array
+        glBindVertexArray(vao);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, GLintptr(patchCount) * 4 * sizeof(GLuint),
+                        GLsizeiptr(indices.size()) * sizeof(GLuint), indices.data());
+        glBindVertexArray(0);
+        bytes += indices.size() * sizeof(GLuint);
+    }
+    patchCount = segments;
+}
+
+template<typename Basis>
+void CurvePatches::assign(const BasicCurve<Basis>& curve)
+{
+    if (stride != Basis::STRIDE)
+        patchCount = 0;
+    stride = Basis::STRIDE;
+    for (int k = 0; k < 4; k++)
+        for (int j = 0; j < 4; j++)
+            basis[k][j] = Basis::M[j][k];
+    controls = 0;
+    update(curve, 0);
+}
+
+// Control points from first to the end, after an insertion or a removal shifted them
+template<typename Basis>
+void CurvePatches::update(const BasicCurve<Basis>& curve, int first)
+{
+    auto n = uint32_t(curve.control_points.size());
+    if (reserve(n))
+        first = 0;
+    if (uint32_t(first) < n) {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, GLintptr(first) * sizeof(glm::vec3), GLsizeiptr(n - first) * sizeof(glm::vec3),
+                        &curve.control_points[first]);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        bytes += size_t(n - first) * sizeof(glm::vec3);
+    }
+    controls = n;
+    index(uint32_t(std::max(0, curve.segments())));
+}
+
+void CurvePatches::updatePoint(int index, const glm::vec3& point)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, GLintptr(index) * sizeof(glm::vec3), sizeof(glm::vec3), &point);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    bytes += sizeof(glm::vec3);
+}
+
+// The shader is active with view and projection set
+void CurvePatches::draw(LinkedShader& shader, glm::vec2 viewport) const
+{
+    if (patchCount == 0)
+        return;
+    shader.SetMat4("basis", basis);
+    shader.SetVec2("viewport", viewport);
+    shader.SetFloat("pixelsPerSegment", pixelsPerSegment);
+    glPatchParameteri(GL_PATCH_VERTICES, 4);
+    glBindVertexArray(vao);
+    glDrawElements(GL_PATCHES, GLsizei(patchCount) * 4, GL_UNSIGNED_INT, 0);
+    glBindVertexArray(0);
+}
+
+void CurvePatches::Delete()
+{
+    if (vao) {
+        glDeleteVertexArrays(1, &vao);
+        glDeleteBuffers(1, &vbo);
+        glDeleteBuffers(1, &ebo);
+    }
+    vao = vbo = ebo = 0;
+    controls = capacity = patchCount = 0;
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "Readback.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+// A stroke sample resolved against the depth buffer of the frame it was drawn in
+struct DepthSample
+{
+    glm::vec2 pixel;                    // Window coordinates, origin at the bottom left
+    double time = 0.0;                  // Cursor timestamp given with the request
+    int tag = 0;                        // Tag of the request
+    glm::vec3 origin = glm::vec3(0.f);  // Pixel on the near plane of that frame, where its ray starts
+    glm::vec3 point = glm::vec3(0.f);   // World space
+    glm::vec3 normal = glm::vec3(0.f);  // World space, facing the camera
+    bool miss = true;                   // Fell on the far plane or outside the window
+    bool resolved = false;              // False when the readback was dropped or had no room for the sample
+};
+
+// Places stroke samples on whatever was rendered : the multisampled depth of the frame is resolved into a single
+// sample target, small rectangles around the samples are read back asynchronously and every sample is unprojected
+// with the inverse camera matrix of that frame. Normals come from the neighbouring depths. Every sample comes back
+// once, in request order.
+class DepthPicker
+{
+public:
+    static constexpr int TILE = 64; // Largest side of the rectangles samples are grouped in, in pixels
+    static constexpr int MAX_PIXELS = 256 * 256; // Pixels read back per request
+
+    GLuint FBO = 0;
+    GLuint depthRBO = 0;
+
+    DepthPicker(int width, int height);
+
+    // Requests poll has not returned yet, dropped ones included
+    int inFlight() const { return readback.inFlight() + (dropped.empty() ? 0 : 1); }
+    void request(GLuint sourceFBO, const std::vector<glm::vec2>& pixels, const std::vector<double>& times, int tag,
+                 const glm::mat4& invCM);
+    bool poll(std::vector<DepthSample>& samples);
+    void Delete();
+
+private:
+    struct Pending
+    {
+        std::vector<glm::vec2> pixels;
+        std::vector<double> times;
+        std::vector<int> tiles; // Readback rectangle of each sample, -1 if it did not fit
+        int tag;
+        glm::mat4 invCM;
+    };
+
+    int width, height;
+    PixelReadback readback;
+    Pending pending[PixelReadback::RING_SIZE];
+    std::vector<DepthSample> dropped; // Samples of requests pushed out of the ring, returned unresolved
+
+    DepthSample sample(const Pending& request, size_t i) const;
+    glm::vec3 unproject(const glm::mat4& invCM, float px, float py, float depth) const;
+};
+
+
+DepthPicker::DepthPicker(int width, int height)
+    : width(width), height(height), readback(MAX_PIXELS * sizeof(float))
+{
+    // Same format as the multisampled renderbuffer so that the resolve blit is allowed
+    glGenFramebuffers(1, &FBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    glGenRenderbuffers(1, &depthRBO);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthRBO);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthRBO);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+
+    auto fboStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (fboStatus != GL_FRAMEBUFFER_COMPLETE)
+        std::cout << "Depth picker framebuffer error: " << fboStatus << std::endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// A miss until its depth is known
+DepthSample DepthPicker::sample(const Pending& request, size_t i) const
+{
+    DepthSample sample;
+    sample.pixel = request.pixels[i];
+    sample.time = request.times[i];
+    sample.tag = request.tag;
+    sample.origin = unproject(request.invCM, std::floor(sample.pixel.x), std::floor(sample.pixel.y), 0.f);
+    return sample;
+}
+
+// Resolve and queue the depths around the given samples, with a one pixel border for the normals. times has one
+// entry per pixel. Samples outside the window come back as misses, the ones past MAX_PIXELS unresolved.
+void DepthPicker::request(GLuint sourceFBO, const std::vector<glm::vec2>& pixels, const std::vector<double>& times,
+                          int tag, const glm::mat4& invCM)
+{
+    if (pixels.empty())
+        return;
+
+    Pending queued = { pixels, times, {}, tag, invCM };
+    std::vector<ReadbackRect> rects;
+    tilePixels(pixels, TILE, 1, width, height, rects, queued.tiles);
+    int fitting = 0;
+    for (int area = 0; fitting < int(rects.size()) && area + rects[fitting].w * rects[fitting].h <= MAX_PIXELS; fitting++)
+        area += rects[fitting].w * rects[fitting].h;
+    rects.resize(fitting);
+    for (int& tile : queued.tiles)
+        if (tile >= fitting)
+            tile = -1;
+
+    // Rendering usually goes on in the source framebuffer afterwards, keep it bound
+    GLint drawFBO = 0;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFBO);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, sourceFBO);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, FBO);
+    for (const auto& rect : rects)
+        glBlitFramebuffer(rect.x, rect.y, rect.x + rect.w, rect.y + rect.h,
+                          rect.x, rect.y, rect.x + rect.w, rect.y + rect.h, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, GLuint(drawFBO));
+
+    if (readback.inFlight() == PixelReadback::RING_SIZE) {
+        const Pending& lost = pending[readback.oldest()];
+        for (size_t i = 0; i < lost.pixels.size(); i++)
+            dropped.push_back(sample(lost, i));
+    }
+    int slot = readback.request(FBO, GL_NONE, rects, GL_DEPTH_COMPONENT, GL_FLOAT, sizeof(float));
+    if (slot < 0) {
+        for (size_t i = 0; i < pixels.size(); i++)
+            dropped.push_back(sample(queued, i));
+        return;
+    }
+    pending[slot] = std::move(queued);
+}
+
+glm::vec3 DepthPicker::unproject(const glm::mat4& invCM, float px, float py, float depth) const
+{
+    return unprojectPixel(invCM, width, height, px, py, depth);
+}
+
+// Non blocking, appends the samples of every readback completed since the last call, oldest first
+bool DepthPicker::poll(std::vector<DepthSample>& samples)
+{
+    bool found = !dropped.empty();
+    samples.insert(samples.end(), dropped.begin(), dropped.end());
+    dropped.clear();
+    readback.poll([&](int slot, const std::vector<ReadbackRect>& rects, const void* data) {
+        const Pending& request = pending[slot];
+        std::vector<const float*> tileDepths(rects.size());
+        auto* depths = (const float*)data;
+        for (size_t k = 0; k < rects.size(); k++) {
+            tileDepths[k] = depths;
+            depths += rects[k].w * rects[k].h;
+        }
+
+        for (size_t i = 0; i < request.pixels.size(); i++) {
+            DepthSample sample = this->sample(request, i);
+            if (request.tiles[i] < 0) {
+                samples.push_back(sample);
+                continue;
+            }
+            sample.resolved = true;
+            const ReadbackRect& rect = rects[request.tiles[i]];
+            const float* tile = tileDepths[request.tiles[i]];
+            auto depthAt = [&](int x, int y) {
+                x = glm::clamp(x, rect.x, rect.x + rect.w - 1);
+                y = glm::clamp(y, rect.y, rect.y + rect.h - 1);
+                return tile[(y - rect.y) * rect.w + (x - rect.x)];
+            };
+            int x = int(std::floor(sample.pixel.x)), y = int(std::floor(sample.pixel.y));
+            if (x < rect.x || y < rect.y || x >= rect.x + rect.w || y >= rect.y + rect.h) {
+                samples.push_back(sample);
+                continue;
+            }
+            float d = depthAt(x, y);
+            if (d >= 1.f) {
+                samples.push_back(sample);
+                continue;
+            }
+            sample.miss = false;
+            sample.point = unproject(request.invCM, float(x), float(y), d);
+
+            // Central differences would blur normals across silhouettes, take the side closest in depth instead
+            float dl = depthAt(x - 1, y), dr = depthAt(x + 1, y);
+            float db = depthAt(x, y - 1), dt = depthAt(x, y + 1);
+            glm::vec3 dx = std::fabs(dr - d) < std::fabs(dl - d)
+                    ? unproject(request.invCM, float(x + 1), float(y), dr) - sample.point
+                    : sample.point - unproject(request.invCM, float(x - 1), float(y), dl);
+            glm::vec3 dy = std::fabs(dt - d) < std::fabs(db - d)
+                    ? unproject(request.invCM, float(x), float(y + 1), dt) - sample.point
+                    : sample.point - unproject(request.invCM, float(x), float(y - 1), db);
+            glm::vec3 n = glm::cross(dx, dy);
+            if (glm::dot(n, n) > 0.f) {
+                n = glm::normalize(n);
+                glm::vec3 eyeDir = sample.point - sample.origin;
+                sample.normal = glm::dot(n, eyeDir) > 0.f ? -n : n;
+            }
+            samples.push_back(sample);
+        }
+        found = true;
+    });
+    return found;
+}
+
+void DepthPicker::Delete()
+{
+    readback.Delete();
+    glDeleteRenderbuffers(1, &depthRBO);
+    glDeleteFramebuffers(1, &FBO);
+}
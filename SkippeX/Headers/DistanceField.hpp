@@ -0,0 +1,477 @@
+#pragma once
+
+#include "BVH.hpp"
+#include "PrimitiveStore.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Stroke point kept relative to the surface it was drawn on, so that its height can be changed afterwards
+struct SurfaceAnchor
+{
+    glm::vec3 point;
+    glm::vec3 normal;
+    PrimitiveHandle handle = INVALID_PRIMITIVE;
+};
+
+// Sparse signed distance field of a BVH, in its object space. The grid is cut in bricks of BRICK^3 cells and only the
+// bricks closer to the surface than the band are stored. Every brick keeps its own (BRICK + 1)^3 corner samples so that
+// a lookup reads a single brick, and a dense table of brick slots keeps every query constant time.
+// The sign comes from the angle weighted pseudonormal of the corner, edge or face the nearest point lies on, which stays
+// right along creases where the faces sharing that point disagree. Open meshes get a consistent but arbitrary inside.
+class DistanceField
+{
+public:
+    static constexpr int BRICK = 8;
+    static constexpr int BRICK_SAMPLES = (BRICK + 1) * (BRICK + 1) * (BRICK + 1);
+
+    DistanceField() {};
+
+    void bake(const BVH& bvh, float band, int resolution, ThreadPool& pool);
+    bool bakeCached(const BVH& bvh, float band, int resolution, ThreadPool& pool, const std::string& path);
+    bool save(const std::string& path) const;
+    bool load(const std::string& path, uint64_t expectedKey);
+
+    bool empty() const { return samples.empty(); }
+    float cell() const { return cellSize; }
+    size_t bytes() const { return samples.size() * sizeof(float) + slots.size() * sizeof(int32_t); }
+    bool contains(const glm::vec3& p) const;
+    float distance(const glm::vec3& p) const;
+    glm::vec3 gradient(const glm::vec3& p) const;
+    glm::vec3 project(glm::vec3 p, float height, int iterations = 4) const;
+
+private:
+    uint64_t key = 0; // Hash of the geometry and settings it was baked from, checked against the disk cache
+    float band = 0.f;
+    float cellSize = 1.f;
+    glm::vec3 origin = glm::vec3(0.f);
+    glm::ivec3 bricks = glm::ivec3(0); // Grid size in bricks
+    std::vector<int32_t> slots;        // Brick -> offset of its first sample, -1 outside the band
+    std::vector<float> samples;
+
+    static uint64_t hashGeometry(const BVH& bvh, float band, int resolution);
+    static void pseudonormals(const BVH& bvh, std::vector<glm::vec3>& normals);
+    bool locate(const glm::vec3& p, int32_t& slot, glm::vec3& local) const;
+};
+
+// Header of the cache files, followed by the slots and the samples
+struct DistanceFieldFile
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    float band, cellSize;
+    float origin[3];
+    int32_t bricks[3];
+    uint64_t sampleCount;
+};
+
+const uint32_t DISTANCE_FIELD_VERSION = 2;
+
+
+// resolution is the number of cells along the longest side of the bounds grown by the band
+void DistanceField::bake(const BVH& bvh, float band, int resolution, ThreadPool& pool)
+{
+    key = hashGeometry(bvh, band, resolution);
+    this->band = band;
+    slots.clear();
+    samples.clear();
+    AABB bounds = bvh.bounds();
+    if (bounds.bmin.x > bounds.bmax.x)
+        return;
+
+    origin = bounds.bmin - glm::vec3(band);
+    glm::vec3 extent = bounds.bmax + glm::vec3(band) - origin;
+    cellSize = std::max(extent.x, std::max(extent.y, extent.z)) / float(std::max(BRICK, resolution));
+    float brickSize = cellSize * BRICK;
+    bricks = glm::ivec3(std::max(1, int(std::ceil(extent.x / brickSize))), std::max(1, int(std::ceil(extent.y / brickSize))),
+                        std::max(1, int(std::ceil(extent.z / brickSize))));
+    auto total = uint32_t(bricks.x * bricks.y * bricks.z);
+    auto brickOrigin = [&](uint32_t b) {
+        glm::ivec3 c(b % bricks.x, (b / bricks.x) % bricks.y, b / (bricks.x * bricks.y));
+        return origin + glm::vec3(c * BRICK) * cellSize;
+    };
+
+    // A brick is kept when its center is within the band plus half its diagonal from the surface
+    float halfDiagonal = 0.5f * std::sqrt(3.f) * BRICK * cellSize;
+    float reach = band + halfDiagonal;
+    std::vector<char> keep(total, 0);
+    pool.parallelFor(total, 64, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t b = begin; b < end; b++) {
+            PointHit hit;
+            keep[b] = bvh.closestPoint(brickOrigin(b) + glm::vec3(0.5f * BRICK * cellSize), reach, hit);
+        }
+    });
+    std::vector<uint32_t> kept;
+    slots.assign(total, -1);
+    for (uint32_t b = 0; b < total; b++) {
+        if (keep[b]) {
+            slots[b] = int32_t(kept.size() * BRICK_SAMPLES);
+            kept.push_back(b);
+        }
+    }
+
+    // Samples farther than any point of the brick can be from the band only need to know they are outside
+    float limit = reach + halfDiagonal;
+    std::vector<glm::vec3> normals;
+    pseudonormals(bvh, normals);
+    samples.assign(kept.size() * BRICK_SAMPLES, limit);
+    pool.parallelFor(uint32_t(kept.size()), 1, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t k = begin; k < end; k++) {
+            glm::vec3 corner = brickOrigin(kept[k]);
+            float* out = &samples[size_t(k) * BRICK_SAMPLES];
+            // Distance is 1-Lipschitz, the previous sample bounds the search radius of the next one
+            glm::vec3 previous = corner;
+            float previousDistance = limit;
+            for (int z = 0; z <= BRICK; z++)
+                for (int y = 0; y <= BRICK; y++)
+                    for (int x = 0; x <= BRICK; x++, out++) {
+                        glm::vec3 p = corner + glm::vec3(x, y, z) * cellSize;
+                        float radius = std::min(limit, previousDistance + glm::length(p - previous) * 1.001f);
+                        previous = p;
+                        previousDistance = limit;
+                        PointHit hit;
+                        if (!bvh.closestPoint(p, radius, hit))
+                            continue;
+                        previousDistance = hit.distance;
+                        glm::vec3 n = normals[7 * size_t(hit.prim) + size_t(hit.feature)];
+                        bool outside = glm::dot(p - hit.point, n) >= 0.f;
+                        *out = outside ? hit.distance : -hit.distance;
+                    }
+        }
+    });
+}
+
+// Angle weighted pseudonormals (Baerentzen and Aanaes) of the BVH triangles, unnormalized, indexed
+// 7 * triangle + TriangleFeature. Triangles without area do not contribute and borrow the normals of their edges.
+void DistanceField::pseudonormals(const BVH& bvh, std::vector<glm::vec3>& normals)
+{
+    const TriangleSoA& tris = bvh.triangles;
+    uint32_t n = tris.count;
+
+    // Corners are rebuilt from one vertex and two edges, so copies of a vertex only agree up to rounding. They are
+    // welded within a tolerance through a grid of that spacing, where a match can only be in a neighbouring cell.
+    glm::vec3 lo(std::numeric_limits<float>::max()), hi(-std::numeric_limits<float>::max());
+    for (uint32_t i = 0; i < n; i++)
+        for (int k = 0; k < 3; k++) {
+            lo = glm::min(lo, tris.vertex(i, k));
+            hi = glm::max(hi, tris.vertex(i, k));
+        }
+    float extent = n > 0 ? glm::max(glm::max(hi.x - lo.x, hi.y - lo.y), hi.z - lo.z) : 0.f;
+    float tolerance = std::max(extent * 1e-5f, std::numeric_limits<float>::min());
+    auto cellKey = [](const glm::ivec3& c) {
+        return uint64_t(uint32_t(c.x) & 0x1FFFFF) << 42 | uint64_t(uint32_t(c.y) & 0x1FFFFF) << 21 |
+               uint64_t(uint32_t(c.z) & 0x1FFFFF);
+    };
+    std::vector<glm::vec3> positions;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> grid;
+    std::vector<uint32_t> welded(3 * size_t(n));
+    for (uint32_t i = 0; i < n; i++)
+        for (int k = 0; k < 3; k++) {
+            glm::vec3 p = tris.vertex(i, k);
+            glm::ivec3 cell(glm::floor((p - lo) / tolerance));
+            uint32_t id = uint32_t(positions.size());
+            for (int dz = -1; dz <= 1 && id == positions.size(); dz++)
+                for (int dy = -1; dy <= 1 && id == positions.size(); dy++)
+                    for (int dx = -1; dx <= 1 && id == positions.size(); dx++) {
+                        auto found = grid.find(cellKey(cell + glm::ivec3(dx, dy, dz)));
+                        if (found == grid.end())
+                            continue;
+                        for (uint32_t other : found->second)
+                            if (glm::length(positions[other] - p) <= tolerance) {
+                                id = other;
+                                break;
+                            }
+                    }
+            if (id == positions.size()) {
+                positions.push_back(p);
+                grid[cellKey(cell)].push_back(id);
+            }
+            welded[3 * i + k] = id;
+        }
+    auto edgeKey = [&](uint32_t i, int k) {
+        uint32_t a = welded[3 * i + k], b = welded[3 * i + (k + 1) % 3];
+        return uint64_t(std::min(a, b)) << 32 | std::max(a, b);
+    };
+
+    // Corners that welded together leave a triangle with a tiny cross product of arbitrary direction
+    auto flat = [&](uint32_t i) {
+        glm::vec3 c = glm::cross(tris.vertex(i, 1) - tris.vertex(i, 0), tris.vertex(i, 2) - tris.vertex(i, 0));
+        return welded[3 * i] == welded[3 * i + 1] || welded[3 * i + 1] == welded[3 * i + 2] ||
+               welded[3 * i + 2] == welded[3 * i] || !(glm::dot(c, c) > 0.f);
+    };
+
+    std::vector<glm::vec3> vertexSum(positions.size(), glm::vec3(0.f));
+    std::unordered_map<uint64_t, glm::vec3> edgeSum;
+    edgeSum.reserve(3 * size_t(n) / 2);
+    for (uint32_t i = 0; i < n; i++) {
+        if (flat(i))
+            continue;
+        glm::vec3 v[3] = { tris.vertex(i, 0), tris.vertex(i, 1), tris.vertex(i, 2) };
+        glm::vec3 normal = tris.normal(i);
+        for (int k = 0; k < 3; k++) {
+            glm::vec3 u = glm::normalize(v[(k + 1) % 3] - v[k]), w = glm::normalize(v[(k + 2) % 3] - v[k]);
+            vertexSum[welded[3 * i + k]] += std::acos(glm::clamp(glm::dot(u, w), -1.f, 1.f)) * normal;
+            edgeSum[edgeKey(i, k)] += normal;
+        }
+    }
+
+    normals.assign(7 * size_t(n), glm::vec3(0.f));
+    for (uint32_t i = 0; i < n; i++) {
+        glm::vec3* triangle = &normals[7 * size_t(i)];
+        for (int k = 0; k < 3; k++) {
+            triangle[int(TriangleFeature::Vertex0) + k] = vertexSum[welded[3 * i + k]];
+            // Edge k runs from corner k to corner k + 1, an edge that welded into a point is that vertex
+            auto edge = edgeSum.find(edgeKey(i, k));
+            glm::vec3& e = triangle[int(TriangleFeature::Edge01) + k];
+            if (welded[3 * i + k] == welded[3 * i + (k + 1) % 3])
+                e = vertexSum[welded[3 * i + k]];
+            else if (edge != edgeSum.end())
+                e = edge->second;
+        }
+        glm::vec3& face = triangle[int(TriangleFeature::Face)];
+        if (!flat(i))
+            face = tris.normal(i);
+        else
+            for (int k = 0; k < 3; k++)
+                face += triangle[int(TriangleFeature::Edge01) + k];
+    }
+}
+
+// Loads the field from path when it was baked from the same geometry and settings, bakes and saves it otherwise.
+// Returns true on a cache hit.
+bool DistanceField::bakeCached(const BVH& bvh, float band, int resolution, ThreadPool& pool, const std::string& path)
+{
+    if (load(path, hashGeometry(bvh, band, resolution)))
+        return true;
+    bake(bvh, band, resolution, pool);
+    if (!save(path))
+        std::cout << "Could not write the distance field cache " << path << std::endl;
+    return false;
+}
+
+bool DistanceField::save(const std::string& path) const
+{
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    DistanceFieldFile header;
+    std::memcpy(header.magic, "SDFB", 4);
+    header.version = DISTANCE_FIELD_VERSION;
+    header.key = key;
+    header.band = band;
+    header.cellSize = cellSize;
+    for (int i = 0; i < 3; i++) {
+        header.origin[i] = origin[i];
+        header.bricks[i] = bricks[i];
+    }
+    header.sampleCount = samples.size();
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+              std::fwrite(slots.data(), sizeof(int32_t), slots.size(), file) == slots.size() &&
+              std::fwrite(samples.data(), sizeof(float), samples.size(), file) == samples.size();
+    return std::fclose(file) == 0 && ok;
+}
+
+bool DistanceField::load(const std::string& path, uint64_t expectedKey)
+{
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+    DistanceFieldFile header;
+    bool ok = std::fread(&header, sizeof(header), 1, file) == 1 && std::memcmp(header.magic, "SDFB", 4) == 0 &&
+              header.version == DISTANCE_FIELD_VERSION && header.key == expectedKey &&
+              header.bricks[0] > 0 && header.bricks[1] > 0 && header.bricks[2] > 0 &&
+              header.sampleCount <= uint64_t(header.bricks[0]) * header.bricks[1] * header.bricks[2] * BRICK_SAMPLES;
+    if (ok) {
+        slots.resize(size_t(header.bricks[0]) * header.bricks[1] * header.bricks[2]);
+        samples.resize(header.sampleCount);
+        ok = std::fread(slots.data(), sizeof(int32_t), slots.size(), file) == slots.size() &&
+             std::fread(samples.data(), sizeof(float), samples.size(), file) == samples.size();
+    }
+    // A truncated or foreign file must not leave a slot pointing past the samples
+    for (size_t b = 0; ok && b < slots.size(); b++)
+        ok = slots[b] == -1 || (slots[b] >= 0 && size_t(slots[b]) + BRICK_SAMPLES <= samples.size());
+    std::fclose(file);
+    if (!ok) {
+        slots.clear();
+        samples.clear();
+        return false;
+    }
+    key = header.key;
+    band = header.band;
+    cellSize = header.cellSize;
+    origin = glm::vec3(header.origin[0], header.origin[1], header.origin[2]);
+    bricks = glm::ivec3(header.bricks[0], header.bricks[1], header.bricks[2]);
+    return true;
+}
+
+// FNV-1a over the triangles in model order, the BVH leaf order is not part of the geometry
+uint64_t DistanceField::hashGeometry(const BVH& bvh, float band, int resolution)
+{
+    uint64_t h = 14695981039346656037ull;
+    auto mix = [&h](const void* data, size_t size) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            h ^= bytes[i];
+            h *= 1099511628211ull;
+        }
+    };
+    mix(&DISTANCE_FIELD_VERSION, sizeof(DISTANCE_FIELD_VERSION));
+    mix(&band, sizeof(band));
+    mix(&resolution, sizeof(resolution));
+    for (uint32_t p : bvh.sourcePrims)
+        for (int k = 0; k < 3; k++) {
+            glm::vec3 v = bvh.triangles.vertex(p, k);
+            mix(&v, sizeof(v));
+        }
+    return h;
+}
+
+bool DistanceField::locate(const glm::vec3& p, int32_t& slot, glm::vec3& local) const
+{
+    if (samples.empty())
+        return false;
+    glm::vec3 c = (p - origin) / cellSize;
+    glm::ivec3 b = glm::ivec3(glm::floor(c / float(BRICK)));
+    if (b.x < 0 || b.y < 0 || b.z < 0 || b.x >= bricks.x || b.y >= bricks.y || b.z >= bricks.z)
+        return false;
+    slot = slots[(b.z * bricks.y + b.y) * bricks.x + b.x];
+    local = c - glm::vec3(b * BRICK);
+    return slot >= 0;
+}
+
+bool DistanceField::contains(const glm::vec3& p) const
+{
+    int32_t slot;
+    glm::vec3 local;
+    return locate(p, slot, local);
+}
+
+// Trilinear inside the brick, points outside the stored band are reported at the band distance
+float DistanceField::distance(const glm::vec3& p) const
+{
+    int32_t slot;
+    glm::vec3 local;
+    if (!locate(p, slot, local))
+        return band;
+    glm::ivec3 i = glm::min(glm::ivec3(local), glm::ivec3(BRICK - 1));
+    glm::vec3 f = local - glm::vec3(i);
+    const int X = 1, Y = BRICK + 1, Z = (BRICK + 1) * (BRICK + 1);
+    const float* s = &samples[slot + i.z * Z + i.y * Y + i.x];
+    float x00 = s[0] + (s[X] - s[0]) * f.x;
+    float x10 = s[Y] + (s[Y + X] - s[Y]) * f.x;
+    float x01 = s[Z] + (s[Z + X] - s[Z]) * f.x;
+    float x11 = s[Z + Y] + (s[Z + Y + X] - s[Z + Y]) * f.x;
+    float y0 = x00 + (x10 - x00) * f.y;
+    float y1 = x01 + (x11 - x01) * f.y;
+    return y0 + (y1 - y0) * f.z;
+}
+
+// Central differences over half a cell, normalized. Zero where the field is flat or not stored.
+glm::vec3 DistanceField::gradient(const glm::vec3& p) const
+{
+    float h = 0.5f * cellSize;
+    glm::vec3 g(distance(p + glm::vec3(h, 0.f, 0.f)) - distance(p - glm::vec3(h, 0.f, 0.f)),
+                distance(p + glm::vec3(0.f, h, 0.f)) - distance(p - glm::vec3(0.f, h, 0.f)),
+                distance(p + glm::vec3(0.f, 0.f, h)) - distance(p - glm::vec3(0.f, 0.f, h)));
+    float length = glm::length(g);
+    return length > 1e-12f ? g / length : glm::vec3(0.f);
+}
+
+// Newton steps along the gradient toward the iso-surface at the given signed height.
+// p should start close to the answer, typically the surface point pushed along its normal.
+glm::vec3 DistanceField::project(glm::vec3 p, float height, int iterations) const
+{
+    for (int i = 0; i < iterations && contains(p); i++) {
+        float error = distance(p) - height;
+        if (std::fabs(error) < 1e-3f * cellSize)
+            break;
+        glm::vec3 g = gradient(p);
+        if (g == glm::vec3(0.f))
+            break;
+        p -= error * g;
+    }
+    return p;
+}
+
+
+// Distance fields of the store models, answering stroke height queries in world space
+class SceneDistanceFields
+{
+public:
+    int resolution = 128; // Cells along the longest side of each field
+
+    SceneDistanceFields(const PrimitiveStore& store, ThreadPool& pool) : store(store), pool(pool) {};
+
+    bool addModel(uint32_t model, const BVH& bvh, float band, const std::string& cachePath);
+    const DistanceField* field(uint32_t model) const;
+    glm::vec3 offset(const SurfaceAnchor& anchor, float height) const;
+    void offsetAll(const std::vector<SurfaceAnchor>& anchors, float height, std::vector<glm::vec3>& positions) const;
+
+private:
+    const PrimitiveStore& store;
+    ThreadPool& pool;
+    std::vector<DistanceField> fields; // Indexed by store model, empty for models without triangles
+};
+
+
+// band is in the model object space. Returns true when the field came from the cache.
+bool SceneDistanceFields::addModel(uint32_t model, const BVH& bvh, float band, const std::string& cachePath)
+{
+    if (fields.size() <= model)
+        fields.resize(model + 1);
+    return fields[model].bakeCached(bvh, band, resolution, pool, cachePath);
+}
+
+const DistanceField* SceneDistanceFields::field(uint32_t model) const
+{
+    return model < fields.size() && !fields[model].empty() ? &fields[model] : nullptr;
+}
+
+// Point at the given height above the surface the anchor was drawn on. Spheres keep measuring heights from their
+// center, triangles follow the field of their model so that the offset surface stays clear of nearby geometry.
+glm::vec3 SceneDistanceFields::offset(const SurfaceAnchor& anchor, float height) const
+{
+    if (handleType(anchor.handle) == PrimitiveType::Sphere)
+        return store.origin(anchor.handle) + anchor.normal * height;
+    uint32_t m = handleModel(anchor.handle);
+    const DistanceField* f = handleType(anchor.handle) == PrimitiveType::Triangle ? field(m) : nullptr;
+    if (!f || store.models[m].instance < 0)
+        return anchor.point + anchor.normal * height;
+
+    const StoreModel& model = store.models[m];
+    const BVHInstance& instance = store.triangles.instances[model.instance];
+    glm::mat3 linear(model.transform);
+    float scale = std::cbrt(std::fabs(glm::determinant(linear)));
+    if (scale <= 0.f)
+        return anchor.point + anchor.normal * height;
+    glm::vec3 p(instance.invTransform * glm::vec4(anchor.point, 1.0f));
+    glm::vec3 n = glm::normalize(glm::transpose(linear) * anchor.normal);
+
+    // Stay on the side the stroke was drawn from, whatever the winding of the surface says
+    float side = glm::dot(f->gradient(p), n) < 0.f ? -1.f : 1.f;
+    float h = height / scale;
+    glm::vec3 q = f->project(p + n * h, side * h);
+    return glm::vec3(model.transform * glm::vec4(q, 1.0f));
+}
+
+void SceneDistanceFields::offsetAll(const std::vector<SurfaceAnchor>& anchors, float height,
+                                    std::vector<glm::vec3>& positions) const
+{
+    positions.resize(anchors.size());
+    pool.parallelFor(uint32_t(anchors.size()), 256, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++)
+            positions[i] = offset(anchors[i], height);
+    });
+}
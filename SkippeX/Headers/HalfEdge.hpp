@@ -0,0 +1,85 @@
+#pragma once
+
+#include "evao.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+// Implicit half-edge structure over an indexed triangle list : half-edge 3 * f + k of face f goes from its corner k
+// to corner (k + 1) % 3, so next / face / origin come from the index alone and only the twins are stored.
+// Vertices are welded by position first, loaders split them along normal and texture seams.
+class HalfEdgeMesh
+{
+public:
+    std::vector<int32_t> twin;    // Opposite half-edge, -1 on borders and non manifold edges
+    std::vector<uint32_t> welded; // Vertex -> first vertex with the same position
+
+    HalfEdgeMesh() {};
+
+    void build(const std::vector<Vertex>& vertices, const std::vector<GLuint>& indices);
+
+    uint32_t faces() const { return uint32_t(twin.size() / 3); }
+    static uint32_t face(uint32_t he) { return he / 3; }
+    static uint32_t next(uint32_t he) { return 3 * (he / 3) + (he + 1) % 3; }
+    // Face across edge k of face f, -1 if there is none
+    int32_t neighbor(uint32_t f, int k) const {
+        int32_t t = twin[3 * f + k];
+        return t < 0 ? -1 : t / 3;
+    }
+};
+
+
+void HalfEdgeMesh::build(const std::vector<Vertex>& vertices, const std::vector<GLuint>& indices)
+{
+    struct PositionHash
+    {
+        // Adding +0 turns -0 into +0, which compares equal to it and must hash the same
+        size_t operator()(const glm::vec3& p) const {
+            glm::vec3 q = p + 0.0f;
+            uint32_t b[3];
+            std::memcpy(b, &q, sizeof(b));
+            return size_t(b[0] * 73856093u ^ b[1] * 19349663u ^ b[2] * 83492791u);
+        }
+    };
+
+    welded.resize(vertices.size());
+    std::unordered_map<glm::vec3, uint32_t, PositionHash> firstAt;
+    firstAt.reserve(vertices.size());
+    for (uint32_t i = 0; i < vertices.size(); i++)
+        welded[i] = firstAt.emplace(vertices[i].Position, i).first->second;
+
+    auto F = uint32_t(indices.size() / 3);
+    twin.assign(3 * F, -1);
+
+    // Each undirected edge keeps its first half-edge until the opposite one shows up
+    std::unordered_map<uint64_t, int32_t> open;
+    open.reserve(3 * F);
+    for (uint32_t he = 0; he < 3 * F; he++) {
+        uint32_t a = welded[indices[he]];
+        uint32_t b = welded[indices[next(he)]];
+        if (a == b)
+            continue;
+        uint64_t key = a < b ? (uint64_t(a) << 32 | b) : (uint64_t(b) << 32 | a);
+        auto it = open.find(key);
+        if (it == open.end()) {
+            open.emplace(key, int32_t(he));
+            continue;
+        }
+        int32_t other = it->second;
+        // A third face on the same edge, or two faces with the same winding : leave them unlinked
+        if (other < 0 || twin[other] >= 0 || welded[indices[other]] != b) {
+            if (other >= 0 && twin[other] >= 0) {
+                twin[twin[other]] = -1;
+                twin[other] = -1;
+            }
+            it->second = -1;
+            continue;
+        }
+        twin[other] = int32_t(he);
+        twin[he] = other;
+    }
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include "Readback.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// A stroke or cursor sample resolved against the id target of the frame it was requested in
+struct IdSample
+{
+    glm::vec2 pixel;        // Window coordinates, origin at the bottom left
+    double time = 0.0;      // Cursor timestamp given with the request
+    int tag = 0;            // Tag of the request
+    glm::vec3 origin;       // Ray through the pixel with the camera of that frame, from the near plane
+    glm::vec3 direction;
+    glm::uvec2 id = glm::uvec2(0u); // (object, primitive) with object 0 for the background
+    bool resolved = false;  // False when the readback was dropped or had no room for the sample, id is meaningless
+};
+
+// Renders object / primitive ids into a single sample RG32UI target, small rectangles around the requested samples
+// are read back asynchronously so picking cost does not depend on the amount of geometry. Every sample comes back
+// once, in request order, with the ray it was requested along : a few frames late but never mixed with a newer cursor.
+class IdPicker
+{
+public:
+    static constexpr int TILE = 64; // Largest side of the rectangles samples are grouped in, in pixels
+    static constexpr int MAX_PIXELS = 256 * 256; // Pixels read back per request
+
+    GLuint FBO = 0;
+    GLuint idTexture = 0;
+    GLuint depthRBO = 0;
+
+    IdPicker(int width, int height);
+
+    // Requests poll has not returned yet, dropped ones included
+    int inFlight() const { return readback.inFlight() + (dropped.empty() ? 0 : 1); }
+    void begin();
+    void end();
+    void request(const std::vector<glm::vec2>& pixels, const std::vector<double>& times, int tag, const glm::mat4& invCM);
+    bool poll(std::vector<IdSample>& samples);
+    void Delete();
+
+private:
+    struct Pending
+    {
+        std::vector<glm::vec2> pixels;
+        std::vector<double> times;
+        std::vector<int> tiles; // Readback rectangle of each sample, -1 if it did not fit
+        int tag;
+        glm::mat4 invCM;
+    };
+
+    int width, height;
+    PixelReadback readback;
+    Pending pending[PixelReadback::RING_SIZE];
+    std::vector<IdSample> dropped; // Samples of requests pushed out of the ring, returned unresolved
+
+    IdSample sample(const Pending& request, size_t i) const;
+};
+
+
+IdPicker::IdPicker(int width, int height)
+    : width(width), height(height), readback(MAX_PIXELS * sizeof(glm::uvec2))
+{
+    glGenFramebuffers(1, &FBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+
+    glGenTextures(1, &idTexture);
+    glBindTexture(GL_TEXTURE_2D, idTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, width, height, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, idTexture, 0);
+
+    glGenRenderbuffers(1, &depthRBO);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthRBO);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRBO);
+
+    auto fboStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (fboStatus != GL_FRAMEBUFFER_COMPLETE)
+        std::cout << "Id picker framebuffer error: " << fboStatus << std::endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Bind and clear the id target, models are then drawn with the id shader
+void IdPicker::begin()
+{
+    const GLuint background[4] = { 0, 0, 0, 0 };
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    glViewport(0, 0, width, height);
+    glClearBufferuiv(GL_COLOR, 0, background);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glEnable(GL_DEPTH_TEST);
+}
+
+void IdPicker::end()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+IdSample IdPicker::sample(const Pending& request, size_t i) const
+{
+    IdSample sample;
+    sample.pixel = request.pixels[i];
+    sample.time = request.times[i];
+    sample.tag = request.tag;
+    sample.origin = unprojectPixel(request.invCM, width, height, sample.pixel.x, sample.pixel.y, 0.f);
+    sample.direction = glm::normalize(unprojectPixel(request.invCM, width, height, sample.pixel.x, sample.pixel.y, 1.f) -
+                                      sample.origin);
+    return sample;
+}
+
+// Queue the ids under the given samples, times has one entry per pixel. Samples outside the window come back on the
+// background, the ones past MAX_PIXELS unresolved.
+void IdPicker::request(const std::vector<glm::vec2>& pixels, const std::vector<double>& times, int tag,
+                       const glm::mat4& invCM)
+{
+    if (pixels.empty())
+        return;
+
+    Pending queued = { pixels, times, {}, tag, invCM };
+    std::vector<ReadbackRect> rects;
+    tilePixels(pixels, TILE, 0, width, height, rects, queued.tiles);
+    int fitting = 0;
+    for (int area = 0; fitting < int(rects.size()) && area + rects[fitting].w * rects[fitting].h <= MAX_PIXELS; fitting++)
+        area += rects[fitting].w * rects[fitting].h;
+    rects.resize(fitting);
+    for (int& tile : queued.tiles)
+        if (tile >= fitting)
+            tile = -1;
+
+    if (readback.inFlight() == PixelReadback::RING_SIZE) {
+        const Pending& lost = pending[readback.oldest()];
+        for (size_t i = 0; i < lost.pixels.size(); i++)
+            dropped.push_back(sample(lost, i));
+    }
+    int slot = readback.request(FBO, GL_COLOR_ATTACHMENT0, rects, GL_RG_INTEGER, GL_UNSIGNED_INT, sizeof(glm::uvec2));
+    if (slot < 0) {
+        for (size_t i = 0; i < pixels.size(); i++)
+            dropped.push_back(sample(queued, i));
+        return;
+    }
+    pending[slot] = std::move(queued);
+}
+
+// Non blocking, appends the samples of every readback completed since the last call, oldest first
+bool IdPicker::poll(std::vector<IdSample>& samples)
+{
+    bool found = !dropped.empty();
+    samples.insert(samples.end(), dropped.begin(), dropped.end());
+    dropped.clear();
+    readback.poll([&](int slot, const std::vector<ReadbackRect>& rects, const void* data) {
+        const Pending& request = pending[slot];
+        std::vector<const glm::uvec2*> tileIds(rects.size());
+        auto* ids = (const glm::uvec2*)data;
+        for (size_t k = 0; k < rects.size(); k++) {
+            tileIds[k] = ids;
+            ids += rects[k].w * rects[k].h;
+        }
+        for (size_t i = 0; i < request.pixels.size(); i++) {
+            IdSample picked = sample(request, i);
+            int k = request.tiles[i];
+            if (k >= 0) {
+                const ReadbackRect& rect = rects[k];
+                int x = int(std::floor(picked.pixel.x)), y = int(std::floor(picked.pixel.y));
+                if (x >= rect.x && y >= rect.y && x < rect.x + rect.w && y < rect.y + rect.h)
+                    picked.id = tileIds[k][(y - rect.y) * rect.w + (x - rect.x)];
+                picked.resolved = true;
+            }
+            samples.push_back(picked);
+        }
+        found = true;
+    });
+    return found;
+}
+
+void IdPicker::Delete()
+{
+    readback.Delete();
+    glDeleteTextures(1, &idTexture);
+    glDeleteRenderbuffers(1, &depthRBO);
+    glDeleteFramebuffers(1, &FBO);
+}
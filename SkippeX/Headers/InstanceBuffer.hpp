@@ -0,0 +1,107 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Grows buffer to at least needed bytes, doubling, and keeps its name and its first used bytes.
+// Vertex arrays that point at the buffer stay valid.
+void growBuffer(GLuint& buffer, GLsizeiptr& capacity, GLsizeiptr used, GLsizeiptr needed);
+
+// Instance matrices kept on the GPU across updates. The storage only grows, by doubling, so the buffer name stays the
+// same and vertex arrays linked to it once keep working. Edits upload the changed range with glBufferSubData.
+class InstanceBuffer
+{
+public:
+    GLuint id = 0;
+
+    uint32_t size() const { return count; }
+    size_t uploaded() const { return bytes; } // Since the last resetStats
+    void resetStats() { bytes = 0; }
+
+    void assign(const std::vector<glm::mat4>& matrices);
+    void update(uint32_t first, uint32_t n, const glm::mat4* matrices);
+    void resize(uint32_t n);
+    void Delete();
+
+private:
+    uint32_t count = 0;
+    GLsizeiptr capacity = 0; // Bytes
+    size_t bytes = 0;
+
+    void reserve(uint32_t n);
+};
+
+
+void growBuffer(GLuint& buffer, GLsizeiptr& capacity, GLsizeiptr used, GLsizeiptr needed)
+{
+    if (buffer && needed <= capacity)
+        return;
+    GLsizeiptr grown = std::max(needed, std::max(capacity * 2, GLsizeiptr(4096)));
+    if (!buffer || used == 0) {
+        if (!buffer)
+            glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, grown, NULL, GL_DYNAMIC_DRAW);
+    }
+    else {
+        // Through a temporary copy, the name is kept
+        GLuint copy;
+        glGenBuffers(1, &copy);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, copy);
+        glBufferData(GL_COPY_WRITE_BUFFER, used, NULL, GL_STREAM_COPY);
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, grown, NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_COPY_READ_BUFFER, copy);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glDeleteBuffers(1, &copy);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    capacity = grown;
+}
+
+void InstanceBuffer::reserve(uint32_t n)
+{
+    growBuffer(id, capacity, GLsizeiptr(count) * sizeof(glm::mat4), GLsizeiptr(n) * sizeof(glm::mat4));
+}
+
+void InstanceBuffer::assign(const std::vector<glm::mat4>& matrices)
+{
+    count = 0;
+    reserve(uint32_t(matrices.size()));
+    count = uint32_t(matrices.size());
+    update(0, count, matrices.data());
+}
+
+void InstanceBuffer::update(uint32_t first, uint32_t n, const glm::mat4* matrices)
+{
+    if (n == 0)
+        return;
+    reserve(first + n);
+    count = std::max(count, first + n);
+    glBindBuffer(GL_ARRAY_BUFFER, id);
+    glBufferSubData(GL_ARRAY_BUFFER, GLintptr(first) * sizeof(glm::mat4), GLsizeiptr(n) * sizeof(glm::mat4), matrices);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    bytes += size_t(n) * sizeof(glm::mat4);
+}
+
+void InstanceBuffer::resize(uint32_t n)
+{
+    reserve(n);
+    count = n;
+}
+
+void InstanceBuffer::Delete()
+{
+    if (id)
+        glDeleteBuffers(1, &id);
+    id = 0;
+    count = capacity = 0;
+}
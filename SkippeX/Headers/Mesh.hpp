@@ -10,6 +10,7 @@
 #include <assimp/IOStream.hpp>
 #include <assimp/IOSystem.hpp>
 #include "evao.hpp"
+#include "HalfEdge.hpp"
 
 #include <string>
 #include <fstream>
@@ -51,6 +52,7 @@ public:
     aiColor4D specular;
     aiColor4D reflective;
     VAO mVAO;
+    HalfEdgeMesh adjacency; // Filled by Model::loadModel
 
     unsigned int instancing;
 
@@ -78,6 +80,8 @@ public:
     }
 
     void Draw(LinkedShader shader);
+    void DrawGeometry() const;
+    void setInstances(GLuint buffer, unsigned int count);
 
     void Delete() {
         mVBO.del();
@@ -176,6 +180,32 @@ void Mesh::Setup(std::vector<glm::mat4> instancesMatrix){
     glBindVertexArray(0);
 }
 
+// Instance matrices read from buffer instead of the one filled by Setup, the buffer is shared and owned by the caller
+void Mesh::setInstances(GLuint buffer, unsigned int count)
+{
+    instancing = count;
+    glBindVertexArray(mVAO.ID);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    for (GLuint column = 0; column < 4; column++) {
+        glEnableVertexAttribArray(4 + column);
+        glVertexAttribPointer(4 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void *)(column * sizeof(glm::vec4)));
+        glVertexAttribDivisor(4 + column, 1);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+// Positions only, no material or texture state (id pass)
+void Mesh::DrawGeometry() const
+{
+    glBindVertexArray(mVAO.ID);
+    if (instancing == 1)
+        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
+    else
+        glDrawElementsInstanced(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0, instancing);
+    glBindVertexArray(0);
+}
+
 void Mesh::Draw(LinkedShader shader)
 {
 
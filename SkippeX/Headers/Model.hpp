@@ -18,7 +18,6 @@
 #include <iostream>
 #include <vector>
 #include <map>
-#include "Object.hpp"
 
 using namespace std;
 
@@ -29,7 +28,6 @@ public:
     bool noTex;
     unsigned int instancing;
     std::vector<glm::mat4> instancesMatrix;
-    std::vector<Triangle> triangles;
 
     Model(glm::vec3 pos = glm::vec3(0.0f), glm::vec3 size = glm::vec3(1.0f), bool noTex = false, unsigned int instancing = 1, std::vector<glm::mat4> instancesMatrix = {})
         : pos(pos), size(size), noTex(noTex), instancing(instancing), instancesMatrix(instancesMatrix)
@@ -39,26 +37,30 @@ public:
     void loadModel(std::string path);
 
     void Draw(LinkedShader shader) {
-        for (Mesh mesh : meshes)
+        for (Mesh& mesh : meshes)
             mesh.Draw(shader);
     }
+    // Primitive ids continue across meshes, in the same order as BVH::build reads the triangles
+    void DrawIds(LinkedShader shader, int objectId) const {
+        shader.SetInt("objectId", objectId);
+        int primitiveBase = 0;
+        for (const Mesh& mesh : meshes) {
+            shader.SetInt("primitiveBase", primitiveBase);
+            mesh.DrawGeometry();
+            primitiveBase += int(mesh.indices.size() / 3);
+        }
+    }
     void Delete() {
-        for (Mesh mesh : meshes)
+        for (Mesh& mesh : meshes)
             mesh.Delete();
     }
-    std::vector<sObject> populate_triangles(glm::mat4 model)
-    {
-        std::vector<sObject> triangles;
-        for (Mesh mesh : meshes) {
-            for (int i = 0; i < mesh.indices.size(); i+=3)
-            {
-                glm::vec3 a = glm::vec3(model * glm::vec4( mesh.vertices[mesh.indices[i]].Position, 1.f));
-                glm::vec3 b = glm::vec3(model * glm::vec4(mesh.vertices[mesh.indices[i + 1]].Position, 1.f));
-                glm::vec3 c = glm::vec3(model * glm::vec4(mesh.vertices[mesh.indices[i + 2]].Position, 1.f));
-                triangles.push_back(std::make_shared<Triangle>(a,b,c));
-            }
-        }
-        return triangles;
+    void setInstances(GLuint buffer, unsigned int count) {
+        instancing = count;
+        for (Mesh& mesh : meshes)
+            mesh.setInstances(buffer, count);
+    }
+    const std::vector<Mesh>& getMeshes() const {
+        return meshes;
     }
 protected:
     std::vector<Mesh> meshes;
@@ -84,6 +86,10 @@ void Model::loadModel(std::string path) {
 
     this->directory = path.substr(0, path.find_last_of('/'));
     this->processNode(scene->mRootNode, scene);
+
+    // Face adjacency for surface walking picking
+    for (Mesh& mesh : meshes)
+        mesh.adjacency.build(mesh.vertices, mesh.indices);
 }
 
 void Model::processNode(aiNode *node, const aiScene* scene) {
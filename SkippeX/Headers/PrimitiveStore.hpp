@@ -0,0 +1,371 @@
+#pragma once
+
+#include "BVH.hpp"
+#include "Ray.hpp"
+#include "TLAS.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+enum class PrimitiveType : uint32_t { None = 0, Sphere = 1, Plane = 2, Triangle = 3 };
+
+// Packed primitive reference : 4 bits of type, 20 bits of owning model and 40 bits of index inside its pool.
+// Triangle indices are the triangle position inside the owning model BVH.
+typedef uint64_t PrimitiveHandle;
+
+const PrimitiveHandle INVALID_PRIMITIVE = 0;
+
+inline PrimitiveHandle makeHandle(PrimitiveType type, uint32_t model, uint64_t index)
+{
+    return (uint64_t(type) << 60) | (uint64_t(model & 0xFFFFF) << 40) | (index & 0xFFFFFFFFFFull);
+}
+inline PrimitiveType handleType(PrimitiveHandle h) { return PrimitiveType(h >> 60); }
+inline uint32_t handleModel(PrimitiveHandle h) { return uint32_t((h >> 40) & 0xFFFFF); }
+inline uint64_t handleIndex(PrimitiveHandle h) { return h & 0xFFFFFFFFFFull; }
+
+const char* primitiveTypeName(PrimitiveType type)
+{
+    switch (type) {
+        case PrimitiveType::Sphere: return "Sphere";
+        case PrimitiveType::Plane: return "Plane";
+        case PrimitiveType::Triangle: return "Triangle";
+        default: return "None";
+    }
+}
+
+struct SceneHit
+{
+    float t = std::numeric_limits<float>::max();
+    float tExit = std::numeric_limits<float>::max(); // Far side of a sphere, equal to t for surfaces
+    glm::vec3 point = glm::vec3(0.f);
+    glm::vec3 normal = glm::vec3(0.f);
+    PrimitiveHandle handle = INVALID_PRIMITIVE;
+};
+
+// Spheres and planes are stored in world space, the owning model only tags them.
+struct SpherePool
+{
+    std::vector<glm::vec3> center;
+    std::vector<float> radius;
+    std::vector<uint32_t> model;
+
+    size_t size() const { return center.size(); }
+    uint64_t add(uint32_t owner, const glm::vec3& c, float r)
+    {
+        center.push_back(c);
+        radius.push_back(r);
+        model.push_back(owner);
+        return center.size() - 1;
+    }
+    void copy(size_t to, size_t from)
+    {
+        center[to] = center[from];
+        radius[to] = radius[from];
+        model[to] = model[from];
+    }
+    void resize(size_t n)
+    {
+        center.resize(n);
+        radius.resize(n);
+        model.resize(n);
+    }
+    void clear() { resize(0); }
+};
+
+struct PlanePool
+{
+    std::vector<glm::vec3> origin;
+    std::vector<glm::vec3> normal;
+    std::vector<float> maxDist;
+    std::vector<uint32_t> model;
+};
+
+struct StoreModel
+{
+    glm::mat4 transform;
+    int instance; // TLAS instance holding the model triangles, -1 if it has none
+};
+
+class PrimitiveStore
+{
+public:
+    SpherePool spheres;
+    PlanePool planes;
+    TLAS triangles;
+    std::vector<StoreModel> models;
+
+    PrimitiveStore() {};
+
+    uint32_t addModel(const glm::mat4& transform, const BVH* blas = nullptr);
+    void setModelTransform(uint32_t model, const glm::mat4& transform);
+    PrimitiveHandle addSphere(uint32_t model, const glm::vec3& center, float radius);
+    PrimitiveHandle addPlane(uint32_t model, const glm::vec3& origin, const glm::vec3& normal, float maxDist = 10.f);
+
+    void update();
+    bool closestHit(const Ray& ray, SceneHit& hit) const;
+    int allHits(const Ray& ray, std::vector<Crossing>& crossings, int maxHits) const;
+    glm::vec3 origin(PrimitiveHandle handle) const;
+    glm::vec3 normal(PrimitiveHandle handle, const glm::vec3& point) const;
+    PrimitiveHandle fromGpuId(uint32_t model, uint32_t primitive) const;
+    bool intersectPrimitive(const Ray& ray, PrimitiveHandle handle, SceneHit& hit) const;
+
+private:
+    std::vector<uint32_t> instanceModels; // TLAS instance -> model
+};
+
+
+uint32_t PrimitiveStore::addModel(const glm::mat4& transform, const BVH* blas)
+{
+    StoreModel model;
+    model.transform = transform;
+    model.instance = -1;
+    if (blas) {
+        model.instance = triangles.addInstance(blas, transform);
+        instanceModels.push_back(uint32_t(models.size()));
+    }
+    models.push_back(model);
+    return uint32_t(models.size() - 1);
+}
+
+void PrimitiveStore::setModelTransform(uint32_t model, const glm::mat4& transform)
+{
+    models[model].transform = transform;
+    if (models[model].instance >= 0)
+        triangles.setTransform(models[model].instance, transform);
+}
+
+PrimitiveHandle PrimitiveStore::addSphere(uint32_t model, const glm::vec3& center, float radius)
+{
+    return makeHandle(PrimitiveType::Sphere, model, spheres.add(model, center, radius));
+}
+
+PrimitiveHandle PrimitiveStore::addPlane(uint32_t model, const glm::vec3& origin, const glm::vec3& normal, float maxDist)
+{
+    planes.origin.push_back(origin);
+    planes.normal.push_back(glm::normalize(normal));
+    planes.maxDist.push_back(maxDist);
+    planes.model.push_back(model);
+    return makeHandle(PrimitiveType::Plane, model, planes.origin.size() - 1);
+}
+
+void PrimitiveStore::update()
+{
+    triangles.update();
+}
+
+glm::vec3 PrimitiveStore::origin(PrimitiveHandle handle) const
+{
+    switch (handleType(handle)) {
+        case PrimitiveType::Sphere: return spheres.center[handleIndex(handle)];
+        case PrimitiveType::Plane: return planes.origin[handleIndex(handle)];
+        default: return glm::vec3(models[handleModel(handle)].transform[3]);
+    }
+}
+
+// One pass over every pool, each one can only shrink hit.t so the nearest primitive always wins
+bool PrimitiveStore::closestHit(const Ray& ray, SceneHit& hit) const
+{
+    bool found = false;
+    glm::vec3 o = ray.point;
+    glm::vec3 d = ray.dir;
+    float a = glm::dot(d, d);
+
+    for (size_t i = 0; i < spheres.center.size(); i++) {
+        glm::vec3 L = spheres.center[i] - o;
+        float b = glm::dot(L, d);
+        float c = glm::dot(L, L) - spheres.radius[i] * spheres.radius[i];
+        float disc = b * b - a * c;
+        if (disc < 0.f)
+            continue;
+        float s = std::sqrt(disc);
+        float t0 = (b - s) / a;
+        float t1 = (b + s) / a;
+        if (t1 < 0.f)
+            continue;
+        // Starting inside the sphere only leaves the exit point
+        float t = t0 >= 0.f ? t0 : t1;
+        if (t >= hit.t)
+            continue;
+        hit.t = t;
+        hit.tExit = t1;
+        hit.point = o + t * d;
+        hit.normal = glm::normalize(hit.point - spheres.center[i]);
+        hit.handle = makeHandle(PrimitiveType::Sphere, spheres.model[i], i);
+        found = true;
+    }
+
+    for (size_t i = 0; i < planes.origin.size(); i++) {
+        float denom = glm::dot(planes.normal[i], d);
+        if (std::fabs(denom) < 1e-6f)
+            continue;
+        float t = glm::dot(planes.origin[i] - o, planes.normal[i]) / denom;
+        if (t < 0.f || t >= hit.t)
+            continue;
+        glm::vec3 p = o + t * d;
+        glm::vec3 fromOrigin = p - planes.origin[i];
+        if (glm::dot(fromOrigin, fromOrigin) > planes.maxDist[i] * planes.maxDist[i])
+            continue;
+        hit.t = t;
+        hit.tExit = t;
+        hit.point = p;
+        hit.normal = planes.normal[i];
+        hit.handle = makeHandle(PrimitiveType::Plane, planes.model[i], i);
+        found = true;
+    }
+
+    InstanceHit meshHit;
+    meshHit.hit.t = hit.t;
+    if (triangles.intersect(ray, meshHit)) {
+        hit.t = meshHit.hit.t;
+        hit.tExit = meshHit.hit.t;
+        hit.point = meshHit.point;
+        hit.normal = meshHit.normal;
+        hit.handle = makeHandle(PrimitiveType::Triangle, instanceModels[meshHit.instance], meshHit.hit.prim);
+        found = true;
+    }
+    return found;
+}
+
+// The maxHits nearest surface crossings sorted along the ray, Crossing::id holds the PrimitiveHandle.
+// Spheres report both their entry and exit.
+int PrimitiveStore::allHits(const Ray& ray, std::vector<Crossing>& crossings, int maxHits) const
+{
+    CrossingCollector collector(maxHits);
+    glm::vec3 o = ray.point;
+    glm::vec3 d = ray.dir;
+    float a = glm::dot(d, d);
+
+    for (size_t i = 0; i < spheres.center.size(); i++) {
+        glm::vec3 L = spheres.center[i] - o;
+        float b = glm::dot(L, d);
+        float c = glm::dot(L, L) - spheres.radius[i] * spheres.radius[i];
+        float disc = b * b - a * c;
+        if (disc < 0.f)
+            continue;
+        float s = std::sqrt(disc);
+        PrimitiveHandle handle = makeHandle(PrimitiveType::Sphere, spheres.model[i], i);
+        if (b - s >= 0.f)
+            collector.add((b - s) / a, handle, true);
+        if (b + s >= 0.f)
+            collector.add((b + s) / a, handle, false);
+    }
+
+    for (size_t i = 0; i < planes.origin.size(); i++) {
+        float denom = glm::dot(planes.normal[i], d);
+        if (std::fabs(denom) < 1e-6f)
+            continue;
+        float t = glm::dot(planes.origin[i] - o, planes.normal[i]) / denom;
+        if (t < 0.f)
+            continue;
+        glm::vec3 fromOrigin = o + t * d - planes.origin[i];
+        if (glm::dot(fromOrigin, fromOrigin) > planes.maxDist[i] * planes.maxDist[i])
+            continue;
+        collector.add(t, makeHandle(PrimitiveType::Plane, planes.model[i], i), denom < 0.f);
+    }
+
+    triangles.intersectAll(ray, collector);
+
+    crossings = collector.sorted();
+    for (auto& crossing : crossings) {
+        if (handleType(crossing.id) == PrimitiveType::None) {
+            uint32_t instance = uint32_t(crossing.id >> 40);
+            crossing.id = makeHandle(PrimitiveType::Triangle, instanceModels[instance], crossing.id & 0xFFFFFFFFFFull);
+        }
+    }
+    return int(crossings.size());
+}
+
+glm::vec3 PrimitiveStore::normal(PrimitiveHandle handle, const glm::vec3& point) const
+{
+    switch (handleType(handle)) {
+        case PrimitiveType::Sphere:
+            return glm::normalize(point - spheres.center[handleIndex(handle)]);
+        case PrimitiveType::Plane:
+            return planes.normal[handleIndex(handle)];
+        case PrimitiveType::Triangle: {
+            const BVHInstance& instance = triangles.instances[models[handleModel(handle)].instance];
+            glm::vec3 n = instance.blas->triangles.normal(uint32_t(handleIndex(handle)));
+            return glm::normalize(glm::transpose(glm::mat3(instance.invTransform)) * n);
+        }
+        default:
+            return glm::vec3(0.f);
+    }
+}
+
+// Ids written by the id pass : models with triangles report their triangle in model order,
+// the others are picked as a whole through their first sphere or plane.
+PrimitiveHandle PrimitiveStore::fromGpuId(uint32_t model, uint32_t primitive) const
+{
+    if (model >= models.size())
+        return INVALID_PRIMITIVE;
+    if (models[model].instance >= 0) {
+        const BVH* blas = triangles.instances[models[model].instance].blas;
+        if (primitive >= blas->sourcePrims.size())
+            return INVALID_PRIMITIVE;
+        return makeHandle(PrimitiveType::Triangle, model, blas->sourcePrims[primitive]);
+    }
+    for (size_t i = 0; i < spheres.model.size(); i++)
+        if (spheres.model[i] == model)
+            return makeHandle(PrimitiveType::Sphere, model, i);
+    for (size_t i = 0; i < planes.model.size(); i++)
+        if (planes.model[i] == model)
+            return makeHandle(PrimitiveType::Plane, model, i);
+    return INVALID_PRIMITIVE;
+}
+
+// Hit a single known primitive. Triangles are intersected through their supporting plane so that an id picked
+// a few frames ago still gives a point when the cursor has moved slightly past the triangle edges.
+bool PrimitiveStore::intersectPrimitive(const Ray& ray, PrimitiveHandle handle, SceneHit& hit) const
+{
+    glm::vec3 o = ray.point;
+    glm::vec3 d = ray.dir;
+    uint64_t i = handleIndex(handle);
+    float t, tExit;
+    switch (handleType(handle)) {
+        case PrimitiveType::Sphere: {
+            glm::vec3 L = spheres.center[i] - o;
+            float a = glm::dot(d, d);
+            float b = glm::dot(L, d);
+            float disc = b * b - a * (glm::dot(L, L) - spheres.radius[i] * spheres.radius[i]);
+            if (disc < 0.f)
+                return false;
+            float s = std::sqrt(disc);
+            tExit = (b + s) / a;
+            t = (b - s) / a >= 0.f ? (b - s) / a : tExit;
+            break;
+        }
+        case PrimitiveType::Plane: {
+            float denom = glm::dot(planes.normal[i], d);
+            if (std::fabs(denom) < 1e-6f)
+                return false;
+            t = tExit = glm::dot(planes.origin[i] - o, planes.normal[i]) / denom;
+            break;
+        }
+        case PrimitiveType::Triangle: {
+            const BVHInstance& instance = triangles.instances[models[handleModel(handle)].instance];
+            const TriangleSoA& tris = instance.blas->triangles;
+            glm::vec3 lo(instance.invTransform * glm::vec4(o, 1.0f));
+            glm::vec3 ld(instance.invTransform * glm::vec4(d, 0.0f));
+            glm::vec3 n = glm::cross(glm::vec3(tris.e1x[i], tris.e1y[i], tris.e1z[i]), glm::vec3(tris.e2x[i], tris.e2y[i], tris.e2z[i]));
+            float denom = glm::dot(n, ld);
+            if (std::fabs(denom) < 1e-12f)
+                return false;
+            t = tExit = glm::dot(glm::vec3(tris.v0x[i], tris.v0y[i], tris.v0z[i]) - lo, n) / denom;
+            break;
+        }
+        default:
+            return false;
+    }
+    if (t < 0.f)
+        return false;
+    hit.t = t;
+    hit.tExit = tExit;
+    hit.point = o + t * d;
+    hit.normal = normal(handle, hit.point);
+    hit.handle = handle;
+    return true;
+}
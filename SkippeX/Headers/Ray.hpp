@@ -0,0 +1,22 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+class Ray
+{
+public:
+    glm::highp_f32vec3 point;
+    glm::highp_f32vec3 dir;
+
+    Ray() {};
+    Ray(glm::highp_f32vec3 p, glm::highp_f32vec3 d) :
+            point(p), dir(d)
+    {};
+    glm::highp_f32vec3 get_sample(float t)
+    {
+        glm::highp_f32vec3 result;
+        glm::highp_f32vec3 direction = normalize(dir);
+        result = glm::highp_f32vec3(point.x + t * direction.x, point.y + t * direction.y, point.z + t * direction.z);
+        return result;
+    }
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct ReadbackRect
+{
+    int x = 0, y = 0, w = 0, h = 0; // Window pixels, origin at the bottom left
+};
+
+// World position of a window pixel center at the given depth buffer value, origin at the bottom left
+glm::vec3 unprojectPixel(const glm::mat4& invCM, int width, int height, float px, float py, float depth)
+{
+    glm::vec4 ndc(2.f * (px + 0.5f) / float(width) - 1.f, 2.f * (py + 0.5f) / float(height) - 1.f, 2.f * depth - 1.f, 1.f);
+    glm::vec4 world = invCM * ndc;
+    return glm::vec3(world) / world.w;
+}
+
+// Groups consecutive pixels into rectangles of at most tile pixels a side, borders included, clipped to the window.
+// tileOf[i] is the rectangle holding pixels[i]. Consecutive stroke samples are close, so a fast stroke across the
+// window costs a few thin rectangles instead of one covering the whole window.
+void tilePixels(const std::vector<glm::vec2>& pixels, int tile, int border, int width, int height,
+                std::vector<ReadbackRect>& rects, std::vector<int>& tileOf)
+{
+    rects.clear();
+    tileOf.assign(pixels.size(), -1);
+    glm::ivec2 lo(0), hi(0);
+    auto close = [&]() {
+        ReadbackRect rect;
+        rect.x = glm::clamp(lo.x - border, 0, width - 1);
+        rect.y = glm::clamp(lo.y - border, 0, height - 1);
+        rect.w = glm::clamp(hi.x + border + 1, 1, width) - rect.x;
+        rect.h = glm::clamp(hi.y + border + 1, 1, height) - rect.y;
+        rects.push_back(rect);
+    };
+    for (size_t i = 0; i < pixels.size(); i++) {
+        glm::ivec2 p(int(std::floor(pixels[i].x)), int(std::floor(pixels[i].y)));
+        glm::ivec2 newLo = glm::min(lo, p), newHi = glm::max(hi, p);
+        if (i == 0 || newHi.x - newLo.x + 1 + 2 * border > tile || newHi.y - newLo.y + 1 + 2 * border > tile) {
+            if (i > 0)
+                close();
+            newLo = newHi = p;
+        }
+        lo = newLo;
+        hi = newHi;
+        tileOf[i] = int(rects.size());
+    }
+    if (!pixels.empty())
+        close();
+}
+
+// Ring of pixel buffer objects filled by glReadPixels and fenced. A slot is only mapped once the GPU is done with it,
+// so results arrive a frame or two late but the CPU never waits on the pipeline. A slot holds one or more rectangles,
+// packed one after the other, rows tightly packed.
+class PixelReadback
+{
+public:
+    static const int RING_SIZE = 3;
+
+    explicit PixelReadback(GLsizeiptr capacity);
+
+    int inFlight() const { return pending; }
+    int oldest() const { return tail; } // Slot the next request drops when all of them are in flight
+
+    int request(GLuint fbo, GLenum readBuffer, const std::vector<ReadbackRect>& rects, GLenum format, GLenum type,
+                GLsizeiptr pixelSize);
+    template<typename OnReady>
+    void poll(OnReady onReady);
+    void Delete();
+
+private:
+    struct Slot
+    {
+        GLuint pbo = 0;
+        GLsync fence = nullptr;
+        GLsizeiptr size = 0;
+        std::vector<ReadbackRect> rects;
+    };
+
+    GLsizeiptr capacity;
+    Slot ring[RING_SIZE];
+    int head = 0; // Next slot to fill
+    int tail = 0; // Oldest pending slot
+    int pending = 0;
+};
+
+
+PixelReadback::PixelReadback(GLsizeiptr capacity) : capacity(capacity)
+{
+    for (auto& slot : ring) {
+        glGenBuffers(1, &slot.pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, capacity, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Queue the copy of rects, pixelSize bytes per pixel, and return the slot it went to. Every slot still in flight drops
+// the oldest.
+int PixelReadback::request(GLuint fbo, GLenum readBuffer, const std::vector<ReadbackRect>& rects, GLenum format,
+                           GLenum type, GLsizeiptr pixelSize)
+{
+    GLsizeiptr size = 0;
+    for (const auto& rect : rects)
+        size += GLsizeiptr(rect.w) * rect.h * pixelSize;
+    if (rects.empty() || size > capacity)
+        return -1;
+    if (pending == RING_SIZE) {
+        glDeleteSync(ring[tail].fence);
+        ring[tail].fence = nullptr;
+        tail = (tail + 1) % RING_SIZE;
+        pending--;
+    }
+
+    int index = head;
+    Slot& slot = ring[index];
+    slot.rects = rects;
+    slot.size = size;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    if (readBuffer != GL_NONE)
+        glReadBuffer(readBuffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    GLsizeiptr offset = 0;
+    for (const auto& rect : rects) {
+        glReadPixels(rect.x, rect.y, rect.w, rect.h, format, type, (void*)offset);
+        offset += GLsizeiptr(rect.w) * rect.h * pixelSize;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    head = (head + 1) % RING_SIZE;
+    pending++;
+    return index;
+}
+
+// Non blocking, calls onReady(slot, rects, data) for every finished readback, oldest first
+template<typename OnReady>
+void PixelReadback::poll(OnReady onReady)
+{
+    while (pending > 0) {
+        Slot& slot = ring[tail];
+        GLenum status = glClientWaitSync(slot.fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        const void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot.size, GL_MAP_READ_BIT);
+        if (data) {
+            onReady(tail, slot.rects, data);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        tail = (tail + 1) % RING_SIZE;
+        pending--;
+    }
+}
+
+void PixelReadback::Delete()
+{
+    for (auto& slot : ring) {
+        if (slot.fence)
+            glDeleteSync(slot.fence);
+        glDeleteBuffers(1, &slot.pbo);
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// x86 intrinsics and the attribute enabling AVX2 on single functions, the rest of the build targets baseline x86-64
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SKIPPEX_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SKIPPEX_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define SKIPPEX_TARGET_AVX2
+#endif
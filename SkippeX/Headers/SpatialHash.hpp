@@ -0,0 +1,208 @@
+#pragma once
+
+#include "BVH.hpp"
+#include "Ray.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+// Uniform grid over a growing set of points, only the occupied cells are stored in a hash map keyed by their
+// coordinates. Points are identified by their insertion order so that ids match the arrays they mirror.
+// Queries are cheapest when the cell size is close to the radius they are asked with.
+class SpatialHash
+{
+public:
+    explicit SpatialHash(float cellSize = 0.1f) : cellSize(cellSize) {};
+
+    uint32_t size() const { return uint32_t(points.size()); }
+    const glm::vec3& position(uint32_t id) const { return points[id]; }
+    float cell() const { return cellSize; }
+
+    void clear();
+    uint32_t add(const glm::vec3& p);
+    void move(uint32_t id, const glm::vec3& p);
+    void rebuild(const std::vector<glm::vec3>& positions, float newCellSize = 0.f);
+
+    template<typename Accept>
+    bool nearest(const glm::vec3& p, float maxDist, uint32_t& id, Accept accept) const;
+    bool nearest(const glm::vec3& p, float maxDist, uint32_t& id) const {
+        return nearest(p, maxDist, id, [](uint32_t) { return true; });
+    }
+    void radius(const glm::vec3& p, float r, std::vector<uint32_t>& ids) const;
+    bool nearRay(const Ray& ray, float r, uint32_t& id, float& t, float tMax = std::numeric_limits<float>::max()) const;
+
+private:
+    float cellSize;
+    std::vector<glm::vec3> points;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> cells;
+    AABB bounds;
+
+    glm::ivec3 cellOf(const glm::vec3& p) const { return glm::ivec3(glm::floor(p / cellSize)); }
+    // 21 bits per axis, a million cells in every direction around the origin
+    static uint64_t key(const glm::ivec3& c) {
+        return (uint64_t(c.x + (1 << 20)) & 0x1FFFFF) << 42 | (uint64_t(c.y + (1 << 20)) & 0x1FFFFF) << 21 |
+               (uint64_t(c.z + (1 << 20)) & 0x1FFFFF);
+    }
+    const std::vector<uint32_t>* find(const glm::ivec3& c) const {
+        auto it = cells.find(key(c));
+        return it == cells.end() ? nullptr : &it->second;
+    }
+};
+
+
+void SpatialHash::clear()
+{
+    points.clear();
+    cells.clear();
+    bounds = AABB();
+}
+
+uint32_t SpatialHash::add(const glm::vec3& p)
+{
+    auto id = uint32_t(points.size());
+    points.push_back(p);
+    cells[key(cellOf(p))].push_back(id);
+    bounds.grow(p);
+    return id;
+}
+
+void SpatialHash::move(uint32_t id, const glm::vec3& p)
+{
+    uint64_t from = key(cellOf(points[id])), to = key(cellOf(p));
+    points[id] = p;
+    bounds.grow(p);
+    if (from == to)
+        return;
+    auto& ids = cells[from];
+    ids.erase(std::find(ids.begin(), ids.end(), id));
+    if (ids.empty())
+        cells.erase(from);
+    cells[to].push_back(id);
+}
+
+void SpatialHash::rebuild(const std::vector<glm::vec3>& positions, float newCellSize)
+{
+    if (newCellSize > 0.f)
+        cellSize = newCellSize;
+    clear();
+    points.reserve(positions.size());
+    for (const auto& p : positions)
+        add(p);
+}
+
+// Nearest accepted point closer than maxDist. Cells are visited in cubic shells around the cell of p,
+// once shell k is done every point closer than k cells has been seen.
+template<typename Accept>
+bool SpatialHash::nearest(const glm::vec3& p, float maxDist, uint32_t& id, Accept accept) const
+{
+    glm::ivec3 center = cellOf(p);
+    float best = maxDist * maxDist;
+    bool found = false;
+    int maxShell = int(std::ceil(maxDist / cellSize));
+    for (int k = 0; k <= maxShell; k++) {
+        for (int z = -k; z <= k; z++)
+            for (int y = -k; y <= k; y++)
+                for (int x = -k; x <= k; x++) {
+                    // Only the surface of the shell, the inside was visited before
+                    if (std::max(std::abs(x), std::max(std::abs(y), std::abs(z))) != k)
+                        continue;
+                    const std::vector<uint32_t>* ids = find(center + glm::ivec3(x, y, z));
+                    if (!ids)
+                        continue;
+                    for (uint32_t i : *ids) {
+                        glm::vec3 d = points[i] - p;
+                        float d2 = glm::dot(d, d);
+                        if (d2 < best && accept(i)) {
+                            best = d2;
+                            id = i;
+                            found = true;
+                        }
+                    }
+                }
+        if (found && best <= float(k * k) * cellSize * cellSize)
+            break;
+    }
+    return found;
+}
+
+void SpatialHash::radius(const glm::vec3& p, float r, std::vector<uint32_t>& ids) const
+{
+    glm::ivec3 lo = cellOf(p - glm::vec3(r)), hi = cellOf(p + glm::vec3(r));
+    for (int z = lo.z; z <= hi.z; z++)
+        for (int y = lo.y; y <= hi.y; y++)
+            for (int x = lo.x; x <= hi.x; x++) {
+                const std::vector<uint32_t>* cell = find(glm::ivec3(x, y, z));
+                if (!cell)
+                    continue;
+                for (uint32_t i : *cell)
+                    if (glm::dot(points[i] - p, points[i] - p) <= r * r)
+                        ids.push_back(i);
+            }
+}
+
+// Point closest to the ray origin, along the ray, among the ones closer than r to it. The ray is clipped to the
+// bounds of the points then walked cell by cell (Amanatides & Woo), each step looking at the cells within r.
+bool SpatialHash::nearRay(const Ray& ray, float r, uint32_t& id, float& t, float tMax) const
+{
+    if (points.empty())
+        return false;
+    glm::vec3 dir = glm::normalize(glm::vec3(ray.dir));
+    glm::vec3 origin = ray.point;
+    glm::vec3 invDir = 1.f / dir;
+    glm::vec3 t1 = (bounds.bmin - glm::vec3(r) - origin) * invDir;
+    glm::vec3 t2 = (bounds.bmax + glm::vec3(r) - origin) * invDir;
+    glm::vec3 tmin = glm::min(t1, t2), tmax = glm::max(t1, t2);
+    float tEnter = std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, 0.f));
+    float tExit = std::min(std::min(tmax.x, tmax.y), std::min(tmax.z, tMax));
+    if (tEnter > tExit)
+        return false;
+
+    glm::ivec3 c = cellOf(origin + dir * tEnter);
+    glm::ivec3 step(dir.x < 0.f ? -1 : 1, dir.y < 0.f ? -1 : 1, dir.z < 0.f ? -1 : 1);
+    glm::vec3 tNext, tDelta;
+    for (int a = 0; a < 3; a++) {
+        float boundary = float(c[a] + (step[a] > 0 ? 1 : 0)) * cellSize;
+        tNext[a] = dir[a] != 0.f ? (boundary - origin[a]) * invDir[a] : std::numeric_limits<float>::max();
+        tDelta[a] = dir[a] != 0.f ? cellSize * std::fabs(invDir[a]) : std::numeric_limits<float>::max();
+    }
+
+    int reach = int(std::ceil(r / cellSize));
+    float slack = (float(reach) + 1.f) * cellSize * std::sqrt(3.f); // Farthest a point of a visited cell can be
+    float bestT = std::numeric_limits<float>::max();
+    float tCell = tEnter;
+    bool found = false;
+    while (tCell <= tExit && tCell - slack <= bestT) {
+        for (int z = -reach; z <= reach; z++)
+            for (int y = -reach; y <= reach; y++)
+                for (int x = -reach; x <= reach; x++) {
+                    const std::vector<uint32_t>* ids = find(c + glm::ivec3(x, y, z));
+                    if (!ids)
+                        continue;
+                    for (uint32_t i : *ids) {
+                        glm::vec3 op = points[i] - origin;
+                        float along = glm::dot(op, dir);
+                        if (along < 0.f || along > tMax || along >= bestT)
+                            continue;
+                        glm::vec3 perpendicular = glm::cross(op, dir);
+                        if (glm::dot(perpendicular, perpendicular) <= r * r) {
+                            bestT = along;
+                            id = i;
+                            found = true;
+                        }
+                    }
+                }
+        int a = tNext.x < tNext.y ? (tNext.x < tNext.z ? 0 : 2) : (tNext.y < tNext.z ? 1 : 2);
+        tCell = tNext[a];
+        tNext[a] += tDelta[a];
+        c[a] += step[a];
+    }
+    if (found)
+        t = bestT;
+    return found;
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "InstanceBuffer.hpp"
+#include "shader.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+// One line of StreamingLines, the instance attributes of lines.vert
+struct LineSegment
+{
+    glm::vec3 from;
+    glm::vec3 to;
+};
+
+// Line segments that only ever grow, drawn as thick anti aliased lines : one instanced quad per segment, widened in
+// screen space by lines.vert and faded over its last pixel by lines.frag. New segments are written to a persistently
+// mapped ring and copied on the GPU to the end of the segment buffer, so a frame costs the segments added since the
+// last one whatever the history. A region of the ring is only written again once the fence of the copy reading it
+// has passed, the CPU waits only when more than the whole ring is in flight.
+class StreamingLines
+{
+public:
+    static const GLsizeiptr RING_BYTES = 1 << 20;
+
+    float thickness = 2.0f; // Pixels
+    glm::vec4 color = glm::vec4(1.0f);
+
+    uint32_t size() const { return count; }
+    size_t uploaded() const { return bytes; } // Since the last resetStats
+    uint32_t stalls() const { return waits; } // Since the last resetStats, fences the CPU had to wait for
+    void resetStats() { bytes = 0; waits = 0; }
+
+    void append(const LineSegment* segments, uint32_t n);
+    void append(const std::vector<LineSegment>& segments) { append(segments.data(), uint32_t(segments.size())); }
+    void clear() { count = 0; }
+    void draw(LinkedShader& shader, glm::mat4 mvp, glm::vec2 viewport) const;
+    void Delete();
+
+private:
+    struct Fence
+    {
+        GLsizeiptr begin, end; // Bytes of the ring read by the copy
+        GLsync sync;
+    };
+
+    GLuint vao = 0, ring = 0, segmentBuffer = 0;
+    GLsizeiptr segmentCapacity = 0; // Bytes
+    char* mapped = nullptr;
+    GLsizeiptr head = 0; // Next byte of the ring to write
+    std::deque<Fence> fences; // Oldest first, in ring order
+    uint32_t count = 0;
+    size_t bytes = 0;
+    uint32_t waits = 0;
+
+    void setup();
+    GLsizeiptr reserve(GLsizeiptr size);
+};
+
+
+void StreamingLines::setup()
+{
+    glGenBuffers(1, &ring);
+    glBindBuffer(GL_COPY_READ_BUFFER, ring);
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_COPY_READ_BUFFER, RING_BYTES, NULL, flags);
+    mapped = static_cast<char*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0, RING_BYTES, flags));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+    growBuffer(segmentBuffer, segmentCapacity, 0, 1024 * sizeof(LineSegment));
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, segmentBuffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(LineSegment), (void*)offsetof(LineSegment, from));
+    glVertexAttribDivisor(0, 1);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(LineSegment), (void*)offsetof(LineSegment, to));
+    glVertexAttribDivisor(1, 1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Offset of size free bytes of the ring, contiguous. Wrapping skips the end of the ring, the copies still reading
+// there are waited for as well since fences retire in ring order.
+GLsizeiptr StreamingLines::reserve(GLsizeiptr size)
+{
+    GLsizeiptr begin = head + size > RING_BYTES ? 0 : head;
+    auto overlaps = [&](const Fence& fence) {
+        if (begin < head) // Wrapped, [head, RING_BYTES) and [0, size) are taken
+            return fence.end > head || fence.begin < size;
+        return fence.begin < begin + size && fence.end > begin;
+    };
+    while (!fences.empty() && overlaps(fences.front())) {
+        Fence& fence = fences.front();
+        GLenum status = glClientWaitSync(fence.sync, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            waits++;
+            do
+                status = glClientWaitSync(fence.sync, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+            while (status == GL_TIMEOUT_EXPIRED);
+        }
+        glDeleteSync(fence.sync);
+        fences.pop_front();
+    }
+    // Signaled fences are dropped on the way so the queue stays short
+    while (!fences.empty()) {
+        GLenum status = glClientWaitSync(fences.front().sync, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+        glDeleteSync(fences.front().sync);
+        fences.pop_front();
+    }
+    head = begin + size;
+    return begin;
+}
+
+void StreamingLines::append(const LineSegment* segments, uint32_t n)
+{
+    if (n == 0)
+        return;
+    if (!ring)
+        setup();
+    growBuffer(segmentBuffer, segmentCapacity, GLsizeiptr(count) * sizeof(LineSegment),
+               GLsizeiptr(count + n) * sizeof(LineSegment));
+    const auto perPiece = uint32_t(RING_BYTES / sizeof(LineSegment));
+    glBindBuffer(GL_COPY_READ_BUFFER, ring);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, segmentBuffer);
+    for (uint32_t done = 0; done < n;) {
+        uint32_t piece = std::min(n - done, perPiece);
+        auto size = GLsizeiptr(piece * sizeof(LineSegment));
+        GLsizeiptr offset = reserve(size);
+        std::memcpy(mapped + offset, segments + done, size_t(size));
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offset,
+                            GLintptr(count) * sizeof(LineSegment), size);
+        fences.push_back({ offset, offset + size, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) });
+        count += piece;
+        done += piece;
+        bytes += size_t(size);
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+// Blended over the scene, the shader is active
+void StreamingLines::draw(LinkedShader& shader, glm::mat4 mvp, glm::vec2 viewport) const
+{
+    if (count == 0)
+        return;
+    shader.SetMat4("MVP", mvp);
+    shader.SetVec2("viewport", viewport);
+    shader.SetFloat("thickness", thickness);
+    shader.SetVec4("lineColor", color);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glBindVertexArray(vao);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GLsizei(count));
+    glBindVertexArray(0);
+    glDisable(GL_BLEND);
+}
+
+void StreamingLines::Delete()
+{
+    for (auto& fence : fences)
+        glDeleteSync(fence.sync);
+    fences.clear();
+    if (ring) {
+        glBindBuffer(GL_COPY_READ_BUFFER, ring);
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glDeleteBuffers(1, &ring);
+    }
+    if (segmentBuffer)
+        glDeleteBuffers(1, &segmentBuffer);
+    if (vao)
+        glDeleteVertexArrays(1, &vao);
+    ring = segmentBuffer = vao = 0;
+    mapped = nullptr;
+    head = segmentCapacity = 0;
+    count = 0;
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "BVH.hpp"
+#include "HalfEdge.hpp"
+#include "Model.hpp"
+#include "Ray.hpp"
+#include "PrimitiveStore.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Projects consecutive stroke samples on meshes. Samples of a stroke land on the same triangle or close to it, so
+// instead of a full scene query the projector walks the face adjacency from the previous hit toward the new ray.
+// It falls back to PrimitiveStore::closestHit when the walk leaves the surface (border, silhouette) or takes too long.
+// The walk follows the surface it started on, an occluder appearing in front of it mid stroke is not noticed.
+class StrokeProjector
+{
+public:
+    int maxSteps = 64;
+    uint32_t walked = 0, fallbacks = 0; // Samples resolved by each path since the last resetStats
+
+    explicit StrokeProjector(const PrimitiveStore& store) : store(store) {};
+
+    void addModel(uint32_t model, const Model& source);
+    bool project(const Ray& ray, SceneHit& hit);
+    void projectBatch(ThreadPool& pool, const std::vector<Ray>& rays, std::vector<SceneHit>& hits, std::vector<char>& found);
+    void reset() { last = INVALID_PRIMITIVE; }
+    void resetStats() { walked = 0; fallbacks = 0; }
+
+private:
+    const PrimitiveStore& store;
+    std::vector<const Model*> sources; // Indexed by store model, null without adjacency
+    PrimitiveHandle last = INVALID_PRIMITIVE;
+
+    bool walk(const Ray& ray, SceneHit& hit);
+};
+
+
+// The model must outlive the projector, its meshes hold the adjacency
+void StrokeProjector::addModel(uint32_t model, const Model& source)
+{
+    if (sources.size() <= model)
+        sources.resize(model + 1, nullptr);
+    sources[model] = &source;
+}
+
+bool StrokeProjector::project(const Ray& ray, SceneHit& hit)
+{
+    if (last != INVALID_PRIMITIVE && walk(ray, hit)) {
+        walked++;
+        last = hit.handle;
+        return true;
+    }
+    fallbacks++;
+    bool found = store.closestHit(ray, hit);
+    last = found && handleType(hit.handle) == PrimitiveType::Triangle ? hit.handle : INVALID_PRIMITIVE;
+    return found;
+}
+
+// Rays of one stroke, in order. Every worker projects a contiguous chunk with its own walk state, the first chunk
+// carries on from the previous batch and the last one leaves its hit for the next.
+void StrokeProjector::projectBatch(ThreadPool& pool, const std::vector<Ray>& rays, std::vector<SceneHit>& hits,
+                                   std::vector<char>& found)
+{
+    auto count = uint32_t(rays.size());
+    hits.assign(count, SceneHit());
+    found.assign(count, 0);
+
+    std::mutex merge;
+    pool.parallelFor(count, 16, [&](uint32_t begin, uint32_t end) {
+        StrokeProjector local(store);
+        local.maxSteps = maxSteps;
+        local.sources = sources;
+        if (begin == 0)
+            local.last = last;
+        for (uint32_t i = begin; i < end; i++)
+            found[i] = local.project(rays[i], hits[i]);
+
+        std::lock_guard<std::mutex> lock(merge);
+        walked += local.walked;
+        fallbacks += local.fallbacks;
+        if (end == count)
+            last = local.last;
+    });
+}
+
+// Barycentric walk in object space : while the ray misses the current face, cross the edge opposite to the most
+// negative barycentric coordinate. A missing twin means the walk left the surface.
+bool StrokeProjector::walk(const Ray& ray, SceneHit& hit)
+{
+    uint32_t model = handleModel(last);
+    if (model >= sources.size() || !sources[model] || store.models[model].instance < 0)
+        return false;
+    const BVHInstance& instance = store.triangles.instances[store.models[model].instance];
+    const BVH& blas = *instance.blas;
+    const TriangleSoA& tris = blas.triangles;
+    const auto& meshes = sources[model]->getMeshes();
+
+    glm::vec3 o(instance.invTransform * glm::vec4(ray.point, 1.0f));
+    glm::vec3 d(instance.invTransform * glm::vec4(ray.dir, 0.0f));
+
+    auto prim = uint32_t(handleIndex(last));
+    uint32_t mesh = blas.meshIds[prim];
+    uint32_t face = blas.triangleIds[prim];
+    if (mesh >= meshes.size() || meshes[mesh].adjacency.faces() <= face)
+        return false;
+    const HalfEdgeMesh& adjacency = meshes[mesh].adjacency;
+
+    int32_t previous = -1;
+    for (int step = 0; step < maxSteps; step++) {
+        glm::vec3 e1(tris.e1x[prim], tris.e1y[prim], tris.e1z[prim]);
+        glm::vec3 e2(tris.e2x[prim], tris.e2y[prim], tris.e2z[prim]);
+        glm::vec3 pvec = glm::cross(d, e2);
+        float det = glm::dot(e1, pvec);
+        if (std::fabs(det) < KERNEL_EPSILON)
+            return false;
+        float invDet = 1.f / det;
+        glm::vec3 tvec = o - glm::vec3(tris.v0x[prim], tris.v0y[prim], tris.v0z[prim]);
+        float u = glm::dot(tvec, pvec) * invDet;
+        glm::vec3 qvec = glm::cross(tvec, e1);
+        float v = glm::dot(d, qvec) * invDet;
+        float w = 1.f - u - v;
+
+        if (u >= 0.f && v >= 0.f && w >= 0.f) {
+            float t = glm::dot(e2, qvec) * invDet;
+            if (t <= 0.f)
+                return false;
+            hit.t = t;
+            hit.tExit = t;
+            hit.point = ray.point + t * ray.dir;
+            hit.handle = makeHandle(PrimitiveType::Triangle, model, prim);
+            hit.normal = store.normal(hit.handle, hit.point);
+            return true;
+        }
+
+        // Edge k goes from corner k to corner k + 1 : w is corner 0, u corner 1, v corner 2
+        int edge = 1;
+        if (u < w && u < v)
+            edge = 2;
+        else if (v < w && v < u)
+            edge = 0;
+        int32_t neighbor = adjacency.neighbor(face, edge);
+        // Bouncing back means the ray passes between the two faces, a full query settles it
+        if (neighbor < 0 || neighbor == previous)
+            return false;
+        previous = int32_t(face);
+        face = uint32_t(neighbor);
+        prim = blas.primitive(mesh, face);
+    }
+    return false;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Streaming polyline simplification, one point at a time. The polyline is anchored at its last kept point and ends
+// at a tail that the next point may still replace : the tail is dropped as long as it and every point dropped since
+// the anchor stay within tolerance of the segment from the anchor to the new point (a one pass Douglas-Peucker over a
+// sliding window). A turn sharper than maxTurn between segments longer than the tolerance also keeps the tail, small
+// corners are not cut by a large tolerance.
+// Vec is glm::vec2 for screen space samples or glm::vec3 for surface points.
+template<typename Vec>
+class StrokeSimplifier
+{
+public:
+    float tolerance = 1.0f;
+    float maxTurn = 45.0f; // Degrees
+    uint32_t maxWindow = 256; // Dropped points checked again, bounds the cost of long straight runs
+
+    uint32_t pushed() const { return pushes; }
+    uint32_t dropped() const { return drops; } // Since the last resetStats
+    void resetStats() { pushes = 0; drops = 0; }
+
+    bool empty() const { return !hasAnchor; }
+    const Vec& tail() const { return hasTail ? tailPoint : anchor; }
+
+    // Returns true when point is appended after the tail, false when it replaces the tail
+    bool push(const Vec& point);
+    // The tail is kept whatever comes next
+    void commit();
+    void reset();
+
+private:
+    Vec anchor = Vec(0.0f), tailPoint = Vec(0.0f);
+    bool hasAnchor = false, hasTail = false;
+    std::vector<Vec> window; // Points dropped between the anchor and the tail
+    uint32_t pushes = 0, drops = 0;
+
+    bool near(const Vec& point, const Vec& end) const;
+};
+
+
+// Distance from point to the segment from the anchor to end
+template<typename Vec>
+bool StrokeSimplifier<Vec>::near(const Vec& point, const Vec& end) const
+{
+    Vec d = end - anchor;
+    float length2 = glm::dot(d, d);
+    float t = length2 > 0.0f ? glm::clamp(glm::dot(point - anchor, d) / length2, 0.0f, 1.0f) : 0.0f;
+    Vec offset = point - (anchor + t * d);
+    return glm::dot(offset, offset) <= tolerance * tolerance;
+}
+
+template<typename Vec>
+bool StrokeSimplifier<Vec>::push(const Vec& point)
+{
+    pushes++;
+    if (!hasAnchor) {
+        anchor = point;
+        hasAnchor = true;
+        return true;
+    }
+    if (!hasTail) {
+        tailPoint = point;
+        hasTail = true;
+        return true;
+    }
+
+    bool keep = window.size() >= maxWindow || !near(tailPoint, point);
+    for (size_t i = 0; i < window.size() && !keep; i++)
+        keep = !near(window[i], point);
+    if (!keep) {
+        Vec in = tailPoint - anchor, out = point - tailPoint;
+        float inLength = glm::length(in), outLength = glm::length(out);
+        keep = inLength > tolerance && outLength > tolerance &&
+               glm::dot(in, out) < std::cos(glm::radians(maxTurn)) * inLength * outLength;
+    }
+
+    if (keep) {
+        anchor = tailPoint;
+        window.clear();
+    }
+    else {
+        window.push_back(tailPoint);
+        drops++;
+    }
+    tailPoint = point;
+    return keep;
+}
+
+template<typename Vec>
+void StrokeSimplifier<Vec>::commit()
+{
+    if (hasTail)
+        anchor = tailPoint;
+    hasTail = false;
+    window.clear();
+}
+
+template<typename Vec>
+void StrokeSimplifier<Vec>::reset()
+{
+    hasAnchor = hasTail = false;
+    window.clear();
+}
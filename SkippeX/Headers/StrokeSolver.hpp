@@ -0,0 +1,243 @@
+#pragma once
+
+#include "DistanceField.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Surfaces crossed by the ray of one stroke sample, nearest first, and the stroke point the sample placed
+struct StrokeSample
+{
+    uint32_t point;
+    SurfaceAnchor placed; // Where the greedy front / back toggle put the point
+    int greedy; // Candidate chosen by the toggle
+    std::vector<SurfaceAnchor> candidates;
+    std::vector<uint64_t> layers; // Id of the layer of each candidate, the same from one sample to the next
+    bool afterGap; // Samples off the surfaces come before this one
+};
+
+// Candidate picked for a stroke point by the solver
+struct StrokeChoice
+{
+    uint32_t point;
+    SurfaceAnchor placed;
+    SurfaceAnchor anchor;
+};
+
+// Picks one candidate per sample so that the stroke is a continuous 3D path : a dynamic programming pass over the
+// samples keeps, for every candidate, the cheapest path that ends on it. Steps cost their 3D length, plus a penalty
+// for changing layer while the stroke stays on the surfaces. On the surfaces a candidate either continues the path of
+// its own layer or changes layer from the cheapest path of the previous sample, so a sample costs O(candidates).
+// Across a gap the stroke is free to land on any layer and only the length counts, every pair is tried there.
+// The first sample prefers the greedy choice so that the depth layer setting still decides where the stroke starts.
+// Samples are added as they come and the path is read back from the last sample.
+class StrokeSolver
+{
+public:
+    float switchPenalty = 0.05f; // World units, layer change between two samples on the surfaces
+    float startBias = 0.1f; // World units, first sample away from its greedy candidate
+
+    uint32_t size() const { return uint32_t(samples.size()); }
+    void add(StrokeSample sample);
+    void solve(std::vector<StrokeChoice>& path) const;
+
+private:
+    std::vector<StrokeSample> samples;
+    std::vector<std::vector<float>> costs; // Cheapest path ending on each candidate
+    std::vector<std::vector<int>> previous; // Candidate of the previous sample on that path
+    std::unordered_map<uint64_t, int> lastLayers; // Layer id -> candidate of the last sample
+};
+
+
+void StrokeSolver::add(StrokeSample sample)
+{
+    auto count = sample.candidates.size();
+    std::vector<float> cost(count, 0.0f);
+    std::vector<int> from(count, -1);
+    if (samples.empty()) {
+        for (size_t j = 0; j < count; j++)
+            cost[j] = int(j) == sample.greedy ? 0.0f : startBias;
+    }
+    else {
+        const StrokeSample& last = samples.back();
+        const std::vector<float>& lastCost = costs.back();
+        auto step = [&](size_t i, size_t j) {
+            return lastCost[i] + glm::length(sample.candidates[j].point - last.candidates[i].point);
+        };
+        if (sample.afterGap) {
+            for (size_t j = 0; j < count; j++) {
+                cost[j] = std::numeric_limits<float>::max();
+                for (size_t i = 0; i < last.candidates.size(); i++)
+                    if (step(i, j) < cost[j]) {
+                        cost[j] = step(i, j);
+                        from[j] = int(i);
+                    }
+            }
+        }
+        else {
+            size_t cheapest = size_t(std::min_element(lastCost.begin(), lastCost.end()) - lastCost.begin());
+            for (size_t j = 0; j < count; j++) {
+                from[j] = int(cheapest);
+                cost[j] = step(cheapest, j) + (last.layers[cheapest] == sample.layers[j] ? 0.0f : switchPenalty);
+                auto same = lastLayers.find(sample.layers[j]);
+                if (same != lastLayers.end() && step(size_t(same->second), j) < cost[j]) {
+                    cost[j] = step(size_t(same->second), j);
+                    from[j] = same->second;
+                }
+            }
+        }
+    }
+    lastLayers.clear();
+    for (size_t j = 0; j < count; j++)
+        lastLayers.emplace(sample.layers[j], int(j));
+    samples.push_back(std::move(sample));
+    costs.push_back(std::move(cost));
+    previous.push_back(std::move(from));
+}
+
+void StrokeSolver::solve(std::vector<StrokeChoice>& path) const
+{
+    path.clear();
+    if (samples.empty())
+        return;
+    const std::vector<float>& lastCost = costs.back();
+    int candidate = int(std::min_element(lastCost.begin(), lastCost.end()) - lastCost.begin());
+    path.resize(samples.size());
+    for (size_t k = samples.size(); k-- > 0;) {
+        const StrokeSample& sample = samples[k];
+        path[k] = { sample.point, sample.placed, sample.candidates[candidate] };
+        candidate = previous[k][candidate];
+    }
+}
+
+// Solved stroke, generation is the one given to begin
+struct StrokeSolution
+{
+    uint32_t generation;
+    std::vector<StrokeChoice> path;
+};
+
+// Runs a StrokeSolver per stroke on a thread pool. Samples are batched by the drawing thread and handed to the
+// pool one batch at a time per stroke, so a stroke is solved while it is drawn and its path is ready shortly after
+// its end. Strokes are independent, a new one may start while the previous one is still solving.
+class BackgroundStrokeSolver
+{
+public:
+    float switchPenalty = 0.05f;
+    float startBias = 0.1f;
+
+    bool drawing() const { return !strokes.empty() && !strokes.back()->ended; }
+    void begin(uint32_t generation);
+    void add(StrokeSample sample);
+    void gap();
+    void end();
+    void pump(ThreadPool& pool);
+    bool poll(StrokeSolution& solution);
+    void wait(); // For the jobs in flight, before the pool or the solver go away
+
+private:
+    struct Stroke
+    {
+        StrokeSolver solver;
+        std::vector<StrokeSample> pending;
+        bool gapPending = false;
+        bool ended = false, solved = false;
+        std::future<void> running;
+        StrokeSolution solution;
+    };
+    std::deque<std::unique_ptr<Stroke>> strokes;
+};
+
+
+void BackgroundStrokeSolver::begin(uint32_t generation)
+{
+    end();
+    strokes.push_back(std::unique_ptr<Stroke>(new Stroke()));
+    strokes.back()->solver.switchPenalty = switchPenalty;
+    strokes.back()->solver.startBias = startBias;
+    strokes.back()->solution.generation = generation;
+}
+
+void BackgroundStrokeSolver::add(StrokeSample sample)
+{
+    if (!drawing() || sample.candidates.empty())
+        return;
+    Stroke& stroke = *strokes.back();
+    sample.afterGap = stroke.gapPending;
+    stroke.gapPending = false;
+    stroke.pending.push_back(std::move(sample));
+}
+
+void BackgroundStrokeSolver::gap()
+{
+    if (drawing())
+        strokes.back()->gapPending = true;
+}
+
+void BackgroundStrokeSolver::end()
+{
+    if (drawing())
+        strokes.back()->ended = true;
+}
+
+// Once per frame. A stroke has at most one job in flight, its samples stay in order.
+void BackgroundStrokeSolver::pump(ThreadPool& pool)
+{
+    for (auto& owned : strokes) {
+        Stroke* stroke = owned.get();
+        if (stroke->running.valid()) {
+            if (stroke->running.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                continue;
+            stroke->running.get();
+        }
+        if (!stroke->pending.empty()) {
+            auto batch = std::make_shared<std::vector<StrokeSample>>(std::move(stroke->pending));
+            stroke->pending.clear();
+            stroke->running = pool.submit([stroke, batch]() {
+                for (auto& sample : *batch)
+                    stroke->solver.add(std::move(sample));
+            });
+        }
+        else if (stroke->ended && !stroke->solved) {
+            stroke->running = pool.submit([stroke]() {
+                stroke->solver.solve(stroke->solution.path);
+                stroke->solved = true;
+            });
+        }
+    }
+}
+
+// Solutions come out in stroke order
+bool BackgroundStrokeSolver::poll(StrokeSolution& solution)
+{
+    if (strokes.empty())
+        return false;
+    Stroke& stroke = *strokes.front();
+    if (!stroke.ended ||
+        (stroke.running.valid() && stroke.running.wait_for(std::chrono::seconds(0)) != std::future_status::ready))
+        return false;
+    if (stroke.running.valid())
+        stroke.running.get();
+    if (!stroke.solved)
+        return false;
+    solution = std::move(stroke.solution);
+    strokes.pop_front();
+    return true;
+}
+
+void BackgroundStrokeSolver::wait()
+{
+    for (auto& stroke : strokes)
+        if (stroke->running.valid())
+            stroke->running.wait();
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Fixed size block of stroke samples, one array per column
+struct StrokeChunk
+{
+    static constexpr uint32_t SIZE = 1024;
+
+    glm::vec2 screen[SIZE]; // Window pixels, y up
+    glm::vec3 world[SIZE]; // Surface point, meaningless without a hit
+    glm::vec3 normal[SIZE];
+    uint8_t hit[SIZE];
+    uint8_t front[SIZE]; // Front / back toggle when the sample was taken
+    double time[SIZE];
+};
+
+// Samples of consecutive strokes
+struct StrokeRange
+{
+    uint32_t first;
+    uint32_t count;
+};
+
+// Every cursor sample of every stroke, in structure of arrays chunks that never move once allocated: appending is
+// O(1) and pointers into earlier samples stay valid, so renderers and plots read the columns in place. A stroke is
+// the range of samples between begin and end, its id is its index.
+class StrokeStore
+{
+public:
+    uint32_t size() const { return count; }
+    uint32_t strokes() const { return uint32_t(ranges.size()); }
+    StrokeRange stroke(uint32_t id) const { return ranges[id]; }
+    bool drawing() const { return open; }
+
+    uint32_t begin();
+    void end() { open = false; }
+    uint32_t append(glm::vec2 screen, glm::vec3 world, glm::vec3 normal, bool hit, bool front, double time);
+    void clear();
+
+    const StrokeChunk& chunk(uint32_t sample) const { return *chunks[sample / StrokeChunk::SIZE]; }
+    uint32_t slot(uint32_t sample) const { return sample % StrokeChunk::SIZE; }
+    const glm::vec2& screen(uint32_t sample) const { return chunk(sample).screen[slot(sample)]; }
+    const glm::vec3& world(uint32_t sample) const { return chunk(sample).world[slot(sample)]; }
+    const glm::vec3& normal(uint32_t sample) const { return chunk(sample).normal[slot(sample)]; }
+    bool hit(uint32_t sample) const { return chunk(sample).hit[slot(sample)] != 0; }
+    bool front(uint32_t sample) const { return chunk(sample).front[slot(sample)] != 0; }
+    double time(uint32_t sample) const { return chunk(sample).time[slot(sample)]; }
+
+    // Calls body(chunk, slot, n, first) for the contiguous pieces of [first, first + n), in order
+    template<typename Body>
+    void forEachSpan(uint32_t first, uint32_t n, Body body) const;
+
+private:
+    std::vector<std::unique_ptr<StrokeChunk>> chunks; // Only the pointers move when this grows
+    std::vector<StrokeRange> ranges;
+    uint32_t count = 0;
+    bool open = false;
+};
+
+
+// Starts a stroke, the previous one ends there
+uint32_t StrokeStore::begin()
+{
+    ranges.push_back({ count, 0 });
+    open = true;
+    return uint32_t(ranges.size() - 1);
+}
+
+// Samples outside of a stroke open one of their own
+uint32_t StrokeStore::append(glm::vec2 screen, glm::vec3 world, glm::vec3 normal, bool hit, bool front, double time)
+{
+    if (!open)
+        begin();
+    if (count / StrokeChunk::SIZE == chunks.size())
+        chunks.emplace_back(new StrokeChunk());
+    StrokeChunk& block = *chunks[count / StrokeChunk::SIZE];
+    uint32_t i = slot(count);
+    block.screen[i] = screen;
+    block.world[i] = world;
+    block.normal[i] = normal;
+    block.hit[i] = hit;
+    block.front[i] = front;
+    block.time[i] = time;
+    ranges.back().count++;
+    return count++;
+}
+
+// The chunks are kept for the next strokes
+void StrokeStore::clear()
+{
+    ranges.clear();
+    count = 0;
+    open = false;
+}
+
+template<typename Body>
+void StrokeStore::forEachSpan(uint32_t first, uint32_t n, Body body) const
+{
+    uint32_t end = std::min(count, first + n);
+    while (first < end) {
+        uint32_t piece = std::min(end - first, StrokeChunk::SIZE - slot(first));
+        body(chunk(first), slot(first), piece, first);
+        first += piece;
+    }
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+#include "BVH.hpp"
+#include "Ray.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// A bottom level BVH placed in the world. The BVH itself is never touched when the transform changes.
+struct BVHInstance
+{
+    const BVH* blas;
+    glm::mat4 transform;
+    glm::mat4 invTransform;
+    AABB bounds; // World space
+};
+
+struct InstanceHit
+{
+    TriangleHit hit; // Object space hit, hit.t is shared with world space
+    int instance = -1;
+    glm::vec3 point = glm::vec3(0.f);
+    glm::vec3 normal = glm::vec3(0.f);
+};
+
+class TLAS
+{
+public:
+    std::vector<BVHInstance> instances;
+    std::vector<BVHNode> nodes;
+    // Median splits keep the depth at log2 of the instance count, a traversal holds at most one more entry than that
+    static const int STACK_SIZE = 64;
+
+    TLAS() {};
+
+    int addInstance(const BVH* blas, const glm::mat4& transform);
+    bool setTransform(int id, const glm::mat4& transform);
+    void update();
+    bool intersect(const Ray& ray, InstanceHit& result) const;
+    void intersectAll(const Ray& ray, CrossingCollector& collector) const;
+
+private:
+    bool topologyDirty = false;
+    bool boundsDirty = false;
+
+    void updateInstanceBounds(BVHInstance& instance);
+    void build();
+    void buildNode(uint32_t nodeIdx, std::vector<uint32_t>& order, uint32_t first, uint32_t count);
+    void refit();
+    float intersectAABB(const Ray& ray, const glm::vec3& invDir, const BVHNode& node, float tMax) const;
+};
+
+
+int TLAS::addInstance(const BVH* blas, const glm::mat4& transform)
+{
+    BVHInstance instance;
+    instance.blas = blas;
+    instance.transform = transform;
+    instance.invTransform = glm::inverse(transform);
+    updateInstanceBounds(instance);
+    instances.push_back(instance);
+    topologyDirty = true;
+    return int(instances.size() - 1);
+}
+
+bool TLAS::setTransform(int id, const glm::mat4& transform)
+{
+    BVHInstance& instance = instances[id];
+    if (instance.transform == transform)
+        return false;
+    instance.transform = transform;
+    instance.invTransform = glm::inverse(transform);
+    updateInstanceBounds(instance);
+    boundsDirty = true;
+    return true;
+}
+
+void TLAS::update()
+{
+    if (topologyDirty)
+        build();
+    else if (boundsDirty)
+        refit();
+    topologyDirty = false;
+    boundsDirty = false;
+}
+
+void TLAS::updateInstanceBounds(BVHInstance& instance)
+{
+    AABB local = instance.blas->bounds();
+    instance.bounds = AABB();
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 corner((i & 1) ? local.bmax.x : local.bmin.x,
+                         (i & 2) ? local.bmax.y : local.bmin.y,
+                         (i & 4) ? local.bmax.z : local.bmin.z);
+        instance.bounds.grow(glm::vec3(instance.transform * glm::vec4(corner, 1.0f)));
+    }
+}
+
+void TLAS::build()
+{
+    nodes.clear();
+    if (instances.empty())
+        return;
+
+    std::vector<uint32_t> order(instances.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    nodes.reserve(2 * instances.size());
+    nodes.emplace_back();
+    buildNode(0, order, 0, uint32_t(order.size()));
+}
+
+// There are only a handful of instances so a median split on the widest axis is enough
+void TLAS::buildNode(uint32_t nodeIdx, std::vector<uint32_t>& order, uint32_t first, uint32_t count)
+{
+    if (count == 1) {
+        const AABB& b = instances[order[first]].bounds;
+        nodes[nodeIdx].bmin = b.bmin;
+        nodes[nodeIdx].bmax = b.bmax;
+        nodes[nodeIdx].leftFirst = order[first];
+        nodes[nodeIdx].count = 1;
+        return;
+    }
+
+    AABB centroidBounds;
+    for (uint32_t i = first; i < first + count; i++)
+        centroidBounds.grow((instances[order[i]].bounds.bmin + instances[order[i]].bounds.bmax) * 0.5f);
+    glm::vec3 extent = centroidBounds.bmax - centroidBounds.bmin;
+    int axis = 0;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+
+    uint32_t mid = first + count / 2;
+    std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + first + count,
+                     [&](uint32_t a, uint32_t b) {
+        return instances[a].bounds.bmin[axis] + instances[a].bounds.bmax[axis] <
+               instances[b].bounds.bmin[axis] + instances[b].bounds.bmax[axis];
+    });
+
+    auto left = uint32_t(nodes.size());
+    nodes.emplace_back();
+    nodes.emplace_back();
+    buildNode(left, order, first, mid - first);
+    buildNode(left + 1, order, mid, first + count - mid);
+
+    nodes[nodeIdx].bmin = glm::min(nodes[left].bmin, nodes[left + 1].bmin);
+    nodes[nodeIdx].bmax = glm::max(nodes[left].bmax, nodes[left + 1].bmax);
+    nodes[nodeIdx].leftFirst = left;
+    nodes[nodeIdx].count = 0;
+}
+
+// Children are always stored after their parent, so a reverse sweep updates the tree bottom-up
+void TLAS::refit()
+{
+    for (int i = int(nodes.size()) - 1; i >= 0; i--) {
+        BVHNode& node = nodes[i];
+        if (node.isLeaf()) {
+            node.bmin = instances[node.leftFirst].bounds.bmin;
+            node.bmax = instances[node.leftFirst].bounds.bmax;
+        }
+        else {
+            node.bmin = glm::min(nodes[node.leftFirst].bmin, nodes[node.leftFirst + 1].bmin);
+            node.bmax = glm::max(nodes[node.leftFirst].bmax, nodes[node.leftFirst + 1].bmax);
+        }
+    }
+}
+
+float TLAS::intersectAABB(const Ray& ray, const glm::vec3& invDir, const BVHNode& node, float tMax) const
+{
+    glm::vec3 t1 = (node.bmin - ray.point) * invDir;
+    glm::vec3 t2 = (node.bmax - ray.point) * invDir;
+    glm::vec3 tmin = glm::min(t1, t2);
+    glm::vec3 tmax = glm::max(t1, t2);
+    float tnear = std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, 0.f));
+    float tfar = std::min(std::min(tmax.x, tmax.y), std::min(tmax.z, tMax));
+    if (tnear <= tfar)
+        return tnear;
+    return std::numeric_limits<float>::max();
+}
+
+bool TLAS::intersect(const Ray& ray, InstanceHit& result) const
+{
+    if (nodes.empty())
+        return false;
+
+    glm::vec3 invDir = 1.f / ray.dir;
+    uint32_t stack[STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+    bool found = false;
+    while (sp > 0) {
+        const BVHNode& node = nodes[stack[--sp]];
+        if (intersectAABB(ray, invDir, node, result.hit.t) == std::numeric_limits<float>::max())
+            continue;
+        if (!node.isLeaf()) {
+            assert(sp + 2 <= STACK_SIZE);
+            stack[sp++] = node.leftFirst + 1;
+            stack[sp++] = node.leftFirst;
+            continue;
+        }
+
+        // The direction is transformed without normalizing so that t keeps its world space meaning
+        const BVHInstance& instance = instances[node.leftFirst];
+        Ray localRay(glm::vec3(instance.invTransform * glm::vec4(ray.point, 1.0f)),
+                     glm::vec3(instance.invTransform * glm::vec4(ray.dir, 0.0f)));
+        if (instance.blas->intersect(localRay, result.hit)) {
+            result.instance = int(node.leftFirst);
+            found = true;
+        }
+    }
+
+    if (found) {
+        const BVHInstance& instance = instances[result.instance];
+        result.point = ray.point + result.hit.t * ray.dir;
+        result.normal = glm::normalize(glm::transpose(glm::mat3(instance.invTransform)) * result.hit.normal);
+    }
+    return found;
+}
+
+// Crossing ids are (instance << 40) | triangle
+void TLAS::intersectAll(const Ray& ray, CrossingCollector& collector) const
+{
+    if (nodes.empty())
+        return;
+
+    glm::vec3 invDir = 1.f / ray.dir;
+    uint32_t stack[STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp > 0) {
+        const BVHNode& node = nodes[stack[--sp]];
+        if (intersectAABB(ray, invDir, node, collector.limit()) == std::numeric_limits<float>::max())
+            continue;
+        if (!node.isLeaf()) {
+            assert(sp + 2 <= STACK_SIZE);
+            stack[sp++] = node.leftFirst + 1;
+            stack[sp++] = node.leftFirst;
+            continue;
+        }
+        const BVHInstance& instance = instances[node.leftFirst];
+        Ray localRay(glm::vec3(instance.invTransform * glm::vec4(ray.point, 1.0f)),
+                     glm::vec3(instance.invTransform * glm::vec4(ray.dir, 0.0f)));
+        bool flipped = glm::determinant(glm::mat3(instance.transform)) < 0.f;
+        instance.blas->intersectAll(localRay, collector, uint64_t(node.leftFirst) << 40, flipped);
+    }
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for per frame jobs, where starting threads through std::async every frame would cost
+// more than the work itself. The calling thread takes part in parallelFor so a pool of size 1 runs inline.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned threads = std::max(1u, std::thread::hardware_concurrency()));
+    ~ThreadPool();
+
+    unsigned size() const { return unsigned(workers.size()) + 1; }
+    template<typename Body>
+    void parallelFor(uint32_t count, uint32_t minChunk, Body body);
+    std::future<void> submit(std::function<void()> task);
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void run();
+};
+
+
+ThreadPool::ThreadPool(unsigned threads)
+{
+    for (unsigned i = 1; i < threads; i++)
+        workers.emplace_back(&ThreadPool::run, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+void ThreadPool::run()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if (stopping && tasks.empty())
+                return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+// Split [0, count) in contiguous chunks of at least minChunk items, call body(begin, end) on each and wait for all.
+// Chunks are ordered, chunk 0 always starts at 0 and runs on the calling thread.
+template<typename Body>
+void ThreadPool::parallelFor(uint32_t count, uint32_t minChunk, Body body)
+{
+    if (count == 0)
+        return;
+    uint32_t chunks = std::min<uint32_t>(size(), (count + std::max(1u, minChunk) - 1) / std::max(1u, minChunk));
+    uint32_t chunk = (count + chunks - 1) / chunks;
+
+    std::vector<std::future<void>> pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t begin = chunk; begin < count; begin += chunk) {
+            uint32_t end = std::min(count, begin + chunk);
+            auto task = std::make_shared<std::packaged_task<void()>>([&body, begin, end]() { body(begin, end); });
+            pending.push_back(task->get_future());
+            tasks.emplace_back([task]() { (*task)(); });
+        }
+    }
+    wake.notify_all();
+
+    body(0u, std::min(count, chunk));
+    for (auto& job : pending)
+        job.get();
+}
+
+// Queues task and returns at once, a pool without workers runs it inline
+std::future<void> ThreadPool::submit(std::function<void()> task)
+{
+    auto job = std::make_shared<std::packaged_task<void()>>(std::move(task));
+    auto done = job->get_future();
+    if (workers.empty()) {
+        (*job)();
+        return done;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.emplace_back([job]() { (*job)(); });
+    }
+    wake.notify_one();
+    return done;
+}
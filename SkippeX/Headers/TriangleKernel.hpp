@@ -0,0 +1,412 @@
+#pragma once
+
+#include "Ray.hpp"
+#include "Simd.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <vector>
+
+// Triangles in structure of arrays layout, stored as one vertex and two edges for Moller-Trumbore.
+// The arrays are padded with 8 degenerate triangles so that kernels can always load full lanes.
+struct TriangleSoA
+{
+    std::vector<float> v0x, v0y, v0z;
+    std::vector<float> e1x, e1y, e1z;
+    std::vector<float> e2x, e2y, e2z;
+    uint32_t count = 0;
+
+    void resize(uint32_t n) {
+        count = n;
+        for (auto* a : { &v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z })
+            a->assign(n + 8, 0.f);
+    }
+    void set(uint32_t i, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+        v0x[i] = a.x; v0y[i] = a.y; v0z[i] = a.z;
+        e1x[i] = b.x - a.x; e1y[i] = b.y - a.y; e1z[i] = b.z - a.z;
+        e2x[i] = c.x - a.x; e2y[i] = c.y - a.y; e2z[i] = c.z - a.z;
+    }
+    // k = 0, 1, 2 for the three corners
+    glm::vec3 vertex(uint32_t i, int k) const {
+        glm::vec3 p(v0x[i], v0y[i], v0z[i]);
+        if (k == 1)
+            p += glm::vec3(e1x[i], e1y[i], e1z[i]);
+        else if (k == 2)
+            p += glm::vec3(e2x[i], e2y[i], e2z[i]);
+        return p;
+    }
+    glm::vec3 normal(uint32_t i) const {
+        return glm::normalize(glm::cross(glm::vec3(e1x[i], e1y[i], e1z[i]), glm::vec3(e2x[i], e2y[i], e2z[i])));
+    }
+};
+
+struct KernelHit
+{
+    float t = std::numeric_limits<float>::max();
+    float u = 0.f, v = 0.f;
+    uint32_t prim = 0;
+};
+
+// Closest hit among triangles [first, first + count) closer than hit.t.
+// On success t, u, v and prim are overwritten and true is returned.
+typedef bool (*TriangleKernel)(const TriangleSoA& tris, uint32_t first, uint32_t count, const Ray& ray, KernelHit& hit);
+
+enum class KernelType { Scalar = 0, SSE = 1, AVX2 = 2 };
+
+const float KERNEL_EPSILON = 1e-12f;
+
+// Reference implementation, every other kernel is validated against this one
+bool intersectTrianglesScalar(const TriangleSoA& tris, uint32_t first, uint32_t count, const Ray& ray, KernelHit& hit)
+{
+    bool found = false;
+    const glm::vec3 o = ray.point;
+    const glm::vec3 d = ray.dir;
+    for (uint32_t i = first; i < first + count; i++) {
+        glm::vec3 e1(tris.e1x[i], tris.e1y[i], tris.e1z[i]);
+        glm::vec3 e2(tris.e2x[i], tris.e2y[i], tris.e2z[i]);
+        glm::vec3 pvec = glm::cross(d, e2);
+        float det = glm::dot(e1, pvec);
+        if (std::fabs(det) < KERNEL_EPSILON)
+            continue;
+        float invDet = 1.f / det;
+        glm::vec3 tvec = o - glm::vec3(tris.v0x[i], tris.v0y[i], tris.v0z[i]);
+        float u = glm::dot(tvec, pvec) * invDet;
+        if (u < 0.f || u > 1.f)
+            continue;
+        glm::vec3 qvec = glm::cross(tvec, e1);
+        float v = glm::dot(d, qvec) * invDet;
+        if (v < 0.f || u + v > 1.f)
+            continue;
+        float t = glm::dot(e2, qvec) * invDet;
+        if (t <= 0.f || t >= hit.t)
+            continue;
+        hit.t = t;
+        hit.u = u;
+        hit.v = v;
+        hit.prim = i;
+        found = true;
+    }
+    return found;
+}
+
+// Every hit among triangles [first, first + count) closer than tMax, reported as onHit(t, prim, frontFacing).
+// tMax() is read again after each hit so that callers can tighten it while collecting.
+template<typename Limit, typename OnHit>
+void intersectTrianglesAll(const TriangleSoA& tris, uint32_t first, uint32_t count, const Ray& ray, Limit tMax, OnHit onHit)
+{
+    const glm::vec3 o = ray.point;
+    const glm::vec3 d = ray.dir;
+    for (uint32_t i = first; i < first + count; i++) {
+        glm::vec3 e1(tris.e1x[i], tris.e1y[i], tris.e1z[i]);
+        glm::vec3 e2(tris.e2x[i], tris.e2y[i], tris.e2z[i]);
+        glm::vec3 pvec = glm::cross(d, e2);
+        float det = glm::dot(e1, pvec);
+        if (std::fabs(det) < KERNEL_EPSILON)
+            continue;
+        float invDet = 1.f / det;
+        glm::vec3 tvec = o - glm::vec3(tris.v0x[i], tris.v0y[i], tris.v0z[i]);
+        float u = glm::dot(tvec, pvec) * invDet;
+        if (u < 0.f || u > 1.f)
+            continue;
+        glm::vec3 qvec = glm::cross(tvec, e1);
+        float v = glm::dot(d, qvec) * invDet;
+        if (v < 0.f || u + v > 1.f)
+            continue;
+        float t = glm::dot(e2, qvec) * invDet;
+        if (t <= 0.f || t >= tMax())
+            continue;
+        // det = -dot(dir, cross(e1, e2)), positive when the ray enters through the front face
+        onHit(t, i, det > 0.f);
+    }
+}
+
+// Part of a triangle a closest point lies on, corners are numbered as in TriangleSoA::vertex
+enum class TriangleFeature : uint8_t { Vertex0, Vertex1, Vertex2, Edge01, Edge12, Edge20, Face };
+
+// Point of triangle i nearest to p, by Voronoi region of the corners and edges (Ericson, Real-Time Collision Detection)
+glm::vec3 closestPointOnTriangle(const TriangleSoA& tris, uint32_t i, const glm::vec3& p, TriangleFeature& feature)
+{
+    glm::vec3 a(tris.v0x[i], tris.v0y[i], tris.v0z[i]);
+    glm::vec3 ab(tris.e1x[i], tris.e1y[i], tris.e1z[i]);
+    glm::vec3 ac(tris.e2x[i], tris.e2y[i], tris.e2z[i]);
+    glm::vec3 ap = p - a;
+    float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+    feature = TriangleFeature::Vertex0;
+    if (d1 <= 0.f && d2 <= 0.f)
+        return a;
+    glm::vec3 bp = ap - ab;
+    float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+    feature = TriangleFeature::Vertex1;
+    if (d3 >= 0.f && d4 <= d3)
+        return a + ab;
+    float vc = d1 * d4 - d3 * d2;
+    feature = TriangleFeature::Edge01;
+    if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f)
+        return a + ab * (d1 / (d1 - d3));
+    glm::vec3 cp = ap - ac;
+    float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+    feature = TriangleFeature::Vertex2;
+    if (d6 >= 0.f && d5 <= d6)
+        return a + ac;
+    float vb = d5 * d2 - d1 * d6;
+    feature = TriangleFeature::Edge20;
+    if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f)
+        return a + ac * (d2 / (d2 - d6));
+    float va = d3 * d6 - d5 * d4;
+    feature = TriangleFeature::Edge12;
+    if (va <= 0.f && (d4 - d3) >= 0.f && (d5 - d6) >= 0.f)
+        return a + ab + (ac - ab) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    feature = TriangleFeature::Face;
+    float denom = 1.f / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+glm::vec3 closestPointOnTriangle(const TriangleSoA& tris, uint32_t i, const glm::vec3& p)
+{
+    TriangleFeature feature;
+    return closestPointOnTriangle(tris, i, p, feature);
+}
+
+#ifdef SKIPPEX_X86
+
+// 4 lanes, SSE2 only so that it runs on every x86-64 CPU
+bool intersectTrianglesSSE(const TriangleSoA& tris, uint32_t first, uint32_t count, const Ray& ray, KernelHit& hit)
+{
+    const __m128 ox = _mm_set1_ps(ray.point.x), oy = _mm_set1_ps(ray.point.y), oz = _mm_set1_ps(ray.point.z);
+    const __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    const __m128 eps = _mm_set1_ps(KERNEL_EPSILON);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+
+    bool found = false;
+    uint32_t end = first + count;
+    for (uint32_t i = first; i < end; i += 4) {
+        __m128 e1x = _mm_loadu_ps(&tris.e1x[i]), e1y = _mm_loadu_ps(&tris.e1y[i]), e1z = _mm_loadu_ps(&tris.e1z[i]);
+        __m128 e2x = _mm_loadu_ps(&tris.e2x[i]), e2y = _mm_loadu_ps(&tris.e2y[i]), e2z = _mm_loadu_ps(&tris.e2z[i]);
+
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 invDet = _mm_div_ps(one, det);
+
+        __m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(&tris.v0x[i]));
+        __m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(&tris.v0y[i]));
+        __m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(&tris.v0z[i]));
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+        __m128 valid = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(int(end - i)), lane));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(_mm_and_ps(det, absMask), eps));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(u, one));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+        valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, zero));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(hit.t)));
+
+        int mask = _mm_movemask_ps(valid);
+        if (mask == 0)
+            continue;
+        alignas(16) float ts[4], us[4], vs[4];
+        _mm_store_ps(ts, t);
+        _mm_store_ps(us, u);
+        _mm_store_ps(vs, v);
+        for (int k = 0; k < 4; k++) {
+            if ((mask & (1 << k)) && ts[k] < hit.t) {
+                hit.t = ts[k];
+                hit.u = us[k];
+                hit.v = vs[k];
+                hit.prim = i + k;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+// 8 lanes per iteration
+SKIPPEX_TARGET_AVX2
+bool intersectTrianglesAVX2(const TriangleSoA& tris, uint32_t first, uint32_t count, const Ray& ray, KernelHit& hit)
+{
+    const __m256 ox = _mm256_set1_ps(ray.point.x), oy = _mm256_set1_ps(ray.point.y), oz = _mm256_set1_ps(ray.point.z);
+    const __m256 dx = _mm256_set1_ps(ray.dir.x), dy = _mm256_set1_ps(ray.dir.y), dz = _mm256_set1_ps(ray.dir.z);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    const __m256 eps = _mm256_set1_ps(KERNEL_EPSILON);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    bool found = false;
+    uint32_t end = first + count;
+    for (uint32_t i = first; i < end; i += 8) {
+        __m256 e1x = _mm256_loadu_ps(&tris.e1x[i]), e1y = _mm256_loadu_ps(&tris.e1y[i]), e1z = _mm256_loadu_ps(&tris.e1z[i]);
+        __m256 e2x = _mm256_loadu_ps(&tris.e2x[i]), e2y = _mm256_loadu_ps(&tris.e2y[i]), e2z = _mm256_loadu_ps(&tris.e2z[i]);
+
+        __m256 px = _mm256_fmsub_ps(dy, e2z, _mm256_mul_ps(dz, e2y));
+        __m256 py = _mm256_fmsub_ps(dz, e2x, _mm256_mul_ps(dx, e2z));
+        __m256 pz = _mm256_fmsub_ps(dx, e2y, _mm256_mul_ps(dy, e2x));
+        __m256 det = _mm256_fmadd_ps(e1x, px, _mm256_fmadd_ps(e1y, py, _mm256_mul_ps(e1z, pz)));
+        __m256 invDet = _mm256_div_ps(one, det);
+
+        __m256 tx = _mm256_sub_ps(ox, _mm256_loadu_ps(&tris.v0x[i]));
+        __m256 ty = _mm256_sub_ps(oy, _mm256_loadu_ps(&tris.v0y[i]));
+        __m256 tz = _mm256_sub_ps(oz, _mm256_loadu_ps(&tris.v0z[i]));
+        __m256 u = _mm256_mul_ps(_mm256_fmadd_ps(tx, px, _mm256_fmadd_ps(ty, py, _mm256_mul_ps(tz, pz))), invDet);
+
+        __m256 qx = _mm256_fmsub_ps(ty, e1z, _mm256_mul_ps(tz, e1y));
+        __m256 qy = _mm256_fmsub_ps(tz, e1x, _mm256_mul_ps(tx, e1z));
+        __m256 qz = _mm256_fmsub_ps(tx, e1y, _mm256_mul_ps(ty, e1x));
+        __m256 v = _mm256_mul_ps(_mm256_fmadd_ps(dx, qx, _mm256_fmadd_ps(dy, qy, _mm256_mul_ps(dz, qz))), invDet);
+        __m256 t = _mm256_mul_ps(_mm256_fmadd_ps(e2x, qx, _mm256_fmadd_ps(e2y, qy, _mm256_mul_ps(e2z, qz))), invDet);
+
+        __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(int(end - i)), lane));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_and_ps(det, absMask), eps, _CMP_GE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, zero, _CMP_GT_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(hit.t), _CMP_LT_OQ));
+
+        int mask = _mm256_movemask_ps(valid);
+        if (mask == 0)
+            continue;
+
+        // Nearest valid lane: broadcast the minimum t and keep the lanes equal to it
+        __m256 tm = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::max()), t, valid);
+        __m256 m = _mm256_min_ps(tm, _mm256_permute_ps(tm, _MM_SHUFFLE(2, 3, 0, 1)));
+        m = _mm256_min_ps(m, _mm256_permute_ps(m, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm256_min_ps(m, _mm256_permute2f128_ps(m, m, 1));
+        int nearest = _mm256_movemask_ps(_mm256_and_ps(valid, _mm256_cmp_ps(tm, m, _CMP_EQ_OQ)));
+        int k = 0;
+        while (!(nearest & (1 << k)))
+            k++;
+
+        alignas(32) float ts[8], us[8], vs[8];
+        _mm256_store_ps(ts, t);
+        _mm256_store_ps(us, u);
+        _mm256_store_ps(vs, v);
+        hit.t = ts[k];
+        hit.u = us[k];
+        hit.v = vs[k];
+        hit.prim = i + k;
+        found = true;
+    }
+    return found;
+}
+
+#endif
+
+bool cpuSupportsAVX2()
+{
+#if defined(SKIPPEX_X86) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#elif defined(SKIPPEX_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    bool fma = (info[2] & (1 << 12)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!fma || !osxsave || (_xgetbv(0) & 0x6) != 0x6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+
+KernelType bestKernelType()
+{
+#ifdef SKIPPEX_X86
+    if (cpuSupportsAVX2())
+        return KernelType::AVX2;
+    return KernelType::SSE;
+#else
+    return KernelType::Scalar;
+#endif
+}
+
+// Falls back to the best supported kernel when the requested one can not run on this CPU
+TriangleKernel selectTriangleKernel(KernelType type)
+{
+    if (type > bestKernelType())
+        type = bestKernelType();
+#ifdef SKIPPEX_X86
+    if (type == KernelType::AVX2)
+        return intersectTrianglesAVX2;
+    if (type == KernelType::SSE)
+        return intersectTrianglesSSE;
+#endif
+    return intersectTrianglesScalar;
+}
+
+TriangleKernel selectTriangleKernel()
+{
+    return selectTriangleKernel(bestKernelType());
+}
+
+const char* kernelName(KernelType type)
+{
+    switch (type) {
+        case KernelType::AVX2: return "AVX2";
+        case KernelType::SSE: return "SSE";
+        default: return "Scalar";
+    }
+}
+
+/**
+ * Cast random rays through the triangles bounds with every supported kernel and compare against the scalar path.
+ * Returns the number of rays where a kernel disagreed.
+ */
+int validateTriangleKernels(const TriangleSoA& tris, int rays = 1000)
+{
+    if (tris.count == 0)
+        return 0;
+    glm::vec3 bmin(std::numeric_limits<float>::max()), bmax(-std::numeric_limits<float>::max());
+    for (uint32_t i = 0; i < tris.count; i++) {
+        for (int k = 0; k < 3; k++) {
+            bmin = glm::min(bmin, tris.vertex(i, k));
+            bmax = glm::max(bmax, tris.vertex(i, k));
+        }
+    }
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    int mismatches = 0;
+    for (int r = 0; r < rays; r++) {
+        glm::vec3 target = bmin + (bmax - bmin) * glm::vec3(unit(rng), unit(rng), unit(rng));
+        glm::vec3 origin = target + (bmax - bmin) * (glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.f - 1.f) * 2.f;
+        Ray ray(origin, glm::normalize(target - origin));
+
+        KernelHit reference;
+        bool refFound = intersectTrianglesScalar(tris, 0, tris.count, ray, reference);
+        for (int type = int(KernelType::SSE); type <= int(bestKernelType()); type++) {
+            KernelHit hit;
+            bool found = selectTriangleKernel(KernelType(type))(tris, 0, tris.count, ray, hit);
+            if (found != refFound || (found && std::fabs(hit.t - reference.t) > 1e-4f * std::max(1.f, reference.t))) {
+                if (mismatches < 10)
+                    printf("Kernel %s mismatch on ray %d : %d t=%f, scalar %d t=%f\n", kernelName(KernelType(type)), r,
+                           int(found), hit.t, int(refFound), reference.t);
+                mismatches++;
+            }
+        }
+    }
+    printf("Validated triangle kernels up to %s on %d rays : %d mismatches\n", kernelName(bestKernelType()), rays, mismatches);
+    return mismatches;
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "InstanceBuffer.hpp"
+#include "evao.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Tube swept along a polyline, a ring of sides vertices around every point. Rings are oriented by rotation minimizing
+// frames computed with the double reflection method (Wang et al. 2008), so the tube does not twist along the curve.
+// Points farther apart than maxGap start a new strand. Strands only break on distance, so the last point of a stroke
+// and the first one of the next stroke are joined when they are closer than maxGap.
+// Vertices and indices stream into growing GPU buffers: extending the polyline only writes the new rings and the last
+// old one, whose tangent depends on the point after it. Moving the last point rewrites its ring and the one before.
+class TubeMesh
+{
+public:
+    int sides = 8;
+    float radius = 0.025f;
+    float maxGap = 0.5f;
+
+    uint32_t rings() const { return uint32_t(centers.size()); }
+    uint32_t triangles() const { return indexCount / 3; }
+    size_t uploaded() const { return bytes; } // Since the last resetStats
+    void resetStats() { bytes = 0; }
+
+    void clear();
+    template<typename Position>
+    void build(uint32_t count, Position position);
+    template<typename Position>
+    void extend(uint32_t count, Position position);
+    void draw() const;
+    void Delete();
+
+private:
+    GLuint vao = 0, vbo = 0, ebo = 0;
+    GLsizeiptr vboCapacity = 0, eboCapacity = 0;
+    uint32_t indexCount = 0;
+    size_t bytes = 0;
+    std::vector<glm::vec3> centers;
+    std::vector<glm::vec3> tangents;
+    std::vector<glm::vec3> frames; // Reference direction normal to the tangent of each ring
+    std::vector<char> starts; // Ring begins a strand
+
+    void sweep(uint32_t first);
+    void upload(uint32_t first);
+};
+
+
+void TubeMesh::clear()
+{
+    centers.clear();
+    tangents.clear();
+    frames.clear();
+    starts.clear();
+    indexCount = 0;
+}
+
+template<typename Position>
+void TubeMesh::build(uint32_t count, Position position)
+{
+    clear();
+    extend(count, position);
+}
+
+// Points [0, rings()) are assumed unchanged except for the last one, which may have moved
+template<typename Position>
+void TubeMesh::extend(uint32_t count, Position position)
+{
+    if (count < rings()) {
+        build(count, position);
+        return;
+    }
+    uint32_t old = rings();
+    bool moved = old > 0 && position(old - 1) != centers.back();
+    if (count == old && !moved)
+        return;
+    // A moved point also turns the ring before it
+    uint32_t first = old == 0 ? 0 : moved && old > 1 ? old - 2 : old - 1;
+    bool wasStart = old > 0 && starts[old - 1];
+    centers.resize(count);
+    tangents.resize(count);
+    frames.resize(count);
+    starts.resize(count);
+    for (uint32_t i = first; i < count; i++)
+        centers[i] = position(i);
+    sweep(first);
+    if (moved && bool(starts[old - 1]) != wasStart) {
+        // The point left or joined its strand, the quads before it change
+        build(count, position);
+        return;
+    }
+    // The quads ending at the moved ring are written again
+    if (moved && !wasStart)
+        indexCount -= 6 * uint32_t(sides);
+    upload(first);
+}
+
+// Tangents by central differences within a strand, frames transported from the previous ring
+void TubeMesh::sweep(uint32_t first)
+{
+    auto n = uint32_t(centers.size());
+    float gap2 = maxGap * maxGap;
+    auto linked = [&](uint32_t a, uint32_t b) {
+        glm::vec3 d = centers[b] - centers[a];
+        return glm::dot(d, d) <= gap2;
+    };
+    for (uint32_t i = first; i < n; i++) {
+        bool hasPrevious = i > 0 && linked(i - 1, i);
+        bool hasNext = i + 1 < n && linked(i, i + 1);
+        starts[i] = !hasPrevious;
+        glm::vec3 d = (hasNext ? centers[i + 1] : centers[i]) - (hasPrevious ? centers[i - 1] : centers[i]);
+        float length = glm::length(d);
+        tangents[i] = length > 1e-12f ? d / length : (i > 0 && hasPrevious ? tangents[i - 1] : glm::vec3(0, 0, 1));
+    }
+    // Any direction normal to t
+    auto normalTo = [](const glm::vec3& t) {
+        glm::vec3 axis = std::fabs(t.x) < 0.9f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0);
+        return glm::normalize(glm::cross(t, axis));
+    };
+    for (uint32_t i = first; i < n; i++) {
+        const glm::vec3& t = tangents[i];
+        if (starts[i]) {
+            frames[i] = normalTo(t);
+            continue;
+        }
+        glm::vec3 next = frames[i - 1];
+        const glm::vec3& t0 = tangents[i - 1];
+        glm::vec3 v1 = centers[i] - centers[i - 1];
+        float c1 = glm::dot(v1, v1);
+        if (c1 > 1e-20f) {
+            glm::vec3 rL = next - (2.f / c1) * glm::dot(v1, next) * v1;
+            glm::vec3 tL = t0 - (2.f / c1) * glm::dot(v1, t0) * v1;
+            glm::vec3 v2 = t - tL;
+            float c2 = glm::dot(v2, v2);
+            next = c2 < 1e-20f ? rL : rL - (2.f / c2) * glm::dot(v2, rL) * v2;
+        }
+        // Removes the drift of float rounding, and the tangent turn of repeated points the reflections do not see
+        next -= glm::dot(next, t) * t;
+        float length = glm::length(next);
+        frames[i] = length > 1e-6f ? next / length : normalTo(t);
+    }
+}
+
+// Rings from first on, and the quads between a ring and the one before it in the same strand
+void TubeMesh::upload(uint32_t first)
+{
+    auto n = uint32_t(centers.size());
+    std::vector<Vertex> vertices;
+    vertices.reserve(size_t(n - first) * sides);
+    for (uint32_t i = first; i < n; i++) {
+        glm::vec3 b = glm::cross(tangents[i], frames[i]);
+        for (int k = 0; k < sides; k++) {
+            float angle = 6.2831853f * float(k) / float(sides);
+            glm::vec3 normal = std::cos(angle) * frames[i] + std::sin(angle) * b;
+            vertices.push_back({ centers[i] + radius * normal, normal, glm::vec4(1.0f),
+                                 glm::vec2(float(k) / float(sides), float(i)) });
+        }
+    }
+
+    // Quads are written with the ring that ends them. The ones up to ring first already are, their vertices moved but
+    // their indices did not.
+    std::vector<GLuint> indices;
+    uint32_t keptIndices = indexCount;
+    for (uint32_t i = first + 1; i < n; i++) {
+        if (starts[i])
+            continue;
+        for (int k = 0; k < sides; k++) {
+            GLuint a = (i - 1) * sides + k, b = (i - 1) * sides + (k + 1) % sides;
+            GLuint c = i * sides + k, d = i * sides + (k + 1) % sides;
+            indices.insert(indices.end(), { a, b, d, a, d, c });
+        }
+    }
+
+    if (!vao) {
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vbo);
+        glGenBuffers(1, &ebo);
+    }
+    GLsizeiptr vertexOffset = GLsizeiptr(first) * sides * sizeof(Vertex);
+    growBuffer(vbo, vboCapacity, vertexOffset, GLsizeiptr(n) * sides * sizeof(Vertex));
+    growBuffer(ebo, eboCapacity, GLsizeiptr(keptIndices) * sizeof(GLuint),
+               GLsizeiptr(keptIndices + indices.size()) * sizeof(GLuint));
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, vertexOffset, GLsizeiptr(vertices.size() * sizeof(Vertex)), vertices.data());
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid *)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid *)offsetof(Vertex, Normal));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid *)offsetof(Vertex, Color));
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid *)offsetof(Vertex, TexCoords));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    if (!indices.empty())
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, GLintptr(keptIndices) * sizeof(GLuint),
+                        GLsizeiptr(indices.size() * sizeof(GLuint)), indices.data());
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    indexCount = keptIndices + uint32_t(indices.size());
+    bytes += vertices.size() * sizeof(Vertex) + indices.size() * sizeof(GLuint);
+}
+
+void TubeMesh::draw() const
+{
+    if (indexCount == 0)
+        return;
+    glBindVertexArray(vao);
+    glDrawElements(GL_TRIANGLES, GLsizei(indexCount), GL_UNSIGNED_INT, 0);
+    glBindVertexArray(0);
+}
+
+void TubeMesh::Delete()
+{
+    if (vao) {
+        glDeleteVertexArrays(1, &vao);
+        glDeleteBuffers(1, &vbo);
+        glDeleteBuffers(1, &ebo);
+    }
+    vao = vbo = ebo = 0;
+    vboCapacity = eboCapacity = 0;
+    clear();
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "Model.hpp"
+#include "Simd.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// World space positions and normals of a model, transformed once per unique vertex instead of once per index.
+// The object space copy is kept in structure of arrays layout so that the transform runs 4 vertices per iteration.
+// update() only transforms again when the model matrix actually changed, version() tells consumers when it did.
+class WorldVertexCache
+{
+public:
+    static const uint32_t CHUNK = 4096; // Vertices per thread pool job
+
+    // World space, padded to a multiple of 4
+    std::vector<float> px, py, pz;
+    std::vector<float> nx, ny, nz;
+    std::vector<uint32_t> meshBase; // First vertex of every mesh
+
+    explicit WorldVertexCache(const Model& model);
+
+    bool update(const glm::mat4& transform, ThreadPool& pool);
+    void invalidate() { dirty = true; }
+    uint32_t version() const { return updates; }
+    uint32_t size() const { return count; }
+    const Model& source() const { return model; }
+
+    glm::vec3 position(uint32_t v) const { return glm::vec3(px[v], py[v], pz[v]); }
+    glm::vec3 normal(uint32_t v) const { return glm::vec3(nx[v], ny[v], nz[v]); }
+    glm::vec3 position(uint32_t mesh, uint32_t v) const { return position(meshBase[mesh] + v); }
+
+private:
+    const Model& model;
+    uint32_t count = 0;
+    uint32_t updates = 0;
+    bool dirty = true;
+    glm::mat4 transform = glm::mat4(1.0f);
+    std::vector<float> ox, oy, oz;
+    std::vector<float> onx, ony, onz;
+
+    void transformRange(uint32_t first, uint32_t last, const glm::mat4& m, const glm::mat3& n);
+};
+
+
+WorldVertexCache::WorldVertexCache(const Model& model) : model(model)
+{
+    for (const Mesh& mesh : model.getMeshes()) {
+        meshBase.push_back(count);
+        count += uint32_t(mesh.vertices.size());
+    }
+    uint32_t padded = (count + 3) & ~3u;
+    for (auto* a : { &ox, &oy, &oz, &onx, &ony, &onz, &px, &py, &pz, &nx, &ny, &nz })
+        a->assign(padded, 0.f);
+    uint32_t v = 0;
+    for (const Mesh& mesh : model.getMeshes())
+        for (const Vertex& vertex : mesh.vertices) {
+            ox[v] = vertex.Position.x; oy[v] = vertex.Position.y; oz[v] = vertex.Position.z;
+            onx[v] = vertex.Normal.x; ony[v] = vertex.Normal.y; onz[v] = vertex.Normal.z;
+            v++;
+        }
+}
+
+// Returns true when the positions were transformed again
+bool WorldVertexCache::update(const glm::mat4& newTransform, ThreadPool& pool)
+{
+    if (!dirty && newTransform == transform)
+        return false;
+    transform = newTransform;
+    dirty = false;
+    glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(transform)));
+    uint32_t padded = uint32_t(px.size());
+    pool.parallelFor((padded + CHUNK - 1) / CHUNK, 1, [&](uint32_t begin, uint32_t end) {
+        transformRange(begin * CHUNK, std::min(padded, end * CHUNK), transform, normalMatrix);
+    });
+    updates++;
+    return true;
+}
+
+// [first, last) with first and last multiples of 4
+void WorldVertexCache::transformRange(uint32_t first, uint32_t last, const glm::mat4& m, const glm::mat3& n)
+{
+    uint32_t i = first;
+#ifdef SKIPPEX_X86
+    const __m128 m00 = _mm_set1_ps(m[0][0]), m01 = _mm_set1_ps(m[0][1]), m02 = _mm_set1_ps(m[0][2]);
+    const __m128 m10 = _mm_set1_ps(m[1][0]), m11 = _mm_set1_ps(m[1][1]), m12 = _mm_set1_ps(m[1][2]);
+    const __m128 m20 = _mm_set1_ps(m[2][0]), m21 = _mm_set1_ps(m[2][1]), m22 = _mm_set1_ps(m[2][2]);
+    const __m128 m30 = _mm_set1_ps(m[3][0]), m31 = _mm_set1_ps(m[3][1]), m32 = _mm_set1_ps(m[3][2]);
+    const __m128 n00 = _mm_set1_ps(n[0][0]), n01 = _mm_set1_ps(n[0][1]), n02 = _mm_set1_ps(n[0][2]);
+    const __m128 n10 = _mm_set1_ps(n[1][0]), n11 = _mm_set1_ps(n[1][1]), n12 = _mm_set1_ps(n[1][2]);
+    const __m128 n20 = _mm_set1_ps(n[2][0]), n21 = _mm_set1_ps(n[2][1]), n22 = _mm_set1_ps(n[2][2]);
+    const __m128 tiny = _mm_set1_ps(1e-30f);
+    for (; i + 4 <= last; i += 4) {
+        __m128 x = _mm_loadu_ps(&ox[i]), y = _mm_loadu_ps(&oy[i]), z = _mm_loadu_ps(&oz[i]);
+        _mm_storeu_ps(&px[i], _mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, x), _mm_mul_ps(m10, y)), _mm_add_ps(_mm_mul_ps(m20, z), m30)));
+        _mm_storeu_ps(&py[i], _mm_add_ps(_mm_add_ps(_mm_mul_ps(m01, x), _mm_mul_ps(m11, y)), _mm_add_ps(_mm_mul_ps(m21, z), m31)));
+        _mm_storeu_ps(&pz[i], _mm_add_ps(_mm_add_ps(_mm_mul_ps(m02, x), _mm_mul_ps(m12, y)), _mm_add_ps(_mm_mul_ps(m22, z), m32)));
+
+        x = _mm_loadu_ps(&onx[i]); y = _mm_loadu_ps(&ony[i]); z = _mm_loadu_ps(&onz[i]);
+        __m128 wx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n00, x), _mm_mul_ps(n10, y)), _mm_mul_ps(n20, z));
+        __m128 wy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n01, x), _mm_mul_ps(n11, y)), _mm_mul_ps(n21, z));
+        __m128 wz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n02, x), _mm_mul_ps(n12, y)), _mm_mul_ps(n22, z));
+        __m128 length = _mm_sqrt_ps(_mm_max_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(wx, wx), _mm_mul_ps(wy, wy)), _mm_mul_ps(wz, wz)), tiny));
+        _mm_storeu_ps(&nx[i], _mm_div_ps(wx, length));
+        _mm_storeu_ps(&ny[i], _mm_div_ps(wy, length));
+        _mm_storeu_ps(&nz[i], _mm_div_ps(wz, length));
+    }
+#endif
+    for (; i < last; i++) {
+        glm::vec3 p(m * glm::vec4(ox[i], oy[i], oz[i], 1.0f));
+        glm::vec3 w = n * glm::vec3(onx[i], ony[i], onz[i]);
+        float length = std::sqrt(std::max(glm::dot(w, w), 1e-30f));
+        px[i] = p.x; py[i] = p.y; pz[i] = p.z;
+        nx[i] = w.x / length; ny[i] = w.y / length; nz[i] = w.z / length;
+    }
+}
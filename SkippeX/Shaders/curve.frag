@@ -0,0 +1,10 @@
+#version 460 core
+
+out vec4 color;
+
+uniform vec4 Ucolor;
+
+void main()
+{
+    color = Ucolor;
+}
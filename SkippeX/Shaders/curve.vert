@@ -0,0 +1,8 @@
+#version 460 core
+layout ( location = 0 ) in vec3 aPos;
+
+// Control points are in world space, the tessellation stages place the curve
+void main( )
+{
+	gl_Position = vec4( aPos, 1.0f );
+}
@@ -0,0 +1,10 @@
+#version 460 core
+
+in vec4 curveColor;
+
+out vec4 color;
+
+void main()
+{
+    color = curveColor;
+}
@@ -0,0 +1,43 @@
+#version 460 core
+
+// One curve of CurveCollection per draw of the multi draw, its points are read from the storage buffer
+struct CurveRecord {
+    vec4 color;
+    uint first;
+    uint count;
+    float thickness;
+    uint pad;
+};
+
+layout ( std430, binding = 0 ) readonly buffer Points { vec4 points[]; };
+layout ( std430, binding = 1 ) readonly buffer Curves { CurveRecord curves[]; };
+
+out vec4 curveColor;
+
+uniform mat4 view;
+uniform mat4 projection;
+uniform vec2 viewport;
+
+vec2 toScreen(vec4 clip)
+{
+    return clip.xy / max(clip.w, 1e-3) * 0.5 * viewport;
+}
+
+void main( )
+{
+    CurveRecord curve = curves[gl_DrawID];
+    // gl_VertexID includes the base vertex of the command, vertices 2i and 2i + 1 are the sides of point i
+    uint index = uint(gl_VertexID) / 2u;
+    float side = (gl_VertexID & 1) == 0 ? -1.0 : 1.0;
+    uint previous = max(index, curve.first + 1u) - 1u;
+    uint next = min(index + 1u, curve.first + curve.count - 1u);
+
+    vec4 clip = projection * view * points[index];
+    vec2 direction = toScreen(projection * view * points[next]) - toScreen(projection * view * points[previous]);
+    direction = length(direction) > 1e-6 ? normalize(direction) : vec2(1.0, 0.0);
+    vec2 normal = vec2(-direction.y, direction.x);
+
+    clip.xy += normal * side * curve.thickness * 0.5 / (0.5 * viewport) * max(clip.w, 1e-3);
+    gl_Position = clip;
+    curveColor = curve.color;
+}
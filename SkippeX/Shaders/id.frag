@@ -0,0 +1,12 @@
+#version 460 core
+
+// Written to an RG32UI attachment : object 0 is the background
+out uvec2 id;
+
+uniform int objectId;
+uniform int primitiveBase;
+
+void main()
+{
+    id = uvec2(uint(objectId), uint(primitiveBase + gl_PrimitiveID));
+}
\ No newline at end of file
@@ -0,0 +1,17 @@
+#version 460 core
+
+in float across;
+
+out vec4 color;
+
+uniform vec4 lineColor;
+uniform float thickness;
+
+void main()
+{
+    // Pixel coverage of the line, the last pixel on each side fades out
+    float coverage = clamp(0.5 * thickness + 0.5 - abs(across), 0.0, 1.0);
+    if (coverage <= 0.0)
+        discard;
+    color = vec4(lineColor.rgb, lineColor.a * coverage);
+}
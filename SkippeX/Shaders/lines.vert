@@ -0,0 +1,38 @@
+#version 460 core
+
+// One segment of StreamingLines per instance, the four vertices of its quad in triangle strip order :
+// 0 and 1 at the start, 2 and 3 at the end, even vertices on the right of the line and odd ones on its left
+layout (location = 0) in vec3 from;
+layout (location = 1) in vec3 to;
+
+out float across; // Pixels from the center of the line
+
+uniform mat4 MVP;
+uniform vec2 viewport;
+uniform float thickness;
+
+vec2 toScreen(vec4 clip)
+{
+    return clip.xy / max(clip.w, 1e-3) * 0.5 * viewport;
+}
+
+void main()
+{
+    vec4 clipFrom = MVP * vec4(from, 1.0);
+    vec4 clipTo = MVP * vec4(to, 1.0);
+    bool atEnd = (gl_VertexID & 2) != 0;
+    float side = (gl_VertexID & 1) == 0 ? -1.0 : 1.0;
+
+    vec2 direction = toScreen(clipTo) - toScreen(clipFrom);
+    direction = length(direction) > 1e-6 ? normalize(direction) : vec2(1.0, 0.0);
+    vec2 normal = vec2(-direction.y, direction.x);
+
+    // Half the width and a pixel to fade over, the ends are pushed out as much so that consecutive segments overlap
+    float extent = 0.5 * thickness + 1.0;
+    vec2 offset = (normal * side + direction * (atEnd ? 1.0 : -1.0)) * extent;
+
+    vec4 clip = atEnd ? clipTo : clipFrom;
+    clip.xy += offset / (0.5 * viewport) * max(clip.w, 1e-3);
+    gl_Position = clip;
+    across = side * extent;
+}
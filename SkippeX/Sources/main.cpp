@@ -5,8 +5,28 @@
 #include "Mesh.hpp"
 #include "Model.hpp"
 #include "Camera.hpp"
-#include "Object.hpp"
+#include "CameraPath.hpp"
+#include "Ray.hpp"
 #include "Curve.hpp"
+#include "CurveFit.hpp"
+#include "CurvePatches.hpp"
+#include "CurveCollection.hpp"
+#include "InstanceBuffer.hpp"
+#include "Tube.hpp"
+#include "BVH.hpp"
+#include "PrimitiveStore.hpp"
+#include "IdPicker.hpp"
+#include "DepthPicker.hpp"
+#include "BulletPicker.hpp"
+#include "StrokeProjector.hpp"
+#include "StrokeSimplifier.hpp"
+#include "StrokeSolver.hpp"
+#include "StreamingLines.hpp"
+#include "StrokeStore.hpp"
+#include "ThreadPool.hpp"
+#include "DistanceField.hpp"
+#include "SpatialHash.hpp"
+#include "VertexCache.hpp"
 
 // System Headers
 // ImGui
@@ -24,6 +44,7 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 // Standard Headers
+#include <algorithm>
 #include <cstdio>
 #include <chrono>  
 #include <cstdlib>
@@ -31,6 +52,9 @@
 #include <cmath>
 #include <memory>
 #include <limits>
+#include <random>
+#include <string>
+#include <unordered_map>
 
 // Define Useful Variables and macros
 #define VSYNC GL_TRUE
@@ -91,40 +115,125 @@ bool showIntersected = false;
 bool polling_points = false;
 bool useSpheres = false;
 int switch_front_back = -1.f;
+int depthLayer = 0; // Which layer crossed by the picking ray receives the strokes, 0 is the nearest
 
-std::vector<glm::vec3> points_buffer; // To store the user strokes
-std::vector<float> points; // To store user strokes in an optimal way
-std::vector<float> intersected_points; // Strokes where we intersected an objecs
-std::vector<float> intersectStates; // Store the change of states from on to off segements
-std::vector<float> intersectSwitches; // Switch history between back and front so that later on we can flip front<->Back
-std::vector<Sphere> bounding_spheres; // Array of all bounding spheres that are used
+// Cursor positions delivered between two frames while drawing, in window pixels with their GLFW timestamp
+struct CursorSample
+{
+    double x, y;
+    double time;
+};
+std::vector<CursorSample> cursor_samples;
+bool simplify_samples = true; // Drop cursor samples close to the line through their neighbours before projecting them
+StrokeSimplifier<glm::vec2> sample_simplifier; // Tolerance in pixels
+CursorSample held_sample; // Last sample, kept until the next one tells whether it is needed
+bool sample_held = false;
+bool simplify_points = false; // Same on the stroke points, in world space, whatever the picking mode
+StrokeSimplifier<glm::vec3> point_simplifier;
+bool solve_strokes = true; // Choose the layer of every stroke point once the whole stroke is known
+BackgroundStrokeSolver stroke_solver;
+uint32_t stroke_generation = 0; // Changes when stroke points are removed, pending solutions then no longer apply
+
+// Picking backends selectable from the UI
+enum PickingMode { PICK_RAY = 0, PICK_ID_BUFFER = 1, PICK_DEPTH = 2, PICK_BULLET = 3 };
+int pickingMode = PICK_RAY;
+
+StrokeStore stroke_store; // Every cursor sample of the strokes with its hit, and the front / back state it was taken in
+SpherePool bounding_spheres; // Bounding sphere of every stroke point
+const uint32_t STROKE_MODEL = 0xFFFFF; // Model tag of the stroke spheres, they belong to no scene model
+std::vector<SurfaceAnchor> stroke_anchors; // Surface point under every bounding sphere, to change their height later
+SceneDistanceFields* distance_fields = nullptr; // Heights above meshes, null until the fields are baked
+const float maxDrawHeight = 7.0f; // Upper bound of the height slider, the distance fields cover up to this distance
+SpatialHash stroke_index(0.1f); // Positions of the bounding spheres under the same ids, for snapping, hovering and erasing
+size_t stroke_begin = 0; // First bounding sphere of the stroke being drawn
+int hovered_point = -1; // Bounding sphere under the cursor, -1 if none
+bool snap_strokes = true; // Join the ends of a new stroke to the points of earlier ones
+float snap_radius = 0.15f;
+float erase_radius = 0.1f;
+bool erase_requested = false;
 std::vector<glm::mat4> instanceMatrix; // All instance matrices that describe each instance model to pass to the shader
-Model* spheres; // spheres Model to load an object and then use its mesh to draw as many instances as we want
+Model* spheres = nullptr; // spheres Model to load an object and then use its mesh to draw as many instances as we want
+InstanceBuffer sphere_instances; // Matrices of the drawn spheres, the stroke points or the curve points
+bool gpu_curve = false; // Draw the interpolated curve from its control points with tessellation shaders
+CurvePatches curve_patches;
+CurveCollection kept_curves; // Finished curves, all drawn with one indirect call
+std::vector<uint32_t> kept_ids; // In the order they were kept
+glm::vec4 kept_color(1.0f, 0.6f, 0.2f, 1.0f);
+float kept_thickness = 3.0f; // Pixels
+bool tube_mode = false; // Draw the strokes or the interpolated curve as one swept tube instead of spheres
+TubeMesh stroke_tube;
+StreamingLines stroke_lines; // Debug lines of the stroke samples, extended with the new samples only
+uint32_t stroke_lines_built = 0; // Samples of the store already in stroke_lines
+int stroke_lines_mode = -1; // showIntersected and useSpheres the lines were built with
+int dragged_point = -1; // Stroke point following the cursor while the left button is held
+bool left_was_down = false;
 Curve* curve = nullptr; // Curve to fit the control points = intersected points
-Curve* detailed_curve = nullptr; // Curve with interpolated points
-std::vector<sObject> boundingObjects; // Bounding objects
+CameraPath camera_path; // Captured camera motion or interpolated curve, replayed by time
 bool useInterpolated = false; // Bool that states if interpolation is used
+int curveSampling = int(CurveSampling::Adaptive); // Fixed, Adaptive or ArcLength points on the interpolated curve
+float sampling_tolerance = 0.5f; // Adaptive, largest distance in pixels between the curve and its spheres
+float sampling_spacing = 0.05f; // ArcLength, world space distance between two spheres
+glm::vec3 eye_position(0.0f); // Camera position of the last frame, for screen space tolerances
+bool fit_curve = true; // Fit fewer control points to the stroke points instead of using each of them
+float fit_tolerance = 0.01f; // Largest mean distance between the fitted curve and the stroke points
+CurveFitter curve_fitter;
+
+/**
+ * Line segments of the stroke samples from the sample first on : their 2D path in window pixels, only the segments
+ * ending on a hit if hitsOnly, or the surface normals at the hits in world space if normals
+ */
+void strokeLineSegments(uint32_t first, bool hitsOnly, bool normals, std::vector<LineSegment>& segments);
+
+/**
+ * Find the entry (front) and exit (back) crossings of the nth layer along the ray, returns false if there are fewer layers
+ */
+bool selectLayer(const std::vector<Crossing>& crossings, int layer, Crossing& front, Crossing& back);
+
+/**
+ * Flip the front / back toggle when the last two stroke samples went on or off the surfaces
+ */
+void updateFrontBack();
+
+/**
+ * Add a sphere instance of a certain size at a certain distance from the front or back of the selected layer
+ */
+bool addSphereInstance(const PrimitiveStore& scene, Ray ray, const std::vector<Crossing>& crossings, int layer,
+                       float size=0.1f, float distance=0.5f, StrokeSample* sample=nullptr);
+/**
+ * Add a sphere instance at a certain distance above the surface point of the anchor
+ */
+bool addSurfaceInstance(const SurfaceAnchor& anchor, float size=0.1f, float distance=0.5f);
 
 /**
- * Render the 2D strokes of the user as lines and if intersect is true add the strokes in the corresponding vector
+ * Move the last point of the current stroke onto the nearest point of an earlier stroke if it is close enough
  */
-void renderLines(bool intersect);
+void snapStrokeEnd();
 
 /**
- * Render the 2D strokes of on the spheres using the normal at the intersection
+ * Move the points of a solved stroke on the layers the solver chose, unless they were edited since
  */
-void renderLinesOnSphere(bool intersect, Camera& cam, glm::vec3 hitPos, glm::vec3 hitNormal, glm::mat4 model);
+void applyStrokeSolution(const StrokeSolution& solution, float size=0.1f, float hdist=0.5f);
 
 /**
- * Add a sphere instance of a certain size at a certain distance from the hit positions P1 and P2 from the ray cast
+ * Remove the bounding spheres within radius of center, the remaining ones keep their order
  */
-void addSphereInstance(Ray ray, glm::vec2 t_vals, glm::vec3 origin, float size=0.1f, float distance=0.5f);
-// void addSphereInstance(Ray ray, glm::vec2 t_vals, float size, float distance, glm::vec3 origin)
+void erasePoints(glm::vec3 center, float radius);
+
+/**
+ * Write the world space geometry of the cached models and the stroke points to an OBJ file
+ */
+bool exportObj(const std::string& path, const std::vector<const WorldVertexCache*>& models);
+
 /**
  * If any parameter were changed (height, size, etc) recompute the transforms
  */
 void updateSphereInstances(glm::vec3 pos, float size=0.1, float hdist=0.5f);
 
+/**
+ * Move one stroke point over a new surface point, only the spheres it changes are uploaded again
+ */
+void moveStrokePoint(uint32_t id, const SurfaceAnchor& anchor, float size=0.1f, float hdist=0.5f);
+
 /**
  * Travel in the screen using the curve as reference positions and its tangent values for the orientations of the camera
  */
@@ -243,6 +352,24 @@ int main() {
     framebuffershader.Activate();
     framebuffershader.SetInt("screenTexture", 0);
 
+    LinkedShader idshader(std::vector<shader>({ shader(GL_VERTEX_SHADER, "id.vert"),
+                                                shader(GL_FRAGMENT_SHADER, "id.frag") }));
+    idshader.Compile();
+
+    LinkedShader curve_shader(std::vector<shader>({ shader(GL_VERTEX_SHADER, "curve.vert"),
+                                                    shader(GL_TESS_CONTROL_SHADER, "curve.tesc"),
+                                                    shader(GL_TESS_EVALUATION_SHADER, "curve.tese"),
+                                                    shader(GL_FRAGMENT_SHADER, "curve.frag") }));
+    curve_shader.Compile();
+
+    LinkedShader curves_shader(std::vector<shader>({ shader(GL_VERTEX_SHADER, "curves.vert"),
+                                                     shader(GL_FRAGMENT_SHADER, "curves.frag") }));
+    curves_shader.Compile();
+
+    LinkedShader lines_shader(std::vector<shader>({ shader(GL_VERTEX_SHADER, "lines.vert"),
+                                                    shader(GL_FRAGMENT_SHADER, "lines.frag") }));
+    lines_shader.Compile();
+
     // Define Useful variables (time_delta, ImGui elements, etc... )
     auto tchrono_start = std::chrono::high_resolution_clock::now();
     float speed = 1.0f;
@@ -257,10 +384,11 @@ int main() {
     float specularStrength = 0.5f;
     float fadeOff = 70.0f;
     bool replay = false;
-    float replaySpeed = 1.f;
+    float replaySpeed = 1.f; // Times real time for captures, world units per second along curves
     bool replayWithDrawing = false;
     bool noShading = true;
-    int replay_ind = 0;
+    double replay_time = 0.0; // Seconds into camera_path
+    double replay_clock = 0.0; // Loop time of the previous frame
     ImVec4 clear_color = ImVec4(0.15f, 0.15f, 0.25f, 1.0f);
     ImVec4 mcolor = ImVec4(0.25f, 0.25f, 0.25f, 1.0f);
 
@@ -299,11 +427,11 @@ int main() {
 
     glm::mat4 bBallModel = trans * rot * sca;
     glm::vec3 otherBallPos = glm::vec3(2.0f, 0.f, 0.f);
-    glm::mat4 bPlaneModel = glm::translate(glm::mat4(1.0f), planePos) * glm::mat4_cast(ballRotation) * glm::mat4(1.0f);
-    auto boundingBall = std::make_shared<Sphere>(ballPos, size * 0.50f);
-    auto boundingPlane = std::make_shared<Plane>(glm::vec3(0.0f), glm::vec3(0.f, 1.0f, 0.f));
 
-    boundingObjects.push_back(boundingBall);
+    // Everything that can be picked, the uvsphere mesh of the ball has a radius of 1
+    PrimitiveStore scene;
+    uint32_t ballModelId = scene.addModel(bBallModel);
+    scene.addSphere(ballModelId, ballPos, size);
 
     // Define Models get more at https://casual-effects.com/g3d/data10/index.html#mesh4
     Model nanosuit_model(glm::vec3(0.0f, -4.f, -10), glm::vec3(mscale), false);
@@ -312,34 +440,68 @@ int main() {
     nanosuitModel = glm::translate(nanosuitModel, nanosuit_model.pos);
     nanosuitModel = glm::scale(nanosuitModel, glm::vec3(mscale));
 
-    /*
-    auto nanosuit_triangles = nanosuit_model.populate_triangles(camera.projection * camera.view * nanosuitModel);
-    int boundingNonTriangleObjects = int(boundingObjects.size() - 1);
-
-    for (const auto& triangle : nanosuit_triangles)
-    {
-        boundingObjects.push_back(triangle);
-    }
-    */
-
-
     Model plane(planePos, glm::vec3(plscale), false);
     plane.loadModel("Sponza/Sponza.gltf");
 
+    // Bottom level acceleration structures for picking, built once in object space.
+    // Moving a model through the UI only refits the top level structure.
+    auto bvh_start = std::chrono::high_resolution_clock::now();
+    BVH nanosuit_bvh;
+    nanosuit_bvh.build(nanosuit_model);
+    BVH plane_bvh;
+    plane_bvh.build(plane);
+    auto bvh_end = std::chrono::high_resolution_clock::now();
+    printf("Built BVHs : nanosuit %d triangles, plane %d triangles in %ld ms\n", int(nanosuit_bvh.size()), int(plane_bvh.size()),
+           long(std::chrono::duration_cast<std::chrono::milliseconds>(bvh_end - bvh_start).count()));
+    int kernelType = int(bestKernelType());
+    printf("Using %s triangle kernel\n", kernelName(KernelType(kernelType)));
+    // The SIMD kernels are checked against the scalar reference once, their mismatches are shown with the kernel setting
+    int kernelMismatches = -1; // Nothing to compare with the scalar kernel alone
+    if (bestKernelType() != KernelType::Scalar)
+        kernelMismatches = validateTriangleKernels(nanosuit_bvh.triangles, 256);
+
+    uint32_t nanosuitModelId = scene.addModel(nanosuitModel, &nanosuit_bvh);
+    uint32_t planeModelId = scene.addModel(plane_model, &plane_bvh);
+
+    // Same scene in a Bullet collision world, to compare against the built-in intersectors
+    BulletPicker bulletPicker(scene);
+    bulletPicker.addModel(nanosuitModelId, nanosuit_model);
+    bulletPicker.addModel(planeModelId, plane);
+    bulletPicker.sync();
+    float builtinRate = 0.f, bulletRate = 0.f; // Rays per millisecond
+
+    // Strokes walk the mesh adjacency from their previous hit instead of querying the whole scene
+    StrokeProjector strokeProjector(scene);
+    strokeProjector.addModel(nanosuitModelId, nanosuit_model);
+    strokeProjector.addModel(planeModelId, plane);
+    ThreadPool pickingPool;
+    // Stroke points are about a sphere scale apart, a tenth of it is below what the spheres show
+    point_simplifier.tolerance = 0.005f;
+
+    // Signed distance fields keep stroke heights measured from the nearest surface, baked in object space once
+    // and cached next to the models. The band is the slider range at the load time scale.
+    auto sdf_start = std::chrono::high_resolution_clock::now();
+    SceneDistanceFields distanceFields(scene, pickingPool);
+    bool nanosuitCached = distanceFields.addModel(nanosuitModelId, nanosuit_bvh, maxDrawHeight / mscale, "nanosuit/nanosuit.sdf");
+    bool planeCached = distanceFields.addModel(planeModelId, plane_bvh, maxDrawHeight / plscale, "Sponza/Sponza.sdf");
+    distance_fields = &distanceFields;
+    auto sdf_end = std::chrono::high_resolution_clock::now();
+    printf("Distance fields : nanosuit %s %zu KB, plane %s %zu KB in %ld ms\n", nanosuitCached ? "cached" : "baked",
+           distanceFields.field(nanosuitModelId) ? distanceFields.field(nanosuitModelId)->bytes() / 1024 : 0,
+           planeCached ? "cached" : "baked",
+           distanceFields.field(planeModelId) ? distanceFields.field(planeModelId)->bytes() / 1024 : 0,
+           long(std::chrono::duration_cast<std::chrono::milliseconds>(sdf_end - sdf_start).count()));
+
+    // World space vertices for CPU consumers, transformed again only after their model moved
+    WorldVertexCache nanosuitWorld(nanosuit_model);
+    WorldVertexCache planeWorld(plane);
+
 
     Model uv_sphere(lightPos, glm::vec3(lscale), true);
     uv_sphere.loadModel("uvsphere/uvsphere.obj");
 
-    Model ball(boundingBall->origin, glm::vec3(size), true);
+    Model ball(ballPos, glm::vec3(size), true);
     ball.loadModel("uvsphere/uvsphere.obj");
-    /*
-    auto nanosuit_triangles = nanosuit_model.populate_triangles(camera.projection * camera.view * nanosuitModel);
-    printf("nanosuit triangles : %d\n", int(nanosuit_triangles.size()));
-    auto plane_triangles = plane.populate_triangles(camera.projection * camera.view * nanosuitModel);
-    printf("plane_triangles : %d\n", int(plane_triangles.size()));
-    auto uv_sphere_triangles = uv_sphere.populate_triangles(camera.projection * camera.view * nanosuitModel);
-    printf("ball_triangles : %d\n", int(uv_sphere_triangles.size()));
-    */
 
     // Frame Rectangle for framebuffers
     unsigned int rectVAO, rectVBO;
@@ -402,6 +564,20 @@ int main() {
     if (fboStatus != GL_FRAMEBUFFER_COMPLETE)
         std::cout << "Post-Processing Framebuffer error: " << fboStatus << std::endl;
 
+    // Single sample id target for GPU picking, read back asynchronously under the stroke samples or the cursor
+    IdPicker idPicker(width, height);
+    std::vector<IdSample> idSamples;
+    Ray idRay; // Newest id readback, with the ray it was requested along
+    SceneHit idHit;
+    bool idFound = false;
+    size_t strokePicks = 0; // Stroke samples requested from a picker and not back yet, the stroke ends after them
+    // Resolved depth of the rendered frame, stroke samples are unprojected on whatever is visible
+    DepthPicker depthPicker(width, height);
+    std::vector<DepthSample> depthSamples;
+    Ray depthRay; // Newest depth readback, its ray runs from the near plane to the placed point
+    SceneHit depthHit;
+    bool depthFound = false;
+
     auto t_start = glfwGetTime();
 
     // Rendering Loop
@@ -427,17 +603,15 @@ int main() {
             replayWithDrawing = false;
             polling_points = false;
         }
-        if (camera.positions.size() > 5) {
-            if (replay or replayWithDrawing) {
-                replay_ind += int(replaySpeed);
-                if (replay_ind >= int(camera.positions.size()))
-                    replay_ind = 0;
-                camera.P = camera.positions[replay_ind];
-                camera.O = camera.orientations[replay_ind];
-            }
+        // Playback follows the clock, a slow frame skips ahead instead of slowing the replay down
+        if ((replay or replayWithDrawing) && !camera_path.empty()) {
+            replay_time = std::fmod(replay_time + (time - replay_clock) * replaySpeed, double(camera_path.duration()));
+            camera_path.sample(float(replay_time), camera.P, camera.O);
         }
+        replay_clock = time;
 
         camera.update(fovDeg, 0.1f, 500.0f);
+        eye_position = camera.P;
 
         // Move light in the scene
         lightPos.x = float(radius * cos(time * speed));
@@ -445,61 +619,222 @@ int main() {
         lightPos.y = float(rheight * (time * speed));
 
 
-        // Intersect with ball
-        bool intersected = false;
-        glm::highp_f32vec3 intersect, normal;
-        float t = std::numeric_limits<float>::max();
-        glm::vec2 t_vals(0.f);
-        Object* intersectedObj;
-        Ray ray = camera.getClickDir(int(xpos), int(ypos), width, height);
-        for (const auto& obj : boundingObjects) {
-            auto curr_t = glm::vec2(std::numeric_limits<float>::max());
-            if (obj->get_intersection(ray, intersect, normal, curr_t)) {
-                t_vals[0] = curr_t[0];
-                t_vals[1] = curr_t[1];
-                intersected = true;
-                intersectedObj = obj.get();
-
-                /*
-                if (switch_front_back == 1) {
-                    if (curr_t[0] <= t) {
-                        t = curr_t[0];
-                        intersectedObj = obj.get();
-                    }
-                }
-                else if (switch_front_back = -1) {
-                    if (curr_t[1] <= t) {
-                        t = curr_t[1];
-                        intersectedObj = obj.get();
-                        auto intersect = ray.get_sample(curr_t[1]);
-                        normal = glm::highp_f32vec3(intersect.x - obj->origin.x, intersect.y - obj->origin.y, intersect.z - obj->origin.z);
-                        normal = glm::normalize(normal);
-                    }
-                }
-                 */
+        // Model transforms edited through ImGui only refit the top level structure
+        nanosuitModel = glm::scale(glm::translate(glm::mat4(1.0f), nanosuit_model.pos), glm::vec3(mscale));
+        plane_model = glm::translate(glm::mat4(1.0f), plane.pos);
+        plane_model = glm::rotate(plane_model, glm::radians(rotate_plane.x), glm::vec3(1.0f, 0.0f, 0.0f));
+        plane_model = glm::rotate(plane_model, glm::radians(rotate_plane.y), glm::vec3(0.0f, 1.0f, 0.0f));
+        plane_model = glm::rotate(plane_model, glm::radians(rotate_plane.z), glm::vec3(0.0f, 0.0f, 1.0f));
+        plane_model = glm::scale(plane_model, glm::vec3(plscale));
+        scene.setModelTransform(nanosuitModelId, nanosuitModel);
+        scene.setModelTransform(planeModelId, plane_model);
+        scene.update();
+        if (pickingMode == PICK_BULLET)
+            bulletPicker.sync();
+
+        if (!polling_points)
+            strokeProjector.reset();
+        if (!polling_points)
+            cursor_samples.clear();
+        // A still cursor keeps feeding the stroke once per frame, starting with the sample the simplifier held back
+        else if (cursor_samples.empty() && sample_held) {
+            cursor_samples.push_back(held_sample);
+            sample_simplifier.commit();
+            sample_held = false;
+        }
+        else if (cursor_samples.empty())
+            cursor_samples.push_back({ xpos, ypos, glfwGetTime() });
+        std::stable_sort(cursor_samples.begin(), cursor_samples.end(),
+                         [](const CursorSample& a, const CursorSample& b) { return a.time < b.time; });
+
+        // Id pass : object id is the scene model id + 1, its readback lands a few frames later
+        if (pickingMode == PICK_ID_BUFFER) {
+            idPicker.begin();
+            idshader.Activate();
+            idshader.SetMat4("view", camera.view);
+            idshader.SetMat4("projection", camera.projection);
+            idshader.SetMat4("model", bBallModel);
+            ball.DrawIds(idshader, int(ballModelId) + 1);
+            idshader.SetMat4("model", nanosuitModel);
+            nanosuit_model.DrawIds(idshader, int(nanosuitModelId) + 1);
+            idshader.SetMat4("model", plane_model);
+            plane.DrawIds(idshader, int(planeModelId) + 1);
+            idPicker.end();
+            // Every stroke sample of the frame is read back with its own ray, the cursor alone while not drawing
+            std::vector<glm::vec2> pixels;
+            std::vector<double> times;
+            if (cursor_samples.empty()) {
+                pixels.emplace_back(float(xpos), float(height - 1) - float(ypos));
+                times.push_back(glfwGetTime());
+            }
+            for (const auto& sample : cursor_samples) {
+                pixels.emplace_back(float(sample.x), float(height - 1) - float(sample.y));
+                times.push_back(sample.time);
             }
+            idPicker.request(pixels, times, cursor_samples.empty() ? 0 : 1, camera.invCM);
+            strokePicks += cursor_samples.size();
+            cursor_samples.clear();
         }
 
-        glm::mat4 intersectedModel;
-        if (intersected) {
-            if (intersectedObj->type == "Sphere") {
-                glm::highp_f32vec4 posIntersect = glm::inverse(bBallModel) * glm::highp_f32vec4(intersect, 1.0f);
-                printf("Intersected %s at (%f, %f, %f) for t(%f, %f)\n", intersectedObj->type.c_str(), intersect.x, intersect.y,
-                       intersect.z, t_vals[0], t_vals[1]);
-                intersectedModel = bBallModel;
+        // Stroke samples of the frame, in time order, with the ray and the closest hit of each
+        std::vector<CursorSample> strokeSamples;
+        std::vector<Ray> strokeRays;
+        std::vector<SceneHit> strokeHits;
+        std::vector<char> strokeFound;
+        std::vector<std::vector<Crossing>> strokeCrossings;
+
+        // Closest hit over every primitive pool, rays are moved to object space for the models triangles.
+        // With GPU picking only the primitive under each readback pixel is intersected, along the ray of its request.
+        // The depth mode needs no intersection at all, its samples carry no primitive.
+        Ray ray = camera.getClickDir(int(xpos), int(ypos), width, height);
+        SceneHit sceneHit;
+        bool intersected;
+        // Readbacks still in flight after a mode change are drained so that their stroke samples are not lost
+        if (pickingMode == PICK_ID_BUFFER || idPicker.inFlight() > 0) {
+            idSamples.clear();
+            idPicker.poll(idSamples);
+            for (const auto& picked : idSamples) {
+                if (picked.tag != 0)
+                    strokePicks--;
+                // A sample the readback could not hold says nothing about the surface, the stroke goes on without it
+                if (!picked.resolved)
+                    continue;
+                idRay = Ray(picked.origin, picked.direction);
+                idHit = SceneHit();
+                idFound = picked.id.x != 0 &&
+                          scene.intersectPrimitive(idRay, scene.fromGpuId(picked.id.x - 1, picked.id.y), idHit);
+                if (picked.tag == 0)
+                    continue;
+                strokeSamples.push_back({ double(picked.pixel.x), double(height - 1) - double(picked.pixel.y), picked.time });
+                strokeRays.push_back(idRay);
+                strokeHits.push_back(idHit);
+                strokeFound.push_back(idFound);
             }
-            else if (intersectedObj->type == "Plane") {
-                glm::highp_f32vec4 posIntersect = glm::inverse(bPlaneModel) * glm::highp_f32vec4(intersect, 1.0f);
-                printf("Intersected %s at (%f, %f, %f) for t(%f, %f)\n", intersectedObj->type.c_str(), intersect.x, intersect.y,
-                       intersect.z, t_vals[0], t_vals[1]);
-                intersectedModel = bPlaneModel;
+            // Layers behind the picked surface are only queried when a sample needs them
+            strokeCrossings.resize(strokeSamples.size());
+        }
+        if (pickingMode == PICK_DEPTH || depthPicker.inFlight() > 0) {
+            depthSamples.clear();
+            depthPicker.poll(depthSamples);
+            for (const auto& placed : depthSamples) {
+                if (placed.tag != 0)
+                    strokePicks--;
+                if (!placed.resolved)
+                    continue;
+                depthRay = Ray(placed.origin, placed.point - placed.origin);
+                depthHit = SceneHit();
+                depthFound = !placed.miss;
+                if (depthFound) {
+                    depthHit.point = placed.point;
+                    depthHit.normal = placed.normal;
+                    depthHit.t = depthHit.tExit = glm::length(placed.point - placed.origin);
+                }
+                if (placed.tag == 0)
+                    continue;
+                strokeSamples.push_back({ double(placed.pixel.x), double(height - 1) - double(placed.pixel.y), placed.time });
+                strokeRays.push_back(depthRay);
+                strokeHits.push_back(depthHit);
+                strokeFound.push_back(depthFound);
+                strokeCrossings.emplace_back();
             }
-            else if (intersectedObj->type == "Triangle") {
-                glm::highp_f32vec4 posIntersect = glm::inverse(nanosuitModel) * glm::highp_f32vec4(intersect, 1.0f);
-                printf("Intersected %s at (%f, %f, %f) for t(%f, %f)\n", intersectedObj->type.c_str(), intersect.x, intersect.y,
-                       intersect.z, t_vals[0], t_vals[1]);
-                intersectedModel = nanosuitModel;
+        }
+        if (pickingMode == PICK_DEPTH) {
+            sceneHit = depthHit;
+            intersected = depthFound;
+        }
+        else if (pickingMode == PICK_ID_BUFFER) {
+            ray = idRay;
+            sceneHit = idHit;
+            intersected = idFound;
+        }
+        else if (!polling_points)
+            intersected = pickingMode == PICK_BULLET ? bulletPicker.closestHit(ray, sceneHit)
+                                                     : scene.closestHit(ray, sceneHit);
+
+        // Every cursor sample delivered since the last frame is projected as one batch, on the worker pool for rays,
+        // the stroke then consumes the results in timestamp order. Bullet world queries stay on this thread.
+        if (polling_points && (pickingMode == PICK_RAY || pickingMode == PICK_BULLET)) {
+            std::vector<Ray> rays;
+            std::vector<SceneHit> hits;
+            std::vector<char> found;
+            for (const auto& sample : cursor_samples)
+                rays.push_back(camera.getClickDir(int(sample.x), int(sample.y), width, height));
+            if (pickingMode == PICK_RAY)
+                strokeProjector.projectBatch(pickingPool, rays, hits, found);
+            else {
+                hits.resize(rays.size());
+                found.resize(rays.size());
+                for (size_t i = 0; i < rays.size(); i++)
+                    found[i] = bulletPicker.closestHit(rays[i], hits[i]);
+            }
+            // Left empty, layers are then queried by the samples that need more than the closest hit.
+            // Deeper layers and the solver need them for every sample, those are fetched up front.
+            std::vector<std::vector<Crossing>> crossings(rays.size());
+            if (pickingMode == PICK_RAY && (depthLayer > 0 || solve_strokes))
+                pickingPool.parallelFor(uint32_t(rays.size()), 16, [&](uint32_t begin, uint32_t end) {
+                    for (uint32_t i = begin; i < end; i++)
+                        if (found[i])
+                            scene.allHits(rays[i], crossings[i], 2 * (depthLayer + 1));
+                });
+            strokeSamples.insert(strokeSamples.end(), cursor_samples.begin(), cursor_samples.end());
+            strokeRays.insert(strokeRays.end(), rays.begin(), rays.end());
+            strokeHits.insert(strokeHits.end(), hits.begin(), hits.end());
+            strokeFound.insert(strokeFound.end(), found.begin(), found.end());
+            for (auto& sampleCrossings : crossings)
+                strokeCrossings.push_back(std::move(sampleCrossings));
+            cursor_samples.clear();
+            ray = rays.back();
+            sceneHit = hits.back();
+            intersected = found.back();
+        }
+        // Strokes are solved on the pool while drawing goes on, finished ones move their points once.
+        // A stroke ends once the samples still being read back for it are placed.
+        if (!polling_points && strokePicks == 0) {
+            stroke_solver.end();
+            stroke_store.end();
+        }
+        stroke_solver.pump(pickingPool);
+        StrokeSolution strokeSolution;
+        while (stroke_solver.poll(strokeSolution))
+            applyStrokeSolution(strokeSolution, defaultBallScale, defaultDrawHeight);
+
+        // Stroke point under the cursor, picked with a ray as fat as the snapping radius. Surfaces in front hide it.
+        hovered_point = -1;
+        uint32_t hovered;
+        float hoveredT;
+        if (!polling_points && !active_mouse && stroke_index.nearRay(ray, snap_radius, hovered, hoveredT) &&
+            (!intersected || hoveredT <= sceneHit.t))
+            hovered_point = int(hovered);
+        // Pressing the left button on a hovered stroke point drags it over the surfaces under the cursor
+        bool left_down = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS && !ImGui::GetIO().WantCaptureMouse;
+        if (!left_down || polling_points || active_mouse)
+            dragged_point = -1;
+        else if (!left_was_down)
+            dragged_point = hovered_point;
+        left_was_down = left_down;
+        if (dragged_point >= 0 && intersected)
+            moveStrokePoint(uint32_t(dragged_point), { sceneHit.point, sceneHit.normal, sceneHit.handle }, defaultBallScale,
+                            defaultDrawHeight);
+        if (erase_requested) {
+            if (hovered_point >= 0) {
+                erasePoints(stroke_index.position(uint32_t(hovered_point)), erase_radius);
+                updateSphereInstances(glm::vec3(0.0f), defaultBallScale, defaultDrawHeight);
             }
+            erase_requested = false;
+        }
+
+        glm::highp_f32vec3 intersect = sceneHit.point;
+        glm::highp_f32vec3 normal = sceneHit.normal;
+        glm::vec2 t_vals(sceneHit.t, sceneHit.tExit);
+        PrimitiveType intersectedType = handleType(sceneHit.handle);
+
+        glm::mat4 intersectedModel(1.0f);
+        if (intersected) {
+            if (sceneHit.handle != INVALID_PRIMITIVE)
+                intersectedModel = scene.models[handleModel(sceneHit.handle)].transform;
+            printf("Intersected %s %d of model %d at (%f, %f, %f) for t(%f, %f)\n", primitiveTypeName(intersectedType),
+                   int(handleIndex(sceneHit.handle)), int(handleModel(sceneHit.handle)), intersect.x, intersect.y, intersect.z,
+                   t_vals[0], t_vals[1]);
         }
 
         glBindFramebuffer(GL_DRAW_FRAMEBUFFER, FBO);
@@ -519,12 +854,6 @@ int main() {
 
         /** Draw Models **/
         // Drawing UV_Sphere as a light
-        glm::mat4 plane_model(1.0f);
-        plane_model = glm::translate(plane_model, plane.pos);
-        plane_model = glm::rotate(plane_model, glm::radians(rotate_plane.x), glm::vec3(1.0f, 0.0f, 0.0f));
-        plane_model = glm::rotate(plane_model, glm::radians(rotate_plane.y), glm::vec3(0.0f, 1.0f, 0.0f));
-        plane_model = glm::rotate(plane_model, glm::radians(rotate_plane.z), glm::vec3(0.0f, 0.0f, 1.0f));
-        plane_model = glm::scale(plane_model, glm::vec3(plscale));
         plane_shader.Activate();
 
         // Settings Light uniforms
@@ -574,31 +903,6 @@ int main() {
 
         glCheckError(); glClearError();
 
-        if (not replayWithDrawing and spheres) {
-            // Drawing spheres instances
-            spheres_shader.Activate();
-
-            // Settings Light uniforms
-            spheres_shader.SetVec3("lightPos", lightPos);
-            spheres_shader.SetVec4("lightColor", lightColor);
-            if (noShading)
-                spheres_shader.SetInt("noShading", 1);
-            else
-                spheres_shader.SetInt("noShading", 0);
-            spheres_shader.SetFloat("ambientStrength", ambientStrength);
-            spheres_shader.SetFloat("specularStrength", specularStrength);
-            spheres_shader.SetFloat("fadeOff", fadeOff);
-
-            // Settings Model uniforms
-            spheres_shader.SetMat4("view", camera.view);
-            spheres_shader.SetMat4("projection", camera.projection);
-            spheres_shader.SetVec3("cameraPos", camera.P);
-            spheres_shader.SetFloat("far", camera.far);
-            spheres_shader.SetFloat("near", camera.near);
-            spheres_shader.SetVec4("Ucolor", glm::vec4(1.0f));
-            spheres->Draw(spheres_shader);
-        }
-        glCheckError(); glClearError();
 
         // Drawing Ball
         ballshader.Activate();
@@ -649,28 +953,143 @@ int main() {
 
         glCheckError(); glClearError();
 
-        if (!active_mouse) {
-            std::vector<float> pts;
-            if (showIntersected or useSpheres)
-                pts = intersected_points;
-            else
-                pts = points;
-            MLine mline(pts);
-            mline.setMVP(glm::mat4(1.0f));
-            mline.setup();
-            mline.draw();
+        // Depth of the scene models only, the stroke spheres drawn next must not catch new samples.
+        // Like the id pass, every stroke sample of the frame is read back, the cursor alone while not drawing.
+        if (pickingMode == PICK_DEPTH) {
+            std::vector<glm::vec2> pixels;
+            std::vector<double> times;
+            if (cursor_samples.empty()) {
+                pixels.emplace_back(float(xpos), float(height - 1) - float(ypos));
+                times.push_back(glfwGetTime());
+            }
+            for (const auto& sample : cursor_samples) {
+                pixels.emplace_back(float(sample.x), float(height - 1) - float(sample.y));
+                times.push_back(sample.time);
+            }
+            depthPicker.request(FBO, pixels, times, cursor_samples.empty() ? 0 : 1, camera.invCM);
+            strokePicks += cursor_samples.size();
+            cursor_samples.clear();
+        }
+
+        if (not replayWithDrawing and useInterpolated and gpu_curve) {
+            // Only the control points are on the GPU, the tessellator evaluates the curve
+            curve_shader.Activate();
+            curve_shader.SetMat4("view", camera.view);
+            curve_shader.SetMat4("projection", camera.projection);
+            curve_shader.SetVec4("Ucolor", glm::vec4(1.0f));
+            curve_patches.draw(curve_shader, glm::vec2(float(width), float(height)));
         }
+        else if (not replayWithDrawing and tube_mode) {
+            // The tube grows with the stroke, only the new rings are uploaded
+            if (polling_points && !useInterpolated)
+                stroke_tube.extend(uint32_t(bounding_spheres.size()), [](uint32_t i) { return bounding_spheres.center[i]; });
+            ballshader.Activate();
+            ballshader.SetMat4("model", glm::mat4(1.0f));
+            ballshader.SetInt("noTex", 1);
+            ballshader.SetInt("noShading", noShading ? 1 : 0);
+            ballshader.SetVec4("material.diffuse", glm::vec4(0.8f, 0.8f, 0.8f, 1.0f));
+            ballshader.SetVec4("material.specular", glm::vec4(0.5f, 0.5f, 0.5f, 1.0f));
+            ballshader.SetVec4("material.reflective", glm::vec4(0.0f));
+            ballshader.SetVec4("Ucolor", glm::vec4(1.0f));
+            stroke_tube.draw();
+        }
+        else if (not replayWithDrawing and spheres) {
+            // Drawing spheres instances
+            spheres_shader.Activate();
 
-        if (polling_points) {
-            if (intersected)
-                addSphereInstance(ray, t_vals, intersectedObj->origin, defaultBallScale, defaultDrawHeight);
-            intersectStates.push_back(float(intersected));
-            intersectSwitches.push_back(float(switch_front_back));
-            if (useSpheres)
-                renderLinesOnSphere(intersected, camera, intersect, normal, intersectedModel);
+            // Settings Light uniforms
+            spheres_shader.SetVec3("lightPos", lightPos);
+            spheres_shader.SetVec4("lightColor", lightColor);
+            if (noShading)
+                spheres_shader.SetInt("noShading", 1);
             else
-                renderLines(intersected);
+                spheres_shader.SetInt("noShading", 0);
+            spheres_shader.SetFloat("ambientStrength", ambientStrength);
+            spheres_shader.SetFloat("specularStrength", specularStrength);
+            spheres_shader.SetFloat("fadeOff", fadeOff);
+
+            // Settings Model uniforms
+            spheres_shader.SetMat4("view", camera.view);
+            spheres_shader.SetMat4("projection", camera.projection);
+            spheres_shader.SetVec3("cameraPos", camera.P);
+            spheres_shader.SetFloat("far", camera.far);
+            spheres_shader.SetFloat("near", camera.near);
+            spheres_shader.SetVec4("Ucolor", glm::vec4(1.0f));
+            spheres->Draw(spheres_shader);
+        }
+        if (kept_curves.size() > 0) {
+            curves_shader.Activate();
+            curves_shader.SetMat4("view", camera.view);
+            curves_shader.SetMat4("projection", camera.projection);
+            kept_curves.draw(curves_shader, glm::vec2(float(width), float(height)));
+        }
+        if (hovered_point >= 0) {
+            // Hovered stroke point, slightly larger than its sphere
+            glm::mat4 hoverModel = glm::translate(glm::mat4(1.0f), bounding_spheres.center[hovered_point]);
+            hoverModel = glm::scale(hoverModel, glm::vec3(bounding_spheres.radius[hovered_point] * 1.5f));
+            uvsphere_shader.Activate();
+            uvsphere_shader.SetMat4("model", hoverModel);
+            uv_sphere.Draw(uvsphere_shader);
         }
+        glCheckError(); glClearError();
+
+        if (!active_mouse) {
+            int mode = int(showIntersected) | int(useSpheres) << 1;
+            if (mode != stroke_lines_mode) {
+                stroke_lines.clear();
+                stroke_lines_built = 0;
+                stroke_lines_mode = mode;
+            }
+            std::vector<LineSegment> segments;
+            strokeLineSegments(stroke_lines_built, showIntersected, useSpheres, segments);
+            stroke_lines.append(segments);
+            stroke_lines_built = stroke_store.size();
+            lines_shader.Activate();
+            glm::mat4 linesMVP = useSpheres ? camera.CM : glm::ortho(0.0f, float(width), 0.0f, float(height));
+            stroke_lines.draw(lines_shader, linesMVP, glm::vec2(float(width), float(height)));
+        }
+
+        // One stroke sample : place its sphere instance and extend the 2D / projected lines.
+        // The sample keeps the time of its cursor event, picker readbacks land frames later.
+        auto addStrokeSample = [&](const Ray& sampleRay, bool hit, const SceneHit& sampleHit,
+                                   const std::vector<Crossing>& crossings, const CursorSample& cursor) {
+            if (hit && sampleHit.handle == INVALID_PRIMITIVE)
+                addSurfaceInstance({ sampleHit.point, sampleHit.normal, sampleHit.handle }, defaultBallScale, defaultDrawHeight);
+            else if (hit) {
+                updateFrontBack();
+                // The closest hit is enough for the front of the first layer, unless the solver wants every layer
+                std::vector<Crossing> layers;
+                const std::vector<Crossing>* sampleCrossings = &crossings;
+                if (crossings.empty() && depthLayer == 0 && switch_front_back == 1 && !solve_strokes) {
+                    layers.push_back({ sampleHit.t, sampleHit.handle, true });
+                    sampleCrossings = &layers;
+                }
+                else if (crossings.empty()) {
+                    // Two crossings per layer are enough as long as entries and exits alternate
+                    if (pickingMode == PICK_BULLET)
+                        bulletPicker.allHits(sampleRay, layers, 2 * (depthLayer + 1));
+                    else
+                        scene.allHits(sampleRay, layers, 2 * (depthLayer + 1));
+                    sampleCrossings = &layers;
+                }
+                StrokeSample solverSample;
+                if (addSphereInstance(scene, sampleRay, *sampleCrossings, depthLayer, defaultBallScale, defaultDrawHeight,
+                                      &solverSample))
+                    stroke_solver.add(std::move(solverSample));
+            }
+            else if (bounding_spheres.size() > stroke_begin) {
+                // Leaving the surfaces ends the stroke, the next hit starts a new one
+                snapStrokeEnd();
+                stroke_begin = bounding_spheres.size();
+            }
+            if (!hit)
+                stroke_solver.gap();
+            stroke_store.append(glm::vec2(float(cursor.x), float(height) - float(cursor.y)), sampleHit.point,
+                                sampleHit.normal, hit, switch_front_back == 1, cursor.time);
+        };
+
+        for (size_t i = 0; i < strokeSamples.size(); i++)
+            addStrokeSample(strokeRays[i], strokeFound[i], strokeHits[i], strokeCrossings[i], strokeSamples[i]);
 
         glCheckError(); glClearError();
 
@@ -744,7 +1163,7 @@ int main() {
 
         ImGui::Begin("Plane Settings");
         ImGui::Text("Plane Settings");
-        ImGui::SliderFloat("scale", &plscale, 0.0f, 1.0f);
+        ImGui::SliderFloat("scale", &plscale, 0.001f, 1.0f);
         ImGui::SliderFloat3("position", &plane.pos[0], -100, 100);
         ImGui::SliderFloat3("rotate", &rotate_plane[0], 0, 360);
         ImGui::ColorEdit3("color", (float*)&planeColor);
@@ -753,17 +1172,155 @@ int main() {
         ImGui::Begin("Selected Model settings");
         ImGui::Text("model settings");
         ImGui::SliderFloat3("position", &nanosuit_model.pos[0], -100, 100);
-        ImGui::SliderFloat("scale", &mscale, 0.0f, 5.0f);
+        ImGui::SliderFloat("scale", &mscale, 0.01f, 5.0f);
 
         ImGui::Text("Spheres settings");
         auto olddefaultDrawHeight = defaultDrawHeight;
         auto olddefaultBallScale = defaultBallScale;
         ImGui::SliderFloat("default Scale", &defaultBallScale, 0.0f, 0.075f);
-        ImGui::SliderFloat("default Height", &defaultDrawHeight, 0.0f, 7.0f);
+        ImGui::SliderFloat("default Height", &defaultDrawHeight, 0.0f, maxDrawHeight);
         ImGui::SliderInt("interpolation samples", &interpolation_samples, 2, 20);
         ImGui::Checkbox("useInterpolated", &useInterpolated);
-
-        if (olddefaultDrawHeight != defaultDrawHeight || olddefaultBallScale != defaultBallScale)
+        auto oldCurveSampling = curveSampling;
+        auto oldSamplingTolerance = sampling_tolerance;
+        auto oldSamplingSpacing = sampling_spacing;
+        ImGui::Combo("curve sampling", &curveSampling, "Fixed\0Adaptive\0Arc length\0");
+        if (curveSampling == int(CurveSampling::Adaptive))
+            ImGui::SliderFloat("tolerance (pixels)", &sampling_tolerance, 0.1f, 4.0f);
+        else if (curveSampling == int(CurveSampling::ArcLength))
+            ImGui::SliderFloat("spacing", &sampling_spacing, 0.005f, 0.5f);
+        auto oldGpuCurve = gpu_curve;
+        ImGui::Checkbox("GPU curve", &gpu_curve);
+        if (gpu_curve)
+            ImGui::SliderFloat("pixels per line", &curve_patches.pixelsPerSegment, 1.0f, 32.0f);
+        auto oldTubeMode = tube_mode;
+        auto oldTubeSides = stroke_tube.sides;
+        ImGui::Checkbox("tube", &tube_mode);
+        if (tube_mode) {
+            ImGui::SliderInt("tube sides", &stroke_tube.sides, 3, 32);
+            ImGui::Text("%u rings, %u triangles (%u for the spheres)", stroke_tube.rings(), stroke_tube.triangles(),
+                        spheres ? uint32_t(spheres->getMeshes()[0].indices.size() / 3) * sphere_instances.size() : 0u);
+        }
+        auto oldFitCurve = fit_curve;
+        auto oldFitTolerance = fit_tolerance;
+        ImGui::Checkbox("fit curve", &fit_curve);
+        if (fit_curve)
+            ImGui::SliderFloat("fit tolerance", &fit_tolerance, 0.001f, 0.1f);
+        if (curve && useInterpolated && gpu_curve)
+            ImGui::Text("%d control points for %d stroke points, %u patches", int(curve->control_points.size()),
+                        int(instanceMatrix.size()), curve_patches.patches());
+        else if (curve && useInterpolated)
+            ImGui::Text("%d control points for %d stroke points, %d interpolated spheres",
+                        int(curve->control_points.size()), int(instanceMatrix.size()), int(curve->points.size()));
+        ImGui::Text("instance uploads %.1f KB this frame, drag a hovered point to move it",
+                    (sphere_instances.uploaded() + curve_patches.uploaded() + stroke_tube.uploaded()) / 1024.0f);
+        sphere_instances.resetStats();
+        curve_patches.resetStats();
+        stroke_tube.resetStats();
+        ImGui::SliderFloat("stroke line width", &stroke_lines.thickness, 1.0f, 8.0f);
+        ImGui::Text("%u stroke line segments, uploads %.1f KB this frame, %u stalls", stroke_lines.size(),
+                    stroke_lines.uploaded() / 1024.0f, stroke_lines.stalls());
+        stroke_lines.resetStats();
+        ImGui::Checkbox("simplify samples", &simplify_samples);
+        if (simplify_samples)
+            ImGui::SliderFloat("sample tolerance (pixels)", &sample_simplifier.tolerance, 0.1f, 8.0f);
+        if (ImGui::Checkbox("simplify points", &simplify_points))
+            point_simplifier.reset();
+        if (simplify_points)
+            ImGui::SliderFloat("point tolerance", &point_simplifier.tolerance, 0.0005f, 0.05f, "%.4f");
+        ImGui::Text("dropped %u of %u samples, %u of %u points", sample_simplifier.dropped(), sample_simplifier.pushed(),
+                    point_simplifier.dropped(), point_simplifier.pushed());
+        ImGui::SameLine();
+        if (ImGui::Button("Reset##simplify")) {
+            sample_simplifier.resetStats();
+            point_simplifier.resetStats();
+        }
+        ImGui::Checkbox("solve strokes", &solve_strokes);
+        if (solve_strokes)
+            ImGui::SliderFloat("layer switch penalty", &stroke_solver.switchPenalty, 0.0f, 0.5f);
+        ImGui::Text("Kept curves");
+        ImGui::ColorEdit4("curve color", &kept_color[0]);
+        ImGui::SliderFloat("curve thickness", &kept_thickness, 1.0f, 16.0f);
+        if (ImGui::Button("Keep curve")) {
+            // The interpolated curve if there is one, the stroke points otherwise.
+            // A GPU curve only keeps its control points up to date, its points are evaluated first.
+            std::vector<glm::vec3> kept;
+            if (useInterpolated && gpu_curve && curve)
+                curve->rebuild();
+            if (useInterpolated && curve && !curve->points.empty())
+                kept = curve->points;
+            else
+                kept = bounding_spheres.center;
+            if (kept.size() > 1)
+                kept_ids.push_back(kept_curves.add(kept, kept_color, kept_thickness));
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Remove last") && !kept_ids.empty()) {
+            kept_curves.remove(kept_ids.back());
+            kept_ids.pop_back();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Clear curves")) {
+            kept_curves.clear();
+            kept_ids.clear();
+        }
+        ImGui::Text("%u curves, %u points, uploads %.1f KB this frame", kept_curves.size(), kept_curves.points(),
+                    kept_curves.uploaded() / 1024.0f);
+        kept_curves.resetStats();
+        ImGui::Checkbox("snap stroke ends", &snap_strokes);
+        ImGui::SliderFloat("snap radius", &snap_radius, 0.0f, 0.5f);
+        ImGui::SliderFloat("erase radius", &erase_radius, 0.0f, 1.0f);
+        ImGui::Text("hovered point %d of %u, Shift+E erases around it", hovered_point, stroke_index.size());
+
+        ImGui::Text("Picking settings");
+        if (ImGui::Combo("triangle kernel", &kernelType, "Scalar\0SSE\0AVX2\0")) {
+            nanosuit_bvh.kernel = selectTriangleKernel(KernelType(kernelType));
+            plane_bvh.kernel = selectTriangleKernel(KernelType(kernelType));
+            kernelType = int(std::min(KernelType(kernelType), bestKernelType()));
+        }
+        if (kernelMismatches >= 0) {
+            ImGui::Text("SIMD kernels against scalar : %d mismatches", kernelMismatches);
+            ImGui::SameLine();
+            if (ImGui::Button("Validate kernels"))
+                kernelMismatches = validateTriangleKernels(nanosuit_bvh.triangles);
+        }
+        ImGui::SliderInt("depth layer", &depthLayer, 0, 7);
+        ImGui::Combo("picking", &pickingMode, "Ray cast\0GPU ids\0Depth buffer\0Bullet\0");
+        if (ImGui::Button("Compare ray backends")) {
+            // The same random camera rays through the built-in intersectors and the Bullet world
+            std::mt19937 rng(0);
+            std::vector<Ray> rays;
+            for (int i = 0; i < 20000; i++)
+                rays.push_back(camera.getClickDir(int(rng() % width), int(rng() % height), width, height));
+            bulletPicker.sync();
+            int builtinHits = 0, bulletHits = 0;
+            auto bench_start = std::chrono::high_resolution_clock::now();
+            for (const auto& r : rays) {
+                SceneHit hit;
+                builtinHits += scene.closestHit(r, hit);
+            }
+            auto bench_mid = std::chrono::high_resolution_clock::now();
+            for (const auto& r : rays) {
+                SceneHit hit;
+                bulletHits += bulletPicker.closestHit(r, hit);
+            }
+            auto bench_end = std::chrono::high_resolution_clock::now();
+            builtinRate = float(rays.size()) / std::max(1e-3f, std::chrono::duration<float, std::milli>(bench_mid - bench_start).count());
+            bulletRate = float(rays.size()) / std::max(1e-3f, std::chrono::duration<float, std::milli>(bench_end - bench_mid).count());
+            printf("Picking %d rays : built-in %d hits %.1f rays/ms, Bullet %d hits %.1f rays/ms\n", int(rays.size()),
+                   builtinHits, builtinRate, bulletHits, bulletRate);
+        }
+        ImGui::Text("built-in %.1f rays/ms, Bullet %.1f rays/ms", builtinRate, bulletRate);
+        ImGui::Text("stroke samples : %u walked, %u full queries", strokeProjector.walked, strokeProjector.fallbacks);
+        ImGui::SameLine();
+        if (ImGui::Button("Reset"))
+            strokeProjector.resetStats();
+
+        if (olddefaultDrawHeight != defaultDrawHeight || olddefaultBallScale != defaultBallScale ||
+            oldTubeMode != tube_mode || oldTubeSides != stroke_tube.sides ||
+            (useInterpolated && (oldCurveSampling != curveSampling || oldSamplingTolerance != sampling_tolerance ||
+                                 oldSamplingSpacing != sampling_spacing || oldFitCurve != fit_curve || oldGpuCurve != gpu_curve ||
+                                 oldFitTolerance != fit_tolerance)))
         {
             updateSphereInstances(glm::vec3(0.0f), defaultBallScale, defaultDrawHeight);
         }
@@ -773,6 +1330,18 @@ int main() {
         if (ImGui::Button("Shading")) {
             noShading = !noShading;
         }
+        if (ImGui::Button("Export OBJ")) {
+            auto export_start = std::chrono::high_resolution_clock::now();
+            bool moved = nanosuitWorld.update(nanosuitModel, pickingPool);
+            moved |= planeWorld.update(plane_model, pickingPool);
+            auto export_mid = std::chrono::high_resolution_clock::now();
+            bool written = exportObj("scene.obj", { &nanosuitWorld, &planeWorld });
+            auto export_end = std::chrono::high_resolution_clock::now();
+            printf("%s scene.obj : vertices %s in %ld ms, written in %ld ms\n", written ? "Exported" : "Could not export",
+                   moved ? "transformed" : "cached",
+                   long(std::chrono::duration_cast<std::chrono::milliseconds>(export_mid - export_start).count()),
+                   long(std::chrono::duration_cast<std::chrono::milliseconds>(export_end - export_mid).count()));
+        }
 
         ImGui::End();
 
@@ -787,21 +1356,32 @@ int main() {
         ImGui::SliderFloat3("position", &camera.P[0], -50.f, 50.f);
         ImGui::Checkbox("Capture", &camera.capture);
         ImGui::Checkbox("Capture Cursor", &leftMouse);
-        ImGui::Checkbox("Replay", &replay);
-        ImGui::SliderFloat("replaySpeed", &replaySpeed, 1.f, 100.f);
+        if (ImGui::Checkbox("Replay", &replay) && replay) {
+            camera_path.fromCapture(camera.positions, camera.orientations, camera.times);
+            replay_time = 0.0;
+            replayWithDrawing = false;
+        }
+        ImGui::SliderFloat("replaySpeed", &replaySpeed, 0.1f, 10.f);
+        // Only curve paths are smoothed, the one being replayed is rebuilt so the slider shows at once
+        if (ImGui::SliderFloat("path smoothing", &camera_path.smoothing, 0.0f, 1.0f) && replayWithDrawing)
+            replayCamWithDrawing(camera);
 
         if (replay or replayWithDrawing)
             active_mouse = false;
 
         if (ImGui::Button("replayCamWithDrawing")) {
             replayWithDrawing = true;
+            replay = false;
+            replay_time = 0.0;
             replayCamWithDrawing(camera);
         }
 
         if (ImGui::Button("reset capture")) {
             camera.positions.clear();
             camera.orientations.clear();
-            replay_ind = 0;
+            camera.times.clear();
+            camera_path.clear();
+            replay_time = 0.0;
             replay = false;
             replayWithDrawing = false;
         }
@@ -820,8 +1400,12 @@ int main() {
             ImPlot::EndPlot();
         }
         if (ImPlot::BeginPlot("My Plot")) {
-            ImPlot::PlotLine("States", &t_data[0], &intersectStates[0], int(intersectStates.size()));
-            ImPlot::PlotLine("SwitchesOnOff", &t_data[0], &intersectSwitches[0], int(intersectSwitches.size()));
+            // Sample index on x, the columns are plotted in place one chunk at a time
+            stroke_store.forEachSpan(0, stroke_store.size(), [](const StrokeChunk& chunk, uint32_t slot, uint32_t n,
+                                                                uint32_t first) {
+                ImPlot::PlotLine("States", &chunk.hit[slot], int(n), 1.0, double(first));
+                ImPlot::PlotLine("SwitchesOnOff", &chunk.front[slot], int(n), 1.0, double(first));
+            });
             ImPlot::EndPlot();
         }
         ImGui::End();
@@ -848,9 +1432,22 @@ int main() {
     uv_sphere.Delete();
     if (spheres)
         spheres->Delete();
+    stroke_solver.wait();
+    sphere_instances.Delete();
+    curve_patches.Delete();
+    stroke_tube.Delete();
+    kept_curves.Delete();
+    stroke_lines.Delete();
 
     glDeleteFramebuffers(1, &FBO);
     glDeleteRenderbuffers(1, &RBO);
+    idshader.Delete();
+    curve_shader.Delete();
+    curves_shader.Delete();
+    lines_shader.Delete();
+    idPicker.Delete();
+    depthPicker.Delete();
+    bulletPicker.Delete();
 
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
@@ -879,18 +1476,34 @@ void cursor_position_callback(GLFWwindow* w, double x_pos, double y_pos) {
         return;
     xpos = x_pos;
     ypos = y_pos;
+    if (!polling_points)
+        return;
+    CursorSample sample = { x_pos, y_pos, glfwGetTime() };
+    if (!simplify_samples) {
+        cursor_samples.push_back(sample);
+        return;
+    }
+    // The held sample is projected once the new one leaves the tolerance band, otherwise the new one replaces it
+    if (sample_simplifier.push(glm::vec2(float(x_pos), float(y_pos))) && sample_held)
+        cursor_samples.push_back(held_sample);
+    held_sample = sample;
+    sample_held = true;
 }
 
 void input() {
 
     if(glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS and glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS) {
-        points_buffer.clear();
-        points.clear();
-        intersected_points.clear();
+        stroke_store.clear();
+        stroke_lines.clear();
+        stroke_lines_built = 0;
         instanceMatrix.clear();
         bounding_spheres.clear();
-        intersectStates.clear();
-        intersectSwitches.clear();
+        stroke_anchors.clear();
+        stroke_index.clear();
+        stroke_begin = 0;
+        stroke_generation++;
+        hovered_point = -1;
+        dragged_point = -1;
     }
 
     if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
@@ -902,18 +1515,34 @@ void input() {
         active_mouse = !active_mouse;
         if (active_mouse)
         {
+            if (polling_points)
+                snapStrokeEnd();
             polling_points = false;
         }
     }
 
     if(!active_mouse && glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS and glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
     {
+        if (!polling_points) {
+            stroke_begin = bounding_spheres.size();
+            stroke_store.begin();
+            sample_simplifier.reset();
+            sample_held = false;
+            if (solve_strokes)
+                stroke_solver.begin(stroke_generation);
+        }
         polling_points = true;
     }
     if(!active_mouse && glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS and glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
     {
+        if (polling_points)
+            snapStrokeEnd();
         polling_points = false;
     }
+    if(!active_mouse && glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS and glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
+    {
+        erase_requested = true;
+    }
     if(!active_mouse && glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS and glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS)
     {
         showIntersected = !showIntersected;
@@ -925,6 +1554,8 @@ void input() {
     }
     if(!active_mouse && glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS and glfwGetKey(window, GLFW_KEY_U) == GLFW_PRESS)
     {
+        if (polling_points)
+            snapStrokeEnd();
         polling_points = false;
         showIntersected = false;
         useSpheres = false;
@@ -933,223 +1564,373 @@ void input() {
     }
 }
 
-void renderLines(bool intersect)
+void strokeLineSegments(uint32_t first, bool hitsOnly, bool normals, std::vector<LineSegment>& segments)
 {
-    //Getting cursor position
-    glm::vec3 p(0.f,0.f,0.f);
-    p.x = float(xpos);
-    p.y = float(height - ypos);
-    p.z = 0;
-    // std::cout << "(" << p.x << "," << p.y << ")" << std::endl;
-
-    if (points_buffer.empty()) {
-        points_buffer.push_back(p);
+    segments.clear();
+    // Back to the first stroke that reaches the sample first, the work is proportional to the new samples
+    uint32_t id = stroke_store.strokes();
+    while (id > 0 && stroke_store.stroke(id - 1).first + stroke_store.stroke(id - 1).count > first)
+        id--;
+    for (; id < stroke_store.strokes(); id++) {
+        StrokeRange range = stroke_store.stroke(id);
+        for (uint32_t i = std::max(first, range.first); i < range.first + range.count; i++) {
+            if (normals && stroke_store.hit(i))
+                segments.push_back({ stroke_store.world(i), stroke_store.world(i) + stroke_store.normal(i) * 0.5f });
+            else if (!normals && i > range.first && (!hitsOnly || stroke_store.hit(i)))
+                segments.push_back({ glm::vec3(stroke_store.screen(i - 1), 0.0f), glm::vec3(stroke_store.screen(i), 0.0f) });
+        }
     }
-    else if (points_buffer.back().x != p.x and points_buffer.back().y != p.y) {
-        points_buffer.push_back(p);
-        if (points_buffer.size() > 2)
-        {
-            auto start = points_buffer.at(points_buffer.size() - 2);
-            auto end = points_buffer.back();
-            float x1 = start.x;
-            float y1 = start.y;
-            float x2 = end.x;
-            float y2 = end.y;
-            auto w = float(width);
-            auto h = float(height);
-
-            // convert 3d world space position 2d screen space position
-            x1 = 2 * x1 / w - 1;
-            y1 = 2 * y1 / h - 1;
-
-            x2 = 2 * x2 / w - 1;
-            y2 = 2 * y2 / h - 1;
-
-            start.x = x1;
-            start.y = y1;
-            end.x = x2;
-            end.y = y2;
-
-            points.push_back(start.x);
-            points.push_back(start.y);
-            points.push_back(start.z);
-            points.push_back(end.x);
-            points.push_back(end.y);
-            points.push_back(end.z);
-
-            if (intersect)
-            {
-                intersected_points.push_back(start.x);
-                intersected_points.push_back(start.y);
-                intersected_points.push_back(start.z);
-                intersected_points.push_back(end.x);
-                intersected_points.push_back(end.y);
-                intersected_points.push_back(end.z);
+}
+
+bool selectLayer(const std::vector<Crossing>& crossings, int layer, Crossing& front, Crossing& back)
+{
+    int entered = -1;
+    for (size_t i = 0; i < crossings.size(); i++) {
+        if (!crossings[i].entering || ++entered != layer)
+            continue;
+        front = crossings[i];
+        back = front;
+        for (size_t j = i + 1; j < crossings.size(); j++) {
+            if (!crossings[j].entering) {
+                back = crossings[j];
+                break;
             }
         }
+        return true;
+    }
+    // A ray starting inside a surface only sees exits, treat the first one as the nearest layer
+    if (entered < 0 && layer == 0 && !crossings.empty()) {
+        front = crossings[0];
+        back = front;
+        return true;
     }
+    return false;
+}
+
+void updateFrontBack()
+{
+    if (stroke_store.size() < 2)
+        return;
+    bool OnOff = stroke_store.hit(stroke_store.size() - 1);
+    bool prevOnOff = stroke_store.hit(stroke_store.size() - 2);
+    if (OnOff != prevOnOff)
+        switch_front_back *= -1;
+}
 
-    std::cout << "Total Points : " << points_buffer.size() << std::endl;
+bool addSphereInstance(const PrimitiveStore& scene, Ray ray, const std::vector<Crossing>& crossings, int layer,
+                       float size, float distance, StrokeSample* sample)
+{
+    if (stroke_store.size() < 2)
+        return false;
+    Crossing front, back;
+    if (!selectLayer(crossings, layer, front, back))
+        return false;
+    const Crossing& selected = switch_front_back == 1 ? front : back;
+    glm::vec3 hitPos = ray.point + selected.t * ray.dir;
+    SurfaceAnchor placed = { hitPos, scene.normal(selected.id, hitPos), selected.id };
+    if (!addSurfaceInstance(placed, size, distance))
+        return false;
+    if (sample) {
+        // Every crossing is a candidate for the stroke solver
+        sample->point = uint32_t(bounding_spheres.size() - 1);
+        sample->placed = placed;
+        sample->greedy = 0;
+        sample->candidates.clear();
+        sample->layers.clear();
+        // A layer is the n-th entry into or exit from the same model along the ray, which does not shift when some
+        // other model comes in front
+        std::unordered_map<uint64_t, uint32_t> seen;
+        for (const Crossing& crossing : crossings) {
+            if (crossing.t == selected.t && crossing.id == selected.id)
+                sample->greedy = int(sample->candidates.size());
+            glm::vec3 point = ray.point + crossing.t * ray.dir;
+            sample->candidates.push_back({ point, scene.normal(crossing.id, point), crossing.id });
+            uint64_t surface = (uint64_t(handleType(crossing.id)) << 20 | handleModel(crossing.id)) << 1 |
+                               uint64_t(crossing.entering);
+            sample->layers.push_back(surface << 24 | seen[surface]++);
+        }
+    }
+    return true;
 }
 
-void renderLinesOnSphere(bool intersect, Camera& cam, glm::vec3 hitPos, glm::vec3 hitNormal, glm::mat4 model)
+bool addSurfaceInstance(const SurfaceAnchor& anchor, float size, float distance)
 {
-    glm::vec4 start = glm::vec4(hitPos, 1.0f);
-    glm::vec4 end = glm::vec4(hitPos + hitNormal * 0.5f, 1.0f);
-    start = cam.projection * cam.view * model * start;
-    end = cam.projection * cam.view * model * end;
+    if (stroke_store.size() < 2)
+        return false;
+    SurfaceAnchor placed = anchor;
+    glm::vec3 tempTranslation = distance_fields ? distance_fields->offset(anchor, distance)
+                                                : anchor.point + anchor.normal * distance;
+    // The first point of a stroke joins an existing curve nearby
+    uint32_t snapped;
+    if (snap_strokes && bounding_spheres.size() == stroke_begin &&
+        stroke_index.nearest(tempTranslation, snap_radius, snapped)) {
+        placed = stroke_anchors[snapped];
+        tempTranslation = bounding_spheres.center[snapped];
+    }
 
-    if (intersect)
-    {
-        points.push_back(start.x);
-        points.push_back(start.y);
-        points.push_back(start.z);
-        points.push_back(end.x);
-        points.push_back(end.y);
-        points.push_back(end.z);
-
-        intersected_points.push_back(start.x);
-        intersected_points.push_back(start.y);
-        intersected_points.push_back(start.z);
-        intersected_points.push_back(end.x);
-        intersected_points.push_back(end.y);
-        intersected_points.push_back(end.z);
+    glm::mat4 trans = glm::translate(glm::mat4(1.0f), tempTranslation);
+    glm::mat4 sca = glm::scale(glm::mat4(1.0f), glm::vec3(size, size, size));
+
+    // A point within tolerance of the line through its neighbours moves the last one instead of following it
+    if (bounding_spheres.size() == stroke_begin)
+        point_simplifier.reset();
+    if (simplify_points && !point_simplifier.push(tempTranslation)) {
+        auto last = uint32_t(bounding_spheres.size() - 1);
+        instanceMatrix[last] = trans * sca;
+        bounding_spheres.center[last] = tempTranslation;
+        stroke_anchors[last] = placed;
+        stroke_index.move(last, tempTranslation);
+        return true;
     }
-    std::cout << "Total Points : " << points.size() << std::endl;
+    instanceMatrix.push_back(trans * sca);
+    bounding_spheres.add(STROKE_MODEL, tempTranslation, size * 0.595f);
+    stroke_anchors.push_back(placed);
+    stroke_index.add(tempTranslation);
+    return true;
 }
 
-void addSphereInstance(Ray ray, glm::vec2 t_vals, glm::vec3 origin, float size, float distance)
+void snapStrokeEnd()
 {
-    if (intersected_points.size() < 2)
+    if (!snap_strokes || bounding_spheres.size() < stroke_begin + 2)
         return;
-    bool OnOff = intersectStates[intersectStates.size() - 1];
-    bool prevOnOff = intersectStates[intersectStates.size() - 2];
-    if (OnOff != prevOnOff)
-        switch_front_back *= -1;
-    glm::vec4 pos;
-    if (switch_front_back == 1) {
-        // pos = glm::vec4(ray.get_sample(t_vals[0] - distance), 1.0f);
-        pos = glm::vec4(ray.get_sample(t_vals[0]), 1.0f);
-        glm::vec3 normal = glm::highp_f32vec3(pos.x - origin.x, pos.y - origin.y, pos.z - origin.z);
-        normal = glm::normalize(normal);
-        pos = glm::vec4(normal * distance, 1.0f);
+    auto last = uint32_t(bounding_spheres.size() - 1);
+    uint32_t snapped;
+    if (!stroke_index.nearest(bounding_spheres.center[last], snap_radius, snapped,
+                              [](uint32_t id) { return id < stroke_begin; }))
+        return;
+    glm::vec3 target = bounding_spheres.center[snapped];
+    stroke_anchors[last] = stroke_anchors[snapped];
+    bounding_spheres.center[last] = target;
+    instanceMatrix[last][3] = glm::vec4(target, 1.0f);
+    stroke_index.move(last, target);
+}
+
+void applyStrokeSolution(const StrokeSolution& solution, float size, float hdist)
+{
+    if (solution.generation != stroke_generation)
+        return;
+    int moved = 0;
+    for (const StrokeChoice& choice : solution.path) {
+        // Snapped, dragged or replaced points keep their place
+        if (choice.point >= stroke_anchors.size() || stroke_anchors[choice.point].point != choice.placed.point ||
+            choice.anchor.point == choice.placed.point)
+            continue;
+        stroke_anchors[choice.point] = choice.anchor;
+        moved++;
     }
-    else if (switch_front_back == -1) {
-        // pos = glm::vec4(ray.get_sample(t_vals[1] + distance), 1.0f);
-        pos = glm::vec4(ray.get_sample(t_vals[1]), 1.0f);
-        glm::vec3 normal = glm::highp_f32vec3(pos.x - origin.x, pos.y - origin.y, pos.z - origin.z);
-        normal = glm::normalize(normal);
-        pos = glm::vec4(normal * distance, 1.0f);
+    printf("Stroke solved, %d of %d points changed layer\n", moved, int(solution.path.size()));
+    if (moved > 0)
+        updateSphereInstances(glm::vec3(0.0f), size, hdist);
+}
+
+void erasePoints(glm::vec3 center, float radius)
+{
+    std::vector<uint32_t> ids;
+    stroke_index.radius(center, radius, ids);
+    if (ids.empty())
+        return;
+    std::vector<char> erased(bounding_spheres.size(), 0);
+    for (uint32_t id : ids)
+        erased[id] = 1;
+    size_t kept = 0;
+    std::vector<glm::vec3> positions;
+    for (size_t i = 0; i < bounding_spheres.size(); i++) {
+        if (erased[i])
+            continue;
+        instanceMatrix[kept] = instanceMatrix[i];
+        bounding_spheres.copy(kept, i);
+        stroke_anchors[kept] = stroke_anchors[i];
+        positions.push_back(bounding_spheres.center[i]);
+        kept++;
     }
-    glm::vec3 tempTranslation = pos;
-    glm::quat tempRotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
-    glm::vec3 tempScale = glm::vec3(size, size, size);
+    instanceMatrix.resize(kept);
+    bounding_spheres.resize(kept);
+    stroke_anchors.resize(kept);
+    stroke_index.rebuild(positions);
+    stroke_begin = std::min(stroke_begin, kept);
+    stroke_generation++;
+    hovered_point = -1;
+    dragged_point = -1;
+    printf("Erased %d stroke points, %d left\n", int(ids.size()), int(kept));
+}
 
-    glm::mat4 trans = glm::mat4(1.0f);
-    glm::mat4 rot = glm::mat4(1.0f);
-    glm::mat4 sca = glm::mat4(1.0f);
+glm::mat4 sphereMatrix(glm::vec3 position, float size)
+{
+    glm::mat4 trans = glm::translate(glm::mat4(1.0f), position);
+    glm::mat4 sca = glm::scale(glm::mat4(1.0f), glm::vec3(size, size, size));
+    return trans * sca;
+}
 
-    trans = glm::translate(trans, tempTranslation);
-    rot = glm::mat4_cast(tempRotation);
-    sca = glm::scale(sca, tempScale);
+// The sphere model is loaded once, its instances then come from sphere_instances
+void uploadSphereInstances(const std::vector<glm::mat4>& matrices)
+{
+    if (!spheres) {
+        spheres = new Model(glm::vec3(0.0f), glm::vec3(1.0f), true, 0);
+        spheres->loadModel("uvsphere/uvsphere.obj");
+    }
+    sphere_instances.assign(matrices);
+    spheres->setInstances(sphere_instances.id, sphere_instances.size());
+}
+
+// Tube as thick as the spheres it replaces
+void buildStrokeTube(const std::vector<glm::vec3>& centers, float size)
+{
+    stroke_tube.radius = size * 0.5f;
+    stroke_tube.build(uint32_t(centers.size()), [&centers](uint32_t i) { return centers[i]; });
+    printf("Num of tube triangles %u\n", stroke_tube.triangles());
+}
 
-    instanceMatrix.push_back(trans * rot * sca);
-    bounding_spheres.emplace_back(tempTranslation, size * 0.595f);
+// Curve points in range after an edit, the instance count follows the point count of the curve
+void uploadCurveRange(CurveRange range, float size)
+{
+    std::vector<glm::mat4> matrices;
+    matrices.reserve(range.count);
+    for (int i = range.first; i < range.first + range.count; i++)
+        matrices.push_back(sphereMatrix(curve->at(i), size));
+    sphere_instances.resize(uint32_t(curve->points.size()));
+    sphere_instances.update(uint32_t(range.first), uint32_t(range.count), matrices.data());
+    spheres->setInstances(sphere_instances.id, sphere_instances.size());
 }
 
 void updateSphereInstances(glm::vec3 pos, float size, float hdist)
 {
     auto t_start = std::chrono::high_resolution_clock::now();
-    std::vector<glm::mat4> interpolated_instanceMatrix;
+    std::vector<glm::vec3> positions;
+    if (distance_fields)
+        distance_fields->offsetAll(stroke_anchors, hdist, positions);
+    else
+        for (const auto& anchor : stroke_anchors)
+            positions.push_back(anchor.point + anchor.normal * hdist);
+    stroke_index.rebuild(positions);
     for (unsigned int i = 0; i < instanceMatrix.size(); i++)
     {
-        glm::vec3 tempTranslation = bounding_spheres[i].origin * hdist;
-        glm::quat tempRotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
-        glm::vec3 tempScale = glm::vec3(size, size, size);
-
-        glm::mat4 trans = glm::mat4(1.0f);
-        glm::mat4 rot = glm::mat4(1.0f);
-        glm::mat4 sca = glm::mat4(1.0f);
-
-        trans = glm::translate(trans, tempTranslation);
-        rot = glm::mat4_cast(tempRotation);
-        sca = glm::scale(sca, tempScale);
-
-        instanceMatrix[i] = trans * rot * sca;
+        bounding_spheres.center[i] = positions[i];
+        bounding_spheres.radius[i] = size * 0.595f;
+        instanceMatrix[i] = sphereMatrix(positions[i], size);
     }
     if (useInterpolated)
     {
-        curve = new Curve();
+        if (!curve)
+            curve = new Curve();
         curve->samples = interpolation_samples;
-        for (auto & bounding_sphere : bounding_spheres)
-            curve->add_point(bounding_sphere.origin * hdist);
-
-        for (int i = 0; i < int(curve->points.size()); i++) {
-            glm::vec3 tempTranslation = curve->at(i);
-            glm::quat tempRotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
-            glm::vec3 tempScale = glm::vec3(size, size, size);
-
-            glm::mat4 trans = glm::mat4(1.0f);
-            glm::mat4 rot = glm::mat4(1.0f);
-            glm::mat4 sca = glm::mat4(1.0f);
-
-            trans = glm::translate(trans, tempTranslation);
-            rot = glm::mat4_cast(tempRotation);
-            sca = glm::scale(sca, tempScale);
-
-            interpolated_instanceMatrix.push_back(trans * rot * sca);
-
+        curve->sampling = CurveSampling(curveSampling);
+        curve->spacing = sampling_spacing;
+        CurveFit fit;
+        if (fit_curve && positions.size() > 4 && curve_fitter.fitTolerance(positions, fit_tolerance, fit))
+            curve->control_points = fit.control_points;
+        else
+            curve->control_points = positions;
+        if (gpu_curve) {
+            // Nothing is sampled on the CPU, points are only filled again when something reads them
+            curve_patches.assign(*curve);
+            printf("Num of curve patches %u\n", curve_patches.patches());
+            return;
+        }
+        if (curve->sampling == CurveSampling::Adaptive) {
+            // A pixel at distance d from the eye spans d * 2 tan(fov / 2) / height
+            float pixel = sampling_tolerance * 2.0f * std::tan(glm::radians(fovDeg) * 0.5f) / float(height);
+            curve->rebuildAdaptive([pixel](const glm::vec3& p) {
+                return std::max(pixel * glm::length(p - eye_position), 1e-5f);
+            });
         }
+        else
+            curve->rebuild();
+
+        std::vector<glm::mat4> interpolated_instanceMatrix;
+        interpolated_instanceMatrix.reserve(curve->points.size());
+        for (const auto& point : curve->points)
+            interpolated_instanceMatrix.push_back(sphereMatrix(point, size));
         std::cout << "Num of interpolated spheres" << interpolated_instanceMatrix.size() << std::endl;
-        spheres = new Model(pos, glm::vec3(size * 0.1f), true, interpolated_instanceMatrix.size(),
-                        interpolated_instanceMatrix);
-        spheres->loadModel("uvsphere/uvsphere.obj");
+        uploadSphereInstances(interpolated_instanceMatrix);
+        if (tube_mode)
+            buildStrokeTube(curve->points, size);
     }
     else
     {
         std::cout << "Num of spheres" << instanceMatrix.size() << std::endl;
-        spheres = new Model(pos, glm::vec3(size * 0.1f), true, instanceMatrix.size(), instanceMatrix);
-        spheres->loadModel("uvsphere/uvsphere.obj");
+        uploadSphereInstances(instanceMatrix);
+        if (tube_mode)
+            buildStrokeTube(positions, size);
     }
     auto t_now = std::chrono::high_resolution_clock::now();
     long time = std::chrono::duration_cast<std::chrono::milliseconds>(t_now - t_start).count();
     printf("Time to update the Instances %ld ms\n", time);
-    printf("Current 2D Strokes %d\n", int(points.size()));
+    printf("Current 2D Strokes %u\n", stroke_store.strokes());
 }
 
+// Without fitting the stroke points are the control points of the curve and the edit stays local to the four
+// segments around the point, a fitted curve is fitted again.
+void moveStrokePoint(uint32_t id, const SurfaceAnchor& anchor, float size, float hdist)
+{
+    if (id >= stroke_anchors.size())
+        return;
+    stroke_anchors[id] = anchor;
+    glm::vec3 position = distance_fields ? distance_fields->offset(anchor, hdist) : anchor.point + anchor.normal * hdist;
+    bounding_spheres.center[id] = position;
+    stroke_index.move(id, position);
+    instanceMatrix[id] = sphereMatrix(position, size);
+    if (!spheres && !(useInterpolated && gpu_curve))
+        return;
+    if (!useInterpolated) {
+        if (id < sphere_instances.size())
+            sphere_instances.update(id, 1, &instanceMatrix[id]);
+        if (tube_mode)
+            stroke_tube.build(uint32_t(bounding_spheres.size()), [](uint32_t i) { return bounding_spheres.center[i]; });
+    }
+    else if (curve && !fit_curve && curve->control_points.size() == instanceMatrix.size() && gpu_curve) {
+        curve->control_points[id] = position;
+        curve_patches.updatePoint(int(id), position);
+    }
+    else if (curve && !fit_curve && curve->control_points.size() == instanceMatrix.size()) {
+        uploadCurveRange(curve->move(int(id), position), size);
+        if (tube_mode)
+            stroke_tube.build(uint32_t(curve->points.size()), [](uint32_t i) { return curve->points[i]; });
+    }
+    else
+        updateSphereInstances(glm::vec3(0.0f), size, hdist);
+}
 
 void replayCamWithDrawing(Camera& cam)
 {
-    if (curve->points.empty())
+    if (gpu_curve && curve)
+        curve->rebuild();
+    if (!curve || curve->points.empty())
     {
         std::cout << "Empty Curve" << std::endl;
         return;
     }
-    cam.positions.clear();
-    cam.orientations.clear();
-
-    detailed_curve = new Curve();
-    detailed_curve->samples = 35;
-    for (int i = 0; i < int(curve->points.size()); i++)
-        detailed_curve->add_point(curve->at(i));
-
-    int N = 10;
-    for (int i = N; i < int(detailed_curve->points.size() - N); i++) {
-        auto currPos = detailed_curve->at(i);
-        auto nextPos = detailed_curve->at(i + 1);
-
-        glm::vec3 avg_orientation = glm::normalize(nextPos - currPos);
-        glm::vec3 avg_pos = currPos;
-        for (int j = -N; j < N - 1; j++) {
-            avg_orientation += glm::normalize(detailed_curve->at(i - j) - detailed_curve->at(j));
-            avg_pos += detailed_curve->at(j);
-        }
-        avg_orientation /= float(N);
-        avg_pos /= float(N);
+    camera_path.up = cam.U;
+    camera_path.fromCurve(curve->points, 1.0f);
+    printf("Camera path of %u keys, %.1f s\n", camera_path.size(), camera_path.duration());
+}
 
-        if (!glm::any(glm::isnan(avg_pos)) or !glm::any(glm::isnan(avg_orientation))) {
-            cam.positions.push_back(avg_pos);
-            cam.orientations.push_back(glm::normalize(avg_orientation));
+bool exportObj(const std::string& path, const std::vector<const WorldVertexCache*>& models)
+{
+    FILE* file = std::fopen(path.c_str(), "w");
+    if (!file)
+        return false;
+    uint32_t base = 1; // OBJ indices are global and start at 1
+    for (size_t m = 0; m < models.size(); m++) {
+        const WorldVertexCache& cache = *models[m];
+        std::fprintf(file, "o model%d\n", int(m));
+        for (uint32_t v = 0; v < cache.size(); v++)
+            std::fprintf(file, "v %f %f %f\n", cache.px[v], cache.py[v], cache.pz[v]);
+        for (uint32_t v = 0; v < cache.size(); v++)
+            std::fprintf(file, "vn %f %f %f\n", cache.nx[v], cache.ny[v], cache.nz[v]);
+        const auto& meshes = cache.source().getMeshes();
+        for (size_t i = 0; i < meshes.size(); i++) {
+            uint32_t first = base + cache.meshBase[i];
+            const auto& indices = meshes[i].indices;
+            for (size_t f = 0; f + 2 < indices.size(); f += 3)
+                std::fprintf(file, "f %u//%u %u//%u %u//%u\n", first + indices[f], first + indices[f],
+                             first + indices[f + 1], first + indices[f + 1], first + indices[f + 2], first + indices[f + 2]);
         }
+        base += cache.size();
     }
-}
\ No newline at end of file
+    std::fprintf(file, "o strokes\n");
+    for (const auto& center : bounding_spheres.center)
+        std::fprintf(file, "v %f %f %f\n", center.x, center.y, center.z);
+    for (size_t i = 0; i < bounding_spheres.size(); i++)
+        std::fprintf(file, "p %u\n", base + uint32_t(i));
+    return std::fclose(file) == 0;
+}
@@ -137,6 +137,11 @@ void LinkedShader::SetMat4(const std::string& name, glm::mat4 value)
     glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, glm::value_ptr(value));
 }
 
+void LinkedShader::SetVec2(const std::string& name, glm::vec2 value)
+{
+    glUniform2f(glGetUniformLocation(ID, name.c_str()), value.x, value.y);
+}
+
 void LinkedShader::SetVec3(const std::string& name, glm::vec3 value)
 {
     glUniform3f(glGetUniformLocation(ID, name.c_str()), value.x, value.y, value.z);